@@ -15,6 +15,7 @@ extern "C" {
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <time.h>
 
 enum syspower_sleep_type {
 	SYSPOWER_SLEEP_TYPE_FREEZE,
@@ -75,84 +76,1271 @@ enum syspower_supply_health {
 	SYSPOWER_SUPPLY_HEALTH_NOBAT,
 };
 
+#define SYSPOWER_RESIDENCY_DAYS 7
+
+struct syspower_residency {
+	uint64_t suspended_ms; /* time suspended (BOOTTIME - MONOTONIC) */
+	uint64_t awake_ms;
+	uint64_t hw_sleep_ms; /* suspend_stats/total_hw_sleep, if supported */
+	uint64_t suspend_count; /* suspend_stats/success */
+};
+
+/**
+ * @brief Enable system autosleep.
+ * @param type Sleep type (cf syspower_sleep_type enum)
+ * @return 0 on success, negative value on error.
+ */
+int syspower_autosleep_enable(enum syspower_sleep_type type);
+
+/**
+ * @brief Disable system autosleep.
+ * @return 0 on success, negative value on error.
+ */
+int syspower_autosleep_disable(void);
+
+/**
+ * @brief Create a new wake-lock, preventing system to autosleep.
+ * @param name Name of the lock.
+ * @param timeout_ms Auto release the lock after timeou_ms (if different from 0).
+ * @return 0 on success, negative value on error.
+ */
+int syspower_wake_lock(const char *name, unsigned int timeout_ms);
+
+/**
+ * @brief Release a wake-lock.
+ * @param name Name of the lock.
+ * @return 0 on success, negative value on error.
+ */
+int syspower_wake_unlock(const char *name);
+
+#define SYSPOWER_WAKE_LOCK_LIST_SIZE 4096
+#define SYSPOWER_WAKE_LOCK_LIST_MAX 256
+
+struct syspower_wake_lock_list {
+	char buf[SYSPOWER_WAKE_LOCK_LIST_SIZE];
+	const char *names[SYSPOWER_WAKE_LOCK_LIST_MAX]; /* sorted, point in buf */
+	unsigned int count;
+};
+
+struct syspower_wake_lock_diff {
+	struct syspower_wake_lock_list list[2]; /* previous and current */
+	unsigned int cur;
+	const char *acquired[SYSPOWER_WAKE_LOCK_LIST_MAX];
+	unsigned int acquired_count;
+	const char *released[SYSPOWER_WAKE_LOCK_LIST_MAX];
+	unsigned int released_count;
+};
+
+/**
+ * @brief Retrieve active wake-locks (from /sys/power/wake_lock).
+ * @param list Pointer to the caller list to parse in, no allocation is done.
+ * @return number of active locks on success, negative value on error.
+ */
+int syspower_wake_lock_list(struct syspower_wake_lock_list *list);
+
+/**
+ * @brief Retrieve inactive wake-locks (from /sys/power/wake_unlock).
+ * @param list Pointer to the caller list to parse in, no allocation is done.
+ * @return number of inactive locks on success, negative value on error.
+ */
+int syspower_wake_unlock_list(struct syspower_wake_lock_list *list);
+
+/**
+ * @brief Retrieve wake-locks acquired and released since previous call.
+ * The diff struct must be zeroed before first call, names remain valid until
+ * the next call.
+ * @param diff Pointer to the caller diff state.
+ * @return number of changes on success, negative value on error.
+ */
+int syspower_wake_lock_diff(struct syspower_wake_lock_diff *diff);
+
+struct syspower_wakelock;
+
+/**
+ * @brief Create a wake-lock handle, with in-process refcounting.
+ * Only the first acquisition and the last release reach the kernel.
+ * @param name Name of the lock (no whitespace).
+ * @return wake-lock handle, NULL on error (errno is set).
+ */
+struct syspower_wakelock *syspower_wakelock_create(const char *name);
+
+/**
+ * @brief Destroy a wake-lock handle, releasing the lock if held.
+ * @param wl wake-lock handle.
+ */
+void syspower_wakelock_destroy(struct syspower_wakelock *wl);
+
+/**
+ * @brief Retrieve wake-lock handle name.
+ * @param wl wake-lock handle.
+ * @return lock name.
+ */
+const char *syspower_wakelock_name(struct syspower_wakelock *wl);
+
+/**
+ * @brief Take a reference on the wake-lock, preventing system to autosleep.
+ * Returns once the kernel lock is held, no reference is taken on error.
+ * @param wl wake-lock handle.
+ * @return 0 on success, negative value on error.
+ */
+int syspower_wakelock_acquire(struct syspower_wakelock *wl);
+
+/**
+ * @brief Hold the wake-lock for at least timeout_ms, without reference.
+ * @param wl wake-lock handle.
+ * @param timeout_ms lock duration.
+ * @return 0 on success, negative value on error.
+ */
+int syspower_wakelock_acquire_timeout(struct syspower_wakelock *wl,
+				      unsigned int timeout_ms);
+
+/**
+ * @brief Drop a reference on the wake-lock.
+ * @param wl wake-lock handle.
+ * @return 0 on success, negative value on error.
+ */
+int syspower_wakelock_release(struct syspower_wakelock *wl);
+
+#define SYSPOWER_WAKELOCK_HIST_BUCKETS 16
+
+struct syspower_wakelock_stats {
+	const char *name;
+	uint64_t acquire_count;
+	uint64_t current_hold_ms; /* 0 if not held */
+	uint64_t total_hold_ms; /* including current hold */
+	uint64_t max_hold_ms;
+	uint64_t hist[SYSPOWER_WAKELOCK_HIST_BUCKETS]; /* bucket n: holds < 2^n ms */
+};
+
+/**
+ * @brief Retrieve wake-lock statistics by index.
+ * Statistics are per lock name, and collected in-process.
+ * @param index index of the lock.
+ * @param stats Pointer to the stats struct to write in.
+ * @return 0 on success, -ENOENT if index is out of range.
+ */
+int syspower_wakelock_stats_get(unsigned int index,
+				struct syspower_wakelock_stats *stats);
+
+/**
+ * @brief Retrieve wake-lock statistics by name.
+ * @param name Name of the lock.
+ * @param stats Pointer to the stats struct to write in.
+ * @return 0 on success, negative value on error.
+ */
+int syspower_wakelock_stats_lookup(const char *name,
+				   struct syspower_wakelock_stats *stats);
+
+struct syspower_broker_client {
+	int pid;
+	unsigned int uid;
+	char name[65];
+	uint64_t held_ms;
+};
+
+/**
+ * @brief Take a wake-lock through the broker daemon.
+ * The lock is held until the returned socket is closed, including on crash.
+ * @param path broker socket path, NULL for default.
+ * @param name Name of the lock (accounting only, up to 64 chars).
+ * @return socket file descriptor on success, negative value on error.
+ */
+int syspower_broker_lock(const char *path, const char *name);
+
+/**
+ * @brief Release a brokered wake-lock.
+ * @param fd socket returned by syspower_broker_lock.
+ */
+void syspower_broker_unlock(int fd);
+
+/**
+ * @brief Retrieve broker clients currently holding a lock.
+ * @param path broker socket path, NULL for default.
+ * @param cb callback called for each client.
+ * @param data callback private data.
+ * @return 0 on success, negative value on error.
+ */
+int syspower_broker_clients(const char *path,
+			    void (*cb)(const struct syspower_broker_client *client,
+				       void *data),
+			    void *data);
+
+/**
+ * @brief Retrieve wake-lock statistics of the broker process.
+ * @param path broker socket path, NULL for default.
+ * @param cb callback called for each lock name (stats only valid during call).
+ * @param data callback private data.
+ * @return 0 on success, negative value on error.
+ */
+int syspower_broker_wakelock_stats(const char *path,
+				   void (*cb)(const struct syspower_wakelock_stats *stats,
+					      void *data),
+				   void *data);
+
+/**
+ * @brief Run the wake-lock broker daemon loop, aggregating all client locks
+ * into a single kernel wake-lock.
+ * @param path broker socket path, NULL for default.
+ * @return negative value on error (does not return otherwise).
+ */
+int syspower_broker_run(const char *path);
+
+/**
+ * @brief Enter system wide suspend state.
+ * @param type Sleep type (cf syspower_sleep_type enum)
+ * @return 0 on success, negative value on error.
+ */
+int syspower_suspend(enum syspower_sleep_type type);
+
+/**
+ * @brief Configure RTC wake alarm.
+ * @param seconds Schedule RTC wakeup in seconds from now, or 0 to disable.
+ * @param wait Block until alarm.
+ * @return 0 on success, negative value on error.
+ */
+int syspower_rtc_wakealarm(unsigned int seconds, bool wait);
+
+/**
+ * @brief Configure RTC wake alarm at an absolute time (RTC_WKALM_SET).
+ * @param when Alarm time in seconds since the Epoch (UTC), or 0 to disable.
+ * @param wait Block until alarm.
+ * @return 0 on success, negative value on error.
+ */
+int syspower_rtc_wakealarm_at(time_t when, bool wait);
+
+/**
+ * @brief Retrieve RTC alarm file descriptor for polling (POLLIN on alarm).
+ * @return file descriptor or negative error code.
+ */
+int syspower_rtc_get_alarmfd(void);
+
+/**
+ * @brief Acknowledge RTC alarm event, does not block.
+ * @param fd file descriptor of the RTC alarm.
+ * @return 0 if alarm fired, -EAGAIN if not, other negative value on error.
+ */
+int syspower_rtc_read_alarmfd(int fd);
+
+/**
+ * @brief Wait for the RTC alarm.
+ * All the waits in progress complete on alarm, also when it is acknowledged
+ * through syspower_rtc_read_alarmfd() on the RTC alarm fd.
+ * @param timeout_ms timeout in milliseconds, -1 to wait forever.
+ * @return 0 on alarm, -ETIMEDOUT, -ECANCELED if cancelled, negative value on error.
+ */
+int syspower_rtc_alarm_wait(int timeout_ms);
+
+/**
+ * @brief Disarm the RTC alarm and wake up all waiters with -ECANCELED.
+ * @return 0 on success, negative value on error.
+ */
+int syspower_rtc_alarm_cancel(void);
+
+/**
+ * @brief Retrieve RTC time.
+ * @param now Pointer to write RTC time in, seconds since the Epoch (UTC).
+ * @return 0 on success, negative value on error.
+ */
+int syspower_rtc_time(time_t *now);
+
+/**
+ * @brief Create a wake alarm timer (CLOCK_BOOTTIME_ALARM timerfd).
+ * Requires CAP_WAKE_ALARM, the returned fd is pollable and readable on expiry.
+ * @return file descriptor on success, negative value on error.
+ */
+int syspower_alarm_timer_open(void);
+
+/**
+ * @brief Arm wake alarm timer, relative to now.
+ * @param fd alarm timer file descriptor.
+ * @param delay_ms delay in milliseconds, or 0 to disarm.
+ * @return 0 on success, negative value on error.
+ */
+int syspower_alarm_timer_set(int fd, uint64_t delay_ms);
+
+/**
+ * @brief Arm wake alarm timer at an absolute CLOCK_BOOTTIME time.
+ * @param fd alarm timer file descriptor.
+ * @param boottime_ms expiry in milliseconds of CLOCK_BOOTTIME.
+ * @return 0 on success, negative value on error.
+ */
+int syspower_alarm_timer_set_abs(int fd, uint64_t boottime_ms);
+
+/**
+ * @brief Release wake alarm timer.
+ * @param fd alarm timer file descriptor.
+ */
+void syspower_alarm_timer_close(int fd);
+
+enum syspower_alarm_backend {
+	SYSPOWER_ALARM_BACKEND_RTC, /* /dev/rtc, second resolution */
+	SYSPOWER_ALARM_BACKEND_TIMER, /* CLOCK_BOOTTIME_ALARM timerfd */
+	SYSPOWER_ALARM_BACKEND_MAX
+};
+
+struct syspower_alarm_sched;
+
+/**
+ * @brief Create a wake alarm scheduler, multiplexing named alarms over the
+ * single backend alarm.
+ * @param backend alarm backend to program.
+ * @param slack_ms Coalescing window, an alarm may be delayed up to slack_ms.
+ * @return scheduler, NULL on error (errno is set).
+ */
+struct syspower_alarm_sched *syspower_alarm_sched_create(enum syspower_alarm_backend backend,
+							 unsigned int slack_ms);
+
+/**
+ * @brief Destroy wake alarm scheduler, pending alarms are dropped.
+ * @param s scheduler.
+ */
+void syspower_alarm_sched_destroy(struct syspower_alarm_sched *s);
+
+/**
+ * @brief Change the coalescing window.
+ * @param s scheduler.
+ * @param slack_ms Coalescing window.
+ */
+void syspower_alarm_sched_set_slack(struct syspower_alarm_sched *s,
+				    unsigned int slack_ms);
+
+/**
+ * @brief Schedule (or reschedule) a named one-shot alarm.
+ * @param s scheduler.
+ * @param name alarm name.
+ * @param delay_ms delay from now (CLOCK_BOOTTIME).
+ * @param cb callback, run from syspower_alarm_sched_dispatch.
+ * @param data callback private data.
+ * @return 0 on success, negative value on error.
+ */
+int syspower_alarm_sched_add(struct syspower_alarm_sched *s, const char *name,
+			     uint64_t delay_ms,
+			     void (*cb)(const char *name, void *data), void *data);
+
+/**
+ * @brief Cancel a named alarm.
+ * @param s scheduler.
+ * @param name alarm name.
+ * @return 0 on success, negative value on error.
+ */
+int syspower_alarm_sched_remove(struct syspower_alarm_sched *s, const char *name);
+
+/**
+ * @brief Run callbacks of expired alarms and reprogram the backend.
+ * To be called on resume or when the scheduler fd is readable.
+ * @param s scheduler.
+ * @return number of dispatched alarms, negative value on error.
+ */
+int syspower_alarm_sched_dispatch(struct syspower_alarm_sched *s);
+
+/**
+ * @brief Retrieve scheduler backend file descriptor for polling.
+ * @param s scheduler.
+ * @return file descriptor or negative error code.
+ */
+int syspower_alarm_sched_fd(struct syspower_alarm_sched *s);
+
+/**
+ * @brief Retrieve time until the programmed backend alarm.
+ * @param s scheduler.
+ * @return delay in ms, -1 if no alarm is pending.
+ */
+int64_t syspower_alarm_sched_next(struct syspower_alarm_sched *s);
+
+/**
+ * @brief Retrieve latest wakeup reason (reason string and interrupt index).
+ * @param reason Pointer to the reason buffer to write in (usually filled with interrupt name).
+ * @param reason_len The reason string buffer size.
+ * @return IRQ index on success, negative value on error.
+ */
+int syspower_wakeup_reason(char *reason, size_t reason_len);
+
+/**
+ * @brief Retrieve wakeup capable device name by index.
+ * @param index index of the device.
+ * @return device name.
+ */
+const char *syspower_wakeup_get(unsigned int index);
+
+/**
+ * @brief Check if wakeup is enabled for the given device.
+ * @param device name.
+ * @return true if wakeup is enabled, false otherwise.
+ */
+bool syspower_wakeup_enabled(const char *devname);
+
+/**
+ * @brief Enable wakeup for the given device.
+ * @param device name.
+ * @return 0 on success, negative value on error.
+ */
+int syspower_wakeup_enable(const char *devname);
+
+/**
+ * @brief Disable wakeup for the given device.
+ * @param device name.
+ * @return 0 on success, negative value on error.
+ */
+int syspower_wakeup_disable(const char *devname);
+
+/**
+ * @brief Open (create if needed) the shared suspend residency accounting.
+ * @param path Path of the shared accounting file, NULL for default.
+ * @return 0 on success, negative value on error.
+ */
+int syspower_residency_open(const char *path);
+
+/**
+ * @brief Close the shared suspend residency accounting.
+ */
+void syspower_residency_close(void);
+
+/**
+ * @brief Account time spent suspended/awake since the previous update.
+ * Automatically called around syspower_suspend().
+ * @return 0 on success, negative value on error.
+ */
+int syspower_residency_update(void);
+
+/**
+ * @brief Retrieve residency for a given day.
+ * @param day Day index, 0 for today, up to SYSPOWER_RESIDENCY_DAYS - 1.
+ * @param res Pointer to the residency struct to write in.
+ * @return 0 on success, negative value on error.
+ */
+int syspower_residency_get(unsigned int day, struct syspower_residency *res);
+
+/**
+ * @brief Retrieve residency over the last SYSPOWER_RESIDENCY_DAYS days.
+ * @param res Pointer to the residency struct to write in.
+ * @return 0 on success, negative value on error.
+ */
+int syspower_residency_total(struct syspower_residency *res);
+
+/**
+ * @brief Retrieve time spent suspended over the last SYSPOWER_RESIDENCY_DAYS days.
+ * @return percentage from 0 to 100, negative value on error.
+ */
+int syspower_residency_percent(void);
+
+enum syspower_rpm_status {
+	SYSPOWER_RPM_STATUS_UNKNOWN,
+	SYSPOWER_RPM_STATUS_ACTIVE,
+	SYSPOWER_RPM_STATUS_SUSPENDED,
+	SYSPOWER_RPM_STATUS_SUSPENDING,
+	SYSPOWER_RPM_STATUS_RESUMING,
+	SYSPOWER_RPM_STATUS_ERROR,
+};
+
+struct syspower_rpm_device {
+	const char *name;
+	const char *bus; /* subsystem (usb, pci, i2c...) */
+	const char *devpath;
+	enum syspower_rpm_status status;
+	bool autosuspend; /* power/control is auto */
+	int autosuspend_delay_ms; /* -1 if not supported */
+	uint64_t active_ms; /* runtime_active_time */
+	uint64_t suspended_ms; /* runtime_suspended_time */
+	uint64_t delta_active_ms; /* since previous sample */
+	uint64_t delta_suspended_ms;
+	unsigned int suspended_permille; /* suspended time ratio */
+};
+
+/**
+ * @brief (Re)discover runtime PM capable devices.
+ * Done implicitly on first use, status and time attributes are kept open.
+ * @return number of devices, negative value if some could not be opened
+ * (e.g. -EMFILE), the devices opened successfully being still available.
+ */
+int syspower_rpm_scan(void);
+
+/**
+ * @brief Sample runtime PM status and times of all devices, in one batch.
+ * @return number of devices.
+ */
+int syspower_rpm_sample(void);
+
+/**
+ * @brief Retrieve runtime PM device by index, as of the latest sample.
+ * @param index index of the device.
+ * @return device, NULL if index is out of range.
+ */
+const struct syspower_rpm_device *syspower_rpm_get(unsigned int index);
+
+/**
+ * @brief Apply runtime PM policy to all devices of a bus, skipping unchanged.
+ * @param bus bus/subsystem name (e.g. "usb"), or NULL for all devices.
+ * @param autosuspend enable (auto) or disable (on) runtime autosuspend.
+ * @param delay_ms autosuspend delay, or negative value to keep it unchanged.
+ * @return number of attributes written, negative value on error.
+ */
+int syspower_rpm_apply(const char *bus, bool autosuspend, int delay_ms);
+
+/**
+ * @brief Retrieve runtime PM status string.
+ * @param status runtime PM status.
+ * @return status string.
+ */
+const char *syspower_rpm_status_str(enum syspower_rpm_status status);
+
+/**
+ * @brief Release runtime PM device cache.
+ */
+void syspower_rpm_release(void);
+
+struct syspower_qos_request;
+
+/**
+ * @brief Request a CPU wakeup latency constraint (/dev/cpu_dma_latency).
+ * Requests are merged in-process, the strictest one applies.
+ * @param latency_us maximum wakeup latency in microseconds.
+ * @return request handle, NULL on error (errno is set).
+ */
+struct syspower_qos_request *syspower_qos_cpu_latency_request(int32_t latency_us);
+
+/**
+ * @brief Request a device resume latency constraint
+ * (power/pm_qos_resume_latency_us).
+ * The device initial constraint is restored when the last request is removed.
+ * @param devpath sysfs path of the device.
+ * @param latency_us maximum resume latency in microseconds.
+ * @return request handle, NULL on error (errno is set).
+ */
+struct syspower_qos_request *syspower_qos_resume_latency_request(const char *devpath,
+								int32_t latency_us);
+
+/**
+ * @brief Update a latency request, the kernel is only written if the
+ * effective constraint changes.
+ * @param req request handle.
+ * @param latency_us maximum latency in microseconds.
+ * @return 0 on success, negative value on error.
+ */
+int syspower_qos_request_update(struct syspower_qos_request *req,
+				int32_t latency_us);
+
+/**
+ * @brief Remove a latency request.
+ * @param req request handle.
+ */
+void syspower_qos_request_remove(struct syspower_qos_request *req);
+
+/**
+ * @brief Retrieve effective in-process CPU latency constraint.
+ * @return latency in microseconds, INT32_MAX if none, -1 if no request.
+ */
+int32_t syspower_qos_cpu_latency(void);
+
+#define SYSPOWER_CPUFREQ_MAX_STATES 64
+
+struct syspower_cpufreq;
+
+struct syspower_cpufreq_policy {
+	char name[16]; /* policyX */
+	unsigned int first_cpu;
+	unsigned int cpu_count; /* related_cpus */
+	uint32_t cur_khz;
+	uint32_t min_khz; /* scaling_min_freq */
+	uint32_t max_khz; /* scaling_max_freq */
+	uint32_t hw_min_khz; /* cpuinfo_min_freq */
+	uint32_t hw_max_khz;
+	unsigned int nr_states; /* 0 if stats are not available */
+	uint32_t state_khz[SYSPOWER_CPUFREQ_MAX_STATES];
+	uint64_t time_in_state_ms[SYSPOWER_CPUFREQ_MAX_STATES];
+	uint64_t delta_ms[SYSPOWER_CPUFREQ_MAX_STATES]; /* since previous sample */
+};
+
+/**
+ * @brief Discover cpufreq policies, attributes are kept open.
+ * @param path cpufreq sysfs directory, NULL for default.
+ * @return cpufreq handle, NULL on error (errno is set).
+ */
+struct syspower_cpufreq *syspower_cpufreq_open(const char *path);
+
+/**
+ * @brief Release cpufreq handle.
+ * @param cf cpufreq handle.
+ */
+void syspower_cpufreq_close(struct syspower_cpufreq *cf);
+
+/**
+ * @brief Retrieve number of cpufreq policies.
+ * @param cf cpufreq handle.
+ * @return number of policies, ordered by first CPU.
+ */
+unsigned int syspower_cpufreq_count(struct syspower_cpufreq *cf);
+
+/**
+ * @brief Retrieve cpufreq policy by index, as of the latest sample.
+ * @param cf cpufreq handle.
+ * @param index index of the policy.
+ * @return policy, NULL if index is out of range.
+ */
+const struct syspower_cpufreq_policy *syspower_cpufreq_get(struct syspower_cpufreq *cf,
+							   unsigned int index);
+
+/**
+ * @brief Sample frequencies and time in state of all policies, in one batch.
+ * @param cf cpufreq handle.
+ * @return 0 on success, negative value on error.
+ */
+int syspower_cpufreq_sample(struct syspower_cpufreq *cf);
+
+/**
+ * @brief Set policy maximum frequency, skipped if unchanged.
+ * The cap is compared with the last one written through this handle, as
+ * scaling_max_freq reads back the effective (e.g. thermally clamped) limit.
+ * @param cf cpufreq handle.
+ * @param index index of the policy.
+ * @param max_khz maximum frequency in kHz.
+ * @return 1 if written, 0 if unchanged, negative value on error.
+ */
+int syspower_cpufreq_set_max(struct syspower_cpufreq *cf, unsigned int index,
+			     uint32_t max_khz);
+
+/**
+ * @brief Set maximum frequency of all policies, skipping unchanged ones.
+ * @param cf cpufreq handle.
+ * @param max_khz array of syspower_cpufreq_count() caps, 0 to leave as is.
+ * @return number of policies written, negative value on error.
+ */
+int syspower_cpufreq_set_max_all(struct syspower_cpufreq *cf,
+				 const uint32_t *max_khz);
+
+struct syspower_cpuidle;
+
+struct syspower_cpuidle_state {
+	unsigned int cpu;
+	unsigned int index; /* stateX */
+	char name[16];
+	uint32_t latency_us; /* exit latency */
+	uint64_t usage; /* number of entries */
+	uint64_t time_us; /* residency */
+	uint64_t delta_usage; /* since previous sample */
+	uint64_t delta_time_us;
+	unsigned int residency_permille; /* of time elapsed since previous sample */
+};
+
+/**
+ * @brief Discover cpuidle states of all CPUs, attributes are kept open
+ * (two fds per state).
+ * @param path cpu sysfs directory, NULL for default.
+ * @return cpuidle handle, NULL on error (errno is set).
+ */
+struct syspower_cpuidle *syspower_cpuidle_open(const char *path);
+
+/**
+ * @brief Release cpuidle handle.
+ * @param ci cpuidle handle.
+ */
+void syspower_cpuidle_close(struct syspower_cpuidle *ci);
+
+/**
+ * @brief Retrieve number of cpuidle states, all CPUs included.
+ * @param ci cpuidle handle.
+ * @return number of states, ordered by CPU then state index.
+ */
+unsigned int syspower_cpuidle_count(struct syspower_cpuidle *ci);
+
+/**
+ * @brief Retrieve cpuidle state by index, as of the latest sample.
+ * @param ci cpuidle handle.
+ * @param index index of the state.
+ * @return state, NULL if index is out of range.
+ */
+const struct syspower_cpuidle_state *syspower_cpuidle_get(struct syspower_cpuidle *ci,
+							  unsigned int index);
+
+/**
+ * @brief Sample usage and residency of all states, in one batch.
+ * @param ci cpuidle handle.
+ * @return 0 on success, negative value on error.
+ */
+int syspower_cpuidle_sample(struct syspower_cpuidle *ci);
+
+/**
+ * @brief Retrieve time elapsed between the two latest samples.
+ * @param ci cpuidle handle.
+ * @return elapsed time in microseconds, 0 before the second sample.
+ */
+uint64_t syspower_cpuidle_elapsed_us(struct syspower_cpuidle *ci);
+
+#define SYSPOWER_EVENT_LISTENERS_MAX 16
+
+enum syspower_event_type {
+	SYSPOWER_EVENT_SUPPLY, /* power_supply uevent */
+	SYSPOWER_EVENT_THERMAL_TRIP, /* trip point crossed, either way */
+	SYSPOWER_EVENT_ANOMALY, /* value above its baseline threshold */
+	SYSPOWER_EVENT_SUSPEND, /* value 1 on entry, 0 on exit, index is the type */
+	SYSPOWER_EVENT_WAKEUP, /* wakeup reason as name, irq as value */
+	/*
+	 * value 1 on acquire, 0 on release, threshold numbers the transitions
+	 * of the name: events may be delivered late, older ones are stale.
+	 */
+	SYSPOWER_EVENT_WAKELOCK,
+	SYSPOWER_EVENT_ALARM, /* alarm dispatched */
+	SYSPOWER_EVENT_MAX
+};
+
+#define SYSPOWER_EVENT_MASK(type) (1U << (type))
+#define SYSPOWER_EVENT_MASK_ALL (~0U)
+
+struct syspower_event {
+	enum syspower_event_type type;
+	const char *name; /* source: supply, thermal zone... */
+	int index; /* source specific, e.g. trip point index */
+	int64_t value; /* e.g. temperature in millidegree Celsius */
+	int64_t threshold; /* e.g. trip temperature, value >= threshold if rising */
+	uint64_t timestamp_ns; /* CLOCK_BOOTTIME */
+};
+
+typedef void (*syspower_event_cb_t)(const struct syspower_event *ev, void *data);
+
+/**
+ * @brief Register a library event listener.
+ * Callbacks are run from the thread emitting the event (e.g. the one
+ * dispatching the monitor fd), and may (un)register listeners.
+ * @param mask SYSPOWER_EVENT_MASK() of the event types to receive.
+ * @param cb event callback.
+ * @param data callback private data.
+ * @return 0 on success, negative value on error.
+ */
+int syspower_event_register(unsigned int mask, syspower_event_cb_t cb, void *data);
+
+/**
+ * @brief Unregister a library event listener.
+ * Waits for the callbacks in progress on other threads, the callback data can
+ * be released on return. When called from an event callback, it does not
+ * wait, other threads may still be running the callback.
+ * @param cb event callback.
+ * @param data callback private data.
+ * @return 0 on success, negative value on error.
+ */
+int syspower_event_unregister(syspower_event_cb_t cb, void *data);
+
+/**
+ * @brief Retrieve event type string.
+ * @param type event type.
+ * @return type string.
+ */
+const char *syspower_event_type_str(enum syspower_event_type type);
+
+/**
+ * @brief Start exporting library events to a trace file.
+ * Events are written in Chrome JSON trace format (Perfetto UI,
+ * chrome://tracing), buffered in memory and written out when the buffer is
+ * full or on syspower_trace_flush().
+ * @param path trace file path, truncated if existing.
+ * @return 0 on success, -EBUSY if already tracing, negative value on error.
+ */
+int syspower_trace_start(const char *path);
+
+/**
+ * @brief Write out buffered trace events.
+ * @return 0 on success, negative value on error.
+ */
+int syspower_trace_flush(void);
+
+/**
+ * @brief Stop exporting events, complete and close the trace file.
+ * @return 0 on success, negative value on error (e.g. a previous write).
+ */
+int syspower_trace_stop(void);
+
+#define SYSPOWER_THERMAL_TRIPS_MAX 12
+
+struct syspower_thermal_zone {
+	char name[32]; /* thermal_zoneX */
+	char type[32];
+	int temp_mc; /* millidegree Celsius */
+	unsigned int nr_trips;
+	int trip_mc[SYSPOWER_THERMAL_TRIPS_MAX];
+	char trip_type[SYSPOWER_THERMAL_TRIPS_MAX][16]; /* critical, hot, passive... */
+};
+
+struct syspower_thermal_cdev {
+	char name[32]; /* cooling_deviceX */
+	char type[32];
+	unsigned long cur_state;
+	unsigned long max_state;
+};
+
+/**
+ * @brief (Re)discover thermal zones and cooling devices.
+ * Temperature and cooling state attributes are kept open.
+ * @param path thermal sysfs class directory, NULL for default.
+ * @return number of thermal zones, negative value on error.
+ */
+int syspower_thermal_scan(const char *path);
+
+/**
+ * @brief Sample all thermal zones and cooling devices, in one batch.
+ * Trip point crossings since the previous sample are reported as
+ * SYSPOWER_EVENT_THERMAL_TRIP events.
+ * @return number of thermal zones.
+ */
+int syspower_thermal_sample(void);
+
+/**
+ * @brief Retrieve thermal zone by index, as of the latest sample.
+ * @param index index of the zone.
+ * @return zone, NULL if index is out of range.
+ */
+const struct syspower_thermal_zone *syspower_thermal_zone_get(unsigned int index);
+
+/**
+ * @brief Retrieve cooling device by index, as of the latest sample.
+ * @param index index of the cooling device.
+ * @return cooling device, NULL if index is out of range.
+ */
+const struct syspower_thermal_cdev *syspower_thermal_cdev_get(unsigned int index);
+
+/**
+ * @brief Release thermal zones and cooling devices.
+ */
+void syspower_thermal_release(void);
+
+/**
+ * @brief Retrieve thermal monitoring file descriptor for polling.
+ * This is the same monitor as the power supply one, thermal uevents resample
+ * the related zone, use syspower_monitor_dispatch() to process them.
+ * @return file descriptor or negative error code.
+ */
+int syspower_thermal_get_monitorfd(void);
+
+/**
+ * @brief Release thermal monitor file descriptor.
+ * @param fd file descriptor of the thermal monitor
+ */
+void syspower_thermal_put_monitorfd(int fd);
+
+#define SYSPOWER_ENERGY_HISTORY 64
+
+struct syspower_energy {
+	uint64_t energy_uj; /* monotonic accumulated energy */
+	uint64_t raw_uj; /* latest raw counter value */
+	uint64_t range_uj; /* counter wrap-around range, 0 if unknown */
+	uint64_t timestamp_ns; /* latest update, CLOCK_BOOTTIME */
+	uint64_t power_uw; /* latest power reading, see syspower_energy_add_power() */
+	unsigned int head;
+	unsigned int count;
+	struct {
+		uint64_t timestamp_ns;
+		uint64_t energy_uj;
+	} history[SYSPOWER_ENERGY_HISTORY];
+};
+
 /**
- * @brief Enable system autosleep.
- * @param type Sleep type (cf syspower_sleep_type enum)
- * @return 0 on success, negative value on error.
+ * @brief Initialize energy accounting.
+ * @param e energy accounting.
+ * @param range_uj counter wrap-around range, 0 if unknown or not a counter.
  */
-int syspower_autosleep_enable(enum syspower_sleep_type type);
+void syspower_energy_init(struct syspower_energy *e, uint64_t range_uj);
 
 /**
- * @brief Disable system autosleep.
- * @return 0 on success, negative value on error.
+ * @brief Account a new energy counter reading, correcting wrap-arounds.
+ * @param e energy accounting.
+ * @param raw_uj raw counter value in microjoules.
+ * @param timestamp_ns reading time, CLOCK_BOOTTIME.
  */
-int syspower_autosleep_disable(void);
+void syspower_energy_update(struct syspower_energy *e, uint64_t raw_uj,
+			    uint64_t timestamp_ns);
 
 /**
- * @brief Create a new wake-lock, preventing system to autosleep.
- * @param name Name of the lock.
- * @param timeout_ms Auto release the lock after timeou_ms (if different from 0).
- * @return 0 on success, negative value on error.
+ * @brief Account energy consumed since the previous update.
+ * @param e energy accounting.
+ * @param delta_uj energy in microjoules.
+ * @param timestamp_ns update time, CLOCK_BOOTTIME.
  */
-int syspower_wake_lock(const char *name, unsigned int timeout_ms);
+void syspower_energy_add(struct syspower_energy *e, uint64_t delta_uj,
+			 uint64_t timestamp_ns);
 
 /**
- * @brief Release a wake-lock.
- * @param name Name of the lock.
- * @return 0 on success, negative value on error.
+ * @brief Account power drawn since the previous update.
+ * The previous reading is integrated over the elapsed time, this one is
+ * accounted at the next update.
+ * @param e energy accounting.
+ * @param power_uw power in microwatts.
+ * @param timestamp_ns reading time, CLOCK_BOOTTIME.
  */
-int syspower_wake_unlock(const char *name);
+void syspower_energy_add_power(struct syspower_energy *e, uint64_t power_uw,
+			       uint64_t timestamp_ns);
 
 /**
- * @brief Enter system wide suspend state.
- * @param type Sleep type (cf syspower_sleep_type enum)
+ * @brief Compute average power over a time window.
+ * The window is bounded by the SYSPOWER_ENERGY_HISTORY latest updates, and
+ * always covers at least the latest two.
+ * @param e energy accounting.
+ * @param window_ms window duration in milliseconds.
+ * @return power in microwatts, 0 if not enough updates.
+ */
+uint64_t syspower_energy_power_uw(const struct syspower_energy *e,
+				  unsigned int window_ms);
+
+/**
+ * @brief Integrate supply power (voltage_now * current_now) since the
+ * previous update. Nothing is accounted while the supply is charging.
+ * @param supplyname supply name.
+ * @param e energy accounting.
  * @return 0 on success, negative value on error.
  */
-int syspower_suspend(enum syspower_sleep_type type);
+int syspower_supply_energy_update(const char *supplyname, struct syspower_energy *e);
+
+#define SYSPOWER_ENERGY_SCOPE_COUNTERS 8
+
+enum syspower_energy_source {
+	SYSPOWER_ENERGY_SOURCE_NONE,
+	SYSPOWER_ENERGY_SOURCE_POWERCAP, /* RAPL package zones */
+	SYSPOWER_ENERGY_SOURCE_HWMON, /* hwmon energy channels */
+	SYSPOWER_ENERGY_SOURCE_BATTERY, /* battery discharge, coarse */
+};
+
+struct syspower_energy_scope {
+	uint64_t timestamp_ns; /* CLOCK_MONOTONIC */
+	uint64_t raw[SYSPOWER_ENERGY_SCOPE_COUNTERS];
+};
+
+struct syspower_energy_result {
+	enum syspower_energy_source source;
+	uint64_t energy_uj;
+	uint64_t duration_ns;
+	uint64_t power_uw; /* average */
+};
 
 /**
- * @brief Configure RTC wake alarm.
- * @param seconds Schedule RTC wakeup in seconds from now, or 0 to disable.
- * @param wait Block until alarm.
+ * @brief Begin an energy measurement scope. The best available energy
+ * counter is selected on first use, and kept open.
+ * @param scope scope to begin, caller allocated.
+ * @return 0 on success, -ENODEV if no energy counter is available, negative
+ * value on error.
+ */
+int syspower_energy_scope_begin(struct syspower_energy_scope *scope);
+
+/**
+ * @brief End an energy measurement scope. A scope may be ended several times,
+ * each result covering the time since syspower_energy_scope_begin().
+ * @param scope scope to end.
+ * @param result energy, duration and average power of the scope.
  * @return 0 on success, negative value on error.
  */
-int syspower_rtc_wakealarm(unsigned int seconds, bool wait);
+int syspower_energy_scope_end(struct syspower_energy_scope *scope,
+			      struct syspower_energy_result *result);
 
 /**
- * @brief Retrieve latest wakeup reason (reason string and interrupt index).
- * @param reason Pointer to the reason buffer to write in (usually filled with interrupt name).
- * @param reason_len The reason string buffer size.
- * @return IRQ index on success, negative value on error.
+ * @brief Retrieve energy source name.
+ * @param source energy source.
+ * @return source name (e.g. powercap).
  */
-int syspower_wakeup_reason(char *reason, size_t reason_len);
+const char *syspower_energy_source_str(enum syspower_energy_source source);
+
+struct syspower_powercap;
+
+struct syspower_powercap_zone {
+	char name[64]; /* intel-rapl:0, intel-rapl:0:1... */
+	char type[32]; /* package-0, core, dram... */
+	struct syspower_energy energy;
+};
 
 /**
- * @brief Retrieve wakeup capable device name by index.
+ * @brief Discover powercap zones with an energy counter, which is kept open.
+ * @param path powercap sysfs class directory, NULL for default.
+ * @return powercap handle, NULL on error (errno is set).
+ */
+struct syspower_powercap *syspower_powercap_open(const char *path);
+
+/**
+ * @brief Release powercap handle.
+ * @param pc powercap handle.
+ */
+void syspower_powercap_close(struct syspower_powercap *pc);
+
+/**
+ * @brief Retrieve number of powercap zones.
+ * @param pc powercap handle.
+ * @return number of zones, ordered by name.
+ */
+unsigned int syspower_powercap_count(struct syspower_powercap *pc);
+
+/**
+ * @brief Retrieve powercap zone by index, as of the latest sample.
+ * @param pc powercap handle.
+ * @param index index of the zone.
+ * @return zone, NULL if index is out of range.
+ */
+const struct syspower_powercap_zone *syspower_powercap_get(struct syspower_powercap *pc,
+							   unsigned int index);
+
+/**
+ * @brief Sample energy counters of all zones, in one batch.
+ * @param pc powercap handle.
+ * @return 0 on success, negative value if a counter could not be read.
+ */
+int syspower_powercap_sample(struct syspower_powercap *pc);
+
+enum syspower_hwmon_type {
+	SYSPOWER_HWMON_POWER, /* uW */
+	SYSPOWER_HWMON_ENERGY, /* uJ */
+	SYSPOWER_HWMON_CURRENT, /* mA */
+	SYSPOWER_HWMON_VOLTAGE, /* mV */
+};
+
+struct syspower_hwmon;
+
+struct syspower_hwmon_channel {
+	char chip[32]; /* hwmon name, e.g. ina226 */
+	char label[32]; /* channel label, or e.g. power1 if none */
+	enum syspower_hwmon_type type;
+	int64_t value; /* latest value, in the type unit */
+	struct syspower_energy energy; /* power and energy channels */
+};
+
+/**
+ * @brief Discover hwmon power, energy, current and voltage channels,
+ * which are kept open.
+ * @param path hwmon sysfs class directory, NULL for default.
+ * @return hwmon handle, NULL on error (errno is set).
+ */
+struct syspower_hwmon *syspower_hwmon_open(const char *path);
+
+/**
+ * @brief Release hwmon handle.
+ * @param hw hwmon handle.
+ */
+void syspower_hwmon_close(struct syspower_hwmon *hw);
+
+/**
+ * @brief Retrieve number of hwmon channels.
+ * @param hw hwmon handle.
+ * @return number of channels, ordered by device, type then channel.
+ */
+unsigned int syspower_hwmon_count(struct syspower_hwmon *hw);
+
+/**
+ * @brief Retrieve hwmon channel by index, as of the latest sample.
+ * @param hw hwmon handle.
+ * @param index index of the channel.
+ * @return channel, NULL if index is out of range.
+ */
+const struct syspower_hwmon_channel *syspower_hwmon_get(struct syspower_hwmon *hw,
+							unsigned int index);
+
+/**
+ * @brief Sample all hwmon channels, in one batch.
+ * Power channels are integrated and energy channels accumulated into the
+ * channel energy accounting.
+ * @param hw hwmon handle.
+ * @return 0 on success, negative value if a channel could not be read.
+ */
+int syspower_hwmon_sample(struct syspower_hwmon *hw);
+
+struct syspower_devfreq;
+
+struct syspower_devfreq_device {
+	char name[64];
+	char governor[32];
+	uint64_t cur_hz;
+	uint64_t target_hz;
+	uint64_t min_hz;
+	uint64_t max_hz;
+	unsigned int nr_states; /* 0 if trans_stat is not available */
+	uint64_t *freq_hz; /* [nr_states] */
+	uint64_t *time_ms; /* [nr_states] */
+	uint64_t *delta_time_ms; /* [nr_states], since previous sample */
+	uint64_t *trans; /* [nr_states * nr_states], from row to column */
+	uint64_t *delta_trans; /* [nr_states * nr_states] */
+};
+
+/**
+ * @brief Discover devfreq devices, attributes are kept open and trans_stat
+ * matrices are allocated once.
+ * @param path devfreq sysfs class directory, NULL for default.
+ * @return devfreq handle, NULL on error (errno is set).
+ */
+struct syspower_devfreq *syspower_devfreq_open(const char *path);
+
+/**
+ * @brief Release devfreq handle.
+ * @param df devfreq handle.
+ */
+void syspower_devfreq_close(struct syspower_devfreq *df);
+
+/**
+ * @brief Retrieve number of devfreq devices.
+ * @param df devfreq handle.
+ * @return number of devices, ordered by name.
+ */
+unsigned int syspower_devfreq_count(struct syspower_devfreq *df);
+
+/**
+ * @brief Retrieve devfreq device by index, as of the latest sample.
+ * @param df devfreq handle.
  * @param index index of the device.
- * @return device name.
+ * @return device, NULL if index is out of range.
  */
-const char *syspower_wakeup_get(unsigned int index);
+const struct syspower_devfreq_device *syspower_devfreq_get(struct syspower_devfreq *df,
+							   unsigned int index);
 
 /**
- * @brief Check if wakeup is enabled for the given device.
- * @param device name.
- * @return true if wakeup is enabled, false otherwise.
+ * @brief Sample frequencies and transition statistics of all devices,
+ * in one batch.
+ * @param df devfreq handle.
+ * @return 0 on success, -EINVAL if a frequency table changed since discovery.
  */
-bool syspower_wakeup_enabled(const char *devname);
+int syspower_devfreq_sample(struct syspower_devfreq *df);
 
 /**
- * @brief Enable wakeup for the given device.
- * @param device name.
+ * @brief Set device frequency range, unchanged bounds are not written.
+ * Bounds are compared with the last ones written through this handle, as
+ * min_freq/max_freq read back the effective (e.g. thermally clamped) limits.
+ * @param df devfreq handle.
+ * @param index index of the device.
+ * @param min_hz minimum frequency, 0 to leave as is.
+ * @param max_hz maximum frequency, 0 to leave as is.
+ * @return number of bounds written, negative value on error.
+ */
+int syspower_devfreq_set_range(struct syspower_devfreq *df, unsigned int index,
+			       uint64_t min_hz, uint64_t max_hz);
+
+/**
+ * @brief Set frequency range of all devices, skipping unchanged bounds.
+ * @param df devfreq handle.
+ * @param min_hz array of syspower_devfreq_count() minimums (0 to leave as
+ * is), or NULL.
+ * @param max_hz array of syspower_devfreq_count() maximums, or NULL.
+ * @return number of bounds written, negative value on error.
+ */
+int syspower_devfreq_set_range_all(struct syspower_devfreq *df,
+				   const uint64_t *min_hz, const uint64_t *max_hz);
+
+struct syspower_proc_energy;
+
+struct syspower_proc_energy_entry {
+	int pid;
+	char comm[16];
+	uint64_t cpu_ticks; /* utime + stime, clock ticks */
+	uint64_t delta_ticks; /* since previous sample */
+	uint64_t energy_uj; /* attributed since first seen */
+	uint64_t delta_uj; /* attributed over the latest interval */
+};
+
+struct syspower_proc_energy_stats {
+	uint64_t energy_uj; /* system energy since open */
+	uint64_t idle_uj; /* share of the idle loop, or unattributed */
+	uint64_t exited_uj; /* share of processes no longer tracked */
+	uint64_t power_uw; /* system power over the latest interval */
+	unsigned int processes; /* processes seen in the latest sample */
+};
+
+/**
+ * @brief Start per-process energy attribution.
+ * @param supplyname supply measuring system power, NULL to use RAPL package
+ * zones when available, the first battery otherwise.
+ * @return attribution handle, NULL on error (errno is set).
+ */
+struct syspower_proc_energy *syspower_proc_energy_open(const char *supplyname);
+
+/**
+ * @brief Release attribution handle.
+ * @param pe attribution handle.
+ */
+void syspower_proc_energy_close(struct syspower_proc_energy *pe);
+
+/**
+ * @brief Sample system energy and process CPU times, and apportion the
+ * energy consumed since the previous sample to processes, proportionally to
+ * their CPU time.
+ * @param pe attribution handle.
+ * @return number of processes, negative value on error.
+ */
+int syspower_proc_energy_sample(struct syspower_proc_energy *pe);
+
+/**
+ * @brief Retrieve attribution totals.
+ * @param pe attribution handle.
+ * @param stats totals to fill.
  * @return 0 on success, negative value on error.
  */
-int syspower_wakeup_enable(const char *devname);
+int syspower_proc_energy_stats(struct syspower_proc_energy *pe,
+			       struct syspower_proc_energy_stats *stats);
 
 /**
- * @brief Disable wakeup for the given device.
- * @param device name.
+ * @brief Retrieve the top energy consumers among live processes.
+ * Entries are valid until the next sample.
+ * @param pe attribution handle.
+ * @param entries array to fill, by decreasing energy.
+ * @param max array size.
+ * @param interval rank by latest interval energy rather than total energy.
+ * @return number of entries, negative value on error.
+ */
+int syspower_proc_energy_top(struct syspower_proc_energy *pe,
+			     const struct syspower_proc_energy_entry **entries,
+			     unsigned int max, bool interval);
+
+#define SYSPOWER_GOVERNOR_LEVELS 32
+
+struct syspower_governor;
+
+struct syspower_governor_band {
+	int capacity; /* band covers capacities up to this one (percents) */
+	unsigned int budget_mw; /* 0 for unlimited */
+};
+
+struct syspower_governor_config {
+	const char *battery; /* NULL for the first battery */
+	const char *source; /* supply measuring power, NULL for RAPL or battery */
+	const char *cpufreq; /* cpufreq sysfs directory, NULL for default */
+	unsigned int ac_budget_mw; /* on external supply, 0 for unlimited */
+	const struct syspower_governor_band *bands; /* by increasing capacity */
+	unsigned int nr_bands;
+};
+
+struct syspower_governor_status {
+	bool ac; /* an external supply is online */
+	int capacity; /* percents, -1 if unknown */
+	unsigned int budget_mw; /* 0 for unlimited */
+	unsigned int power_mw; /* measured over the latest step */
+	unsigned int level; /* 0 (hw min) to SYSPOWER_GOVERNOR_LEVELS (hw max) */
+	uint64_t steps;
+	uint64_t writes; /* cpufreq cap writes */
+	uint64_t step_us; /* latest control step duration */
+	uint64_t max_step_us;
+	uint64_t reaction_us; /* latest supply event to caps applied */
+};
+
+/**
+ * @brief Create a CPU power budget governor, capping cpufreq policies so
+ * that power stays within the budget of the battery capacity band, or the AC
+ * budget. Supply events are tracked to switch budget immediately.
+ * @param config governor configuration, copied.
+ * @return governor handle, NULL on error (errno is set).
+ */
+struct syspower_governor *syspower_governor_create(const struct syspower_governor_config *config);
+
+/**
+ * @brief Destroy governor, caps are left as they are.
+ * Waits for its supply event handling in progress, must not be called from an
+ * event callback.
+ * @param gov governor handle.
+ */
+void syspower_governor_destroy(struct syspower_governor *gov);
+
+/**
+ * @brief Run one control step: measure power since the previous step and
+ * adjust cpufreq caps, only writing those that change.
+ * To be called periodically (e.g. every second).
+ * @param gov governor handle.
+ * @return number of caps written, negative value on error.
+ */
+int syspower_governor_step(struct syspower_governor *gov);
+
+/**
+ * @brief Retrieve governor state and overhead statistics.
+ * @param gov governor handle.
+ * @param status status to fill.
  * @return 0 on success, negative value on error.
  */
-int syspower_wakeup_disable(const char *devname);
+int syspower_governor_status(struct syspower_governor *gov,
+			     struct syspower_governor_status *status);
 
 /**
  * @brief Retrieve supply presence.
@@ -230,6 +1418,316 @@ enum syspower_supply_status syspower_supply_status(const char *supplyname);
 enum syspower_supply_health syspower_supply_health(const char *supplyname,
 						   char *health_str);
 
+#define SYSPOWER_SUPPLY_SNAPSHOT_MAX 16
+
+struct syspower_supply_snapshot {
+	char name[64];
+	enum syspower_supply_type type;
+	enum syspower_supply_status status;
+	enum syspower_supply_health health;
+	bool present;
+	bool online;
+	int capacity; /* percents, -1 if not reported */
+	int voltage_mv;
+	int current_ma; /* signed, as reported by the driver */
+	int temp_dc; /* decidegree Celsius */
+	int cycle_count; /* -1 if not reported */
+	int64_t charge_now_uah;
+	int64_t charge_full_uah;
+	int64_t charge_full_design_uah;
+	int64_t energy_now_uwh;
+	int64_t energy_full_uwh;
+	int64_t energy_full_design_uwh;
+	bool stale; /* deadline exceeded, last known values */
+	uint64_t timestamp_ns; /* CLOCK_BOOTTIME */
+};
+
+struct syspower_supply_latency {
+	uint64_t count; /* completed reads */
+	uint64_t timeouts; /* deadlines exceeded */
+	uint64_t last_us;
+	uint64_t avg_us; /* moving average */
+	uint64_t max_us;
+	bool pending; /* read in progress */
+};
+
+/**
+ * @brief Retrieve all supply properties at once, from its uevent attribute.
+ * The attribute is kept open, values are consistent with each other and
+ * properties not reported by the driver are left to 0 (or -1).
+ * The supply deadline applies, see syspower_supply_set_deadline().
+ * @param supplyname supply name.
+ * @param snap snapshot to fill.
+ * @return 0 on success, negative value on error.
+ */
+int syspower_supply_snapshot(const char *supplyname,
+			     struct syspower_supply_snapshot *snap);
+
+/**
+ * @brief Retrieve all supply properties at once, within a deadline.
+ * If the deadline is exceeded, the last known values are returned with the
+ * stale flag set.
+ * @param supplyname supply name.
+ * @param snap snapshot to fill.
+ * @param timeout_ms deadline, 0 to read synchronously, negative value for
+ * the supply deadline.
+ * @return 0 on success, -ETIMEDOUT if exceeded without any known values,
+ * negative value on error.
+ */
+int syspower_supply_snapshot_timeout(const char *supplyname,
+				     struct syspower_supply_snapshot *snap,
+				     int timeout_ms);
+
+/**
+ * @brief Set supply read deadline.
+ * Reads of supplies with a deadline are run by a worker pool, so that a
+ * slow or stuck fuel gauge cannot block the caller longer than that.
+ * @param supplyname supply name.
+ * @param deadline_ms deadline, 0 to read synchronously (default).
+ * @return 0 on success, negative value on error.
+ */
+int syspower_supply_set_deadline(const char *supplyname, unsigned int deadline_ms);
+
+/**
+ * @brief Read a supply attribute within a deadline, through a held fd.
+ * @param supplyname supply name.
+ * @param attr attribute name (e.g. current_now).
+ * @param value buffer to write the value in.
+ * @param len buffer length.
+ * @param timeout_ms deadline, 0 to read synchronously, negative value for
+ * the supply deadline.
+ * @return 0 on success, 1 if the deadline was exceeded and value is the last
+ * known one, negative value on error.
+ */
+int syspower_supply_read_attribute(const char *supplyname, const char *attr,
+				   char *value, size_t len, int timeout_ms);
+
+/**
+ * @brief Retrieve supply attribute read latency statistics.
+ * @param supplyname supply name.
+ * @param attr attribute name (uevent for snapshots).
+ * @param latency statistics to fill.
+ * @return 0 on success, -ENOENT if the attribute has never been read.
+ */
+int syspower_supply_latency(const char *supplyname, const char *attr,
+			    struct syspower_supply_latency *latency);
+
+/**
+ * @brief Release supply held attributes, except those with a read in
+ * progress. Must not be called concurrently with supply reads.
+ */
+void syspower_supply_snapshot_release(void);
+
+struct syspower_battery_health;
+
+enum syspower_battery_cycle_kind {
+	SYSPOWER_BATTERY_CHARGE,
+	SYSPOWER_BATTERY_DISCHARGE,
+};
+
+struct syspower_battery_cycle {
+	enum syspower_battery_cycle_kind kind;
+	uint64_t start_ns; /* CLOCK_BOOTTIME */
+	uint32_t duration_s;
+	int start_capacity; /* percents */
+	int end_capacity;
+	unsigned int depth; /* percents, partial cycle */
+	int avg_temp_dc; /* decidegree Celsius */
+	unsigned int avg_power_mw;
+	unsigned int health_permille; /* charge_full / design, 0 if unknown */
+	int cycle_count; /* as reported by the driver, -1 if unknown */
+};
+
+struct syspower_battery_health_summary {
+	unsigned int health_permille; /* latest charge_full / design */
+	unsigned int initial_health_permille; /* first seen */
+	int cycle_count; /* latest driver cycle count, -1 if unknown */
+	int initial_cycle_count; /* first seen */
+	uint64_t equivalent_cycles_permille; /* sum of discharge depths */
+	unsigned int records; /* cycle records stored */
+	uint64_t total_records; /* including overwritten ones */
+};
+
+/**
+ * @brief Start battery health tracking and charge cycle detection.
+ * @param battery battery supply name, NULL for the first battery.
+ * @param max_records number of cycle records kept, oldest are overwritten.
+ * @param events feed from supply events (see syspower_monitor_dispatch()),
+ * otherwise snapshots are fed with syspower_battery_health_feed().
+ * @return health tracking handle, NULL on error (errno is set).
+ */
+struct syspower_battery_health *syspower_battery_health_open(const char *battery,
+							     unsigned int max_records,
+							     bool events);
+
+/**
+ * @brief Stop battery health tracking.
+ * Waits for its supply event handling in progress, must not be called from an
+ * event callback.
+ * @param h health tracking handle.
+ */
+void syspower_battery_health_close(struct syspower_battery_health *h);
+
+/**
+ * @brief Feed a battery snapshot, e.g. periodically taken.
+ * @param h health tracking handle.
+ * @param snap battery snapshot.
+ * @return 0 on success, negative value on error.
+ */
+int syspower_battery_health_feed(struct syspower_battery_health *h,
+				 const struct syspower_supply_snapshot *snap);
+
+/**
+ * @brief Retrieve battery wear and cycle totals.
+ * @param h health tracking handle.
+ * @param summary summary to fill.
+ * @return 0 on success, negative value on error.
+ */
+int syspower_battery_health_summary(struct syspower_battery_health *h,
+				    struct syspower_battery_health_summary *summary);
+
+/**
+ * @brief Retrieve a stored cycle record.
+ * @param h health tracking handle.
+ * @param index record index, 0 being the oldest stored.
+ * @param cycle record to fill.
+ * @return 0 on success, -ENOENT if index is out of range.
+ */
+int syspower_battery_health_cycle(struct syspower_battery_health *h,
+				  unsigned int index,
+				  struct syspower_battery_cycle *cycle);
+
+#define SYSPOWER_ANOMALY_STATES 8
+
+struct syspower_anomaly;
+
+enum syspower_anomaly_metric {
+	SYSPOWER_ANOMALY_DRAIN, /* discharge power, mW */
+	SYSPOWER_ANOMALY_WAKEUPS, /* wakeups per hour */
+	SYSPOWER_ANOMALY_METRIC_MAX
+};
+
+struct syspower_anomaly_config {
+	const char *battery; /* NULL for the first battery */
+	unsigned int weight_shift; /* EWMA weight 1/2^n, 0 for 4 */
+	unsigned int sigma_tenths; /* threshold in tenths of sigma, 0 for 30 */
+	unsigned int warmup; /* samples before flagging, 0 for 16 */
+};
+
+struct syspower_anomaly_baseline {
+	uint64_t samples;
+	int64_t mean;
+	int64_t stddev;
+	int64_t threshold; /* 0 while warming up */
+};
+
+/**
+ * @brief Create an anomaly detector on discharge power and wakeup rate.
+ * Anomalies are reported as SYSPOWER_EVENT_ANOMALY events, with the metric
+ * name, the state as index, the value and the baseline threshold.
+ * @param config detector configuration, NULL for defaults.
+ * @return detector handle, NULL on error (errno is set).
+ */
+struct syspower_anomaly *syspower_anomaly_create(const struct syspower_anomaly_config *config);
+
+/**
+ * @brief Destroy anomaly detector.
+ * @param a detector handle.
+ */
+void syspower_anomaly_destroy(struct syspower_anomaly *a);
+
+/**
+ * @brief Feed a metric sample, compared to then folded into the baseline of
+ * the given state.
+ * @param a detector handle.
+ * @param metric sampled metric.
+ * @param state caller defined state (e.g. screen on/off), below
+ * SYSPOWER_ANOMALY_STATES.
+ * @param value sample value.
+ * @return 1 if flagged as anomaly, 0 if not, negative value on error.
+ */
+int syspower_anomaly_feed(struct syspower_anomaly *a,
+			  enum syspower_anomaly_metric metric,
+			  unsigned int state, int64_t value);
+
+/**
+ * @brief Sample battery discharge power and wakeups per hour (successful
+ * suspends since the previous call), and feed them.
+ * @param a detector handle.
+ * @param state caller defined state, below SYSPOWER_ANOMALY_STATES.
+ * @return number of anomalies flagged, negative value on error.
+ */
+int syspower_anomaly_sample(struct syspower_anomaly *a, unsigned int state);
+
+/**
+ * @brief Retrieve metric baseline of a state.
+ * @param a detector handle.
+ * @param metric metric.
+ * @param state state.
+ * @param baseline baseline to fill.
+ * @return 0 on success, negative value on error.
+ */
+int syspower_anomaly_baseline(struct syspower_anomaly *a,
+			      enum syspower_anomaly_metric metric,
+			      unsigned int state,
+			      struct syspower_anomaly_baseline *baseline);
+
+/**
+ * @brief Retrieve anomaly metric name.
+ * @param metric metric.
+ * @return metric name (e.g. drain).
+ */
+const char *syspower_anomaly_metric_str(enum syspower_anomaly_metric metric);
+
+struct syspower_supply_input {
+	bool powered; /* fed by an online external supply */
+	char source[64]; /* that external supply, empty if none */
+	unsigned int depth; /* supply edges between source and this supply */
+};
+
+/**
+ * @brief Build the supply power-flow graph, from supplied_from/supplied_to
+ * attributes (or external supplies feeding batteries when not exposed).
+ * The graph is then kept up to date from supply events, see
+ * syspower_monitor_dispatch(), and rebuilt when an unknown supply shows up.
+ * Removed or unreadable supplies stay in the graph, offline.
+ * @return number of supplies, negative value on error.
+ */
+int syspower_supply_graph_build(void);
+
+/**
+ * @brief Stop tracking supply events and release the supply graph.
+ */
+void syspower_supply_graph_release(void);
+
+/**
+ * @brief Refresh a supply graph node and propagate its change downstream,
+ * for users not dispatching monitor events.
+ * @param supplyname supply name.
+ * @return 0 on success, negative value on error.
+ */
+int syspower_supply_graph_update(const char *supplyname);
+
+/**
+ * @brief Retrieve the effective input of a supply (e.g. BAT0) from the
+ * supply graph, without reading any supply.
+ * @param supplyname supply name.
+ * @param input input to fill.
+ * @return 0 on success, -ENOENT if not in the graph.
+ */
+int syspower_supply_graph_input(const char *supplyname,
+				struct syspower_supply_input *input);
+
+/**
+ * @brief Retrieve the supplies directly feeding a supply.
+ * @param supplyname supply name.
+ * @param names array to fill with supplier names.
+ * @param max array size.
+ * @return number of suppliers, negative value on error.
+ */
+int syspower_supply_graph_suppliers(const char *supplyname, char names[][64],
+				    unsigned int max);
+
 /**
  * @brief Retrieve power supply monitoring file descriptor for polling.
  * @return file descriptor or negative error code.
@@ -247,9 +1745,19 @@ void syspower_supply_put_monitorfd(int fd);
  * @param fd file descriptor of the power supply monitor
  * @param supplyname pointer to the supplyname string to write in.
  * @param maxlen maximum length of the supplyname string.
+ * @return 0 on success, -EAGAIN if the event was a thermal one, negative
+ * value on error.
  */
 int syspower_supply_read_monitorfd(int fd, char *supplyname, size_t maxlen);
 
+/**
+ * @brief Process all pending monitor uevents (power supply and thermal).
+ * Changes are reported to the event listeners.
+ * @param fd file descriptor of the monitor
+ * @return number of uevents processed, negative value on error.
+ */
+int syspower_monitor_dispatch(int fd);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
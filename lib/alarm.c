@@ -0,0 +1,416 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * This file is part of libsyspower.
+ *
+ * Copyright (C) 2022 Loic Poulain <loic.poulain@linaro.org>
+ */
+
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <syspower.h>
+
+#include "internal.h"
+
+/*
+ * Wake alarm scheduler.
+ *
+ * There is only one hardware alarm, so logical alarms are kept in a min-heap
+ * ordered by deadline (CLOCK_BOOTTIME) and the backend is always programmed
+ * for the head. To reduce wakeups, alarms are coalesced: the backend fires at
+ * the latest deadline within [earliest, earliest + slack], and every alarm
+ * expired at that point is dispatched in the same wakeup. No alarm is thus
+ * delayed by more than the slack.
+ *
+ * The RTC wake alarm is system wide: the scheduler only disables it when it
+ * still holds the time the scheduler wrote, not to drop someone else's.
+ */
+
+struct alarm_entry {
+	char *name;
+	uint64_t deadline_ms;
+	unsigned int index; /* position in heap */
+	void (*cb)(const char *name, void *data);
+	void *data;
+	struct alarm_entry *next; /* dispatch list */
+};
+
+struct syspower_alarm_sched {
+	enum syspower_alarm_backend backend;
+	unsigned int slack_ms;
+	int fd;
+	pthread_mutex_t lock;
+	struct alarm_entry **heap;
+	unsigned int count;
+	unsigned int size;
+	uint64_t programmed_ms;
+	time_t rtc_when; /* RTC alarm written, 0 if none */
+};
+
+static void __heap_swap(struct syspower_alarm_sched *s, unsigned int a, unsigned int b)
+{
+	struct alarm_entry *tmp = s->heap[a];
+
+	s->heap[a] = s->heap[b];
+	s->heap[b] = tmp;
+	s->heap[a]->index = a;
+	s->heap[b]->index = b;
+}
+
+static void __heap_up(struct syspower_alarm_sched *s, unsigned int i)
+{
+	while (i && s->heap[i]->deadline_ms < s->heap[(i - 1) / 2]->deadline_ms) {
+		__heap_swap(s, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void __heap_down(struct syspower_alarm_sched *s, unsigned int i)
+{
+	while (1) {
+		unsigned int min = i, l = 2 * i + 1, r = 2 * i + 2;
+
+		if (l < s->count && s->heap[l]->deadline_ms < s->heap[min]->deadline_ms)
+			min = l;
+		if (r < s->count && s->heap[r]->deadline_ms < s->heap[min]->deadline_ms)
+			min = r;
+		if (min == i)
+			return;
+
+		__heap_swap(s, i, min);
+		i = min;
+	}
+}
+
+static struct alarm_entry *__heap_remove(struct syspower_alarm_sched *s, unsigned int i)
+{
+	struct alarm_entry *entry = s->heap[i];
+
+	s->count--;
+	if (i != s->count) {
+		s->heap[i] = s->heap[s->count];
+		s->heap[i]->index = i;
+		__heap_down(s, i);
+		__heap_up(s, i);
+	}
+
+	return entry;
+}
+
+/* Latest deadline within limit, visiting only the heap part below limit */
+static uint64_t __heap_latest(struct syspower_alarm_sched *s, unsigned int i,
+			      uint64_t limit)
+{
+	uint64_t latest, child;
+
+	if (i >= s->count || s->heap[i]->deadline_ms > limit)
+		return 0;
+
+	latest = s->heap[i]->deadline_ms;
+
+	child = __heap_latest(s, 2 * i + 1, limit);
+	if (child > latest)
+		latest = child;
+
+	child = __heap_latest(s, 2 * i + 2, limit);
+	if (child > latest)
+		latest = child;
+
+	return latest;
+}
+
+/*
+ * Disable the RTC alarm, only if it is still ours. When it cannot be read
+ * back, it is left armed: a spurious wakeup finds nothing to dispatch.
+ */
+static int __alarm_rtc_disable(struct syspower_alarm_sched *s)
+{
+	time_t when;
+	int ret = 0;
+
+	if (!s->rtc_when)
+		return 0;
+
+	if (!__rtc_wakealarm_read(&when) && when == s->rtc_when)
+		ret = syspower_rtc_wakealarm_at(0, false);
+
+	s->rtc_when = 0;
+
+	return ret;
+}
+
+static int __alarm_program(struct syspower_alarm_sched *s)
+{
+	uint64_t expiry, now;
+	time_t rtc_now, when;
+	int ret;
+
+	if (!s->count) {
+		s->programmed_ms = 0;
+		if (s->backend == SYSPOWER_ALARM_BACKEND_TIMER)
+			return syspower_alarm_timer_set(s->fd, 0);
+		return __alarm_rtc_disable(s);
+	}
+
+	expiry = __heap_latest(s, 0, s->heap[0]->deadline_ms + s->slack_ms);
+	if (expiry == s->programmed_ms)
+		return 0;
+
+	if (s->backend == SYSPOWER_ALARM_BACKEND_TIMER) {
+		ret = syspower_alarm_timer_set_abs(s->fd, expiry);
+	} else {
+		/* RTC has second resolution, round up not to fire early */
+		if ((ret = syspower_rtc_time(&rtc_now)))
+			return ret;
+
+		now = __clock_ns(CLOCK_BOOTTIME) / 1000000;
+		expiry = expiry > now ? expiry : now;
+		when = rtc_now + 1 + (expiry - now + 999) / 1000;
+		ret = syspower_rtc_wakealarm_at(when, false);
+		if (!ret)
+			s->rtc_when = when;
+	}
+
+	if (!ret)
+		s->programmed_ms = expiry;
+
+	return ret;
+}
+
+struct syspower_alarm_sched *syspower_alarm_sched_create(enum syspower_alarm_backend backend,
+							 unsigned int slack_ms)
+{
+	struct syspower_alarm_sched *s;
+
+	if (backend >= SYSPOWER_ALARM_BACKEND_MAX) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+
+	s->backend = backend;
+	s->slack_ms = slack_ms;
+	s->fd = -1;
+
+	if (backend == SYSPOWER_ALARM_BACKEND_TIMER) {
+		s->fd = syspower_alarm_timer_open();
+		if (s->fd < 0) {
+			errno = -s->fd;
+			free(s);
+			return NULL;
+		}
+	}
+
+	pthread_mutex_init(&s->lock, NULL);
+
+	return s;
+}
+
+void syspower_alarm_sched_destroy(struct syspower_alarm_sched *s)
+{
+	if (!s)
+		return;
+
+	while (s->count) {
+		struct alarm_entry *entry = __heap_remove(s, s->count - 1);
+
+		free(entry->name);
+		free(entry);
+	}
+
+	__alarm_program(s);
+
+	syspower_alarm_timer_close(s->fd);
+	pthread_mutex_destroy(&s->lock);
+	free(s->heap);
+	free(s);
+}
+
+int syspower_alarm_sched_fd(struct syspower_alarm_sched *s)
+{
+	if (!s)
+		return -EINVAL;
+
+	if (s->backend == SYSPOWER_ALARM_BACKEND_RTC)
+		return syspower_rtc_get_alarmfd();
+
+	return s->fd;
+}
+
+void syspower_alarm_sched_set_slack(struct syspower_alarm_sched *s,
+				    unsigned int slack_ms)
+{
+	if (!s)
+		return;
+
+	pthread_mutex_lock(&s->lock);
+	s->slack_ms = slack_ms;
+	__alarm_program(s);
+	pthread_mutex_unlock(&s->lock);
+}
+
+static struct alarm_entry *__alarm_find(struct syspower_alarm_sched *s, const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < s->count; i++) {
+		if (!strcmp(s->heap[i]->name, name))
+			return s->heap[i];
+	}
+
+	return NULL;
+}
+
+int syspower_alarm_sched_add(struct syspower_alarm_sched *s, const char *name,
+			     uint64_t delay_ms,
+			     void (*cb)(const char *name, void *data), void *data)
+{
+	struct alarm_entry *entry;
+	int ret;
+
+	if (!s || !name || !cb)
+		return -EINVAL;
+
+	pthread_mutex_lock(&s->lock);
+
+	/* Re-adding a named alarm reschedules it */
+	entry = __alarm_find(s, name);
+	if (entry) {
+		__heap_remove(s, entry->index);
+	} else {
+		if (s->count == s->size) {
+			unsigned int size = s->size ? s->size * 2 : 16;
+			struct alarm_entry **heap;
+
+			heap = realloc(s->heap, size * sizeof(*heap));
+			if (!heap) {
+				ret = -ENOMEM;
+				goto unlock;
+			}
+
+			s->heap = heap;
+			s->size = size;
+		}
+
+		entry = calloc(1, sizeof(*entry));
+		if (!entry || !(entry->name = strdup(name))) {
+			free(entry);
+			ret = -ENOMEM;
+			goto unlock;
+		}
+	}
+
+	entry->deadline_ms = __clock_ns(CLOCK_BOOTTIME) / 1000000 + delay_ms;
+	entry->cb = cb;
+	entry->data = data;
+	entry->index = s->count;
+	s->heap[s->count++] = entry;
+	__heap_up(s, entry->index);
+
+	ret = __alarm_program(s);
+
+unlock:
+	pthread_mutex_unlock(&s->lock);
+
+	return ret;
+}
+
+int syspower_alarm_sched_remove(struct syspower_alarm_sched *s, const char *name)
+{
+	struct alarm_entry *entry;
+	int ret;
+
+	if (!s || !name)
+		return -EINVAL;
+
+	pthread_mutex_lock(&s->lock);
+
+	entry = __alarm_find(s, name);
+	if (!entry) {
+		ret = -ENOENT;
+		goto unlock;
+	}
+
+	__heap_remove(s, entry->index);
+	free(entry->name);
+	free(entry);
+
+	ret = __alarm_program(s);
+
+unlock:
+	pthread_mutex_unlock(&s->lock);
+
+	return ret;
+}
+
+int syspower_alarm_sched_dispatch(struct syspower_alarm_sched *s)
+{
+	struct alarm_entry *expired = NULL, **tail = &expired;
+	uint64_t count, now;
+	int dispatched = 0;
+
+	if (!s)
+		return -EINVAL;
+
+	/* Acknowledge backend expiry, if any */
+	if (s->backend == SYSPOWER_ALARM_BACKEND_TIMER)
+		READ_RETRY(s->fd, &count, sizeof(count));
+	else
+		syspower_rtc_read_alarmfd(syspower_rtc_get_alarmfd());
+
+	pthread_mutex_lock(&s->lock);
+
+	now = __clock_ns(CLOCK_BOOTTIME) / 1000000;
+	while (s->count && s->heap[0]->deadline_ms <= now) {
+		*tail = __heap_remove(s, 0);
+		tail = &(*tail)->next;
+	}
+	*tail = NULL;
+
+	s->programmed_ms = 0;
+	__alarm_program(s);
+
+	pthread_mutex_unlock(&s->lock);
+
+	/* Callbacks are run unlocked, they may reschedule */
+	while (expired) {
+		struct alarm_entry *entry = expired;
+
+		expired = entry->next;
+		__event_emit(SYSPOWER_EVENT_ALARM, entry->name, 0, 0, 0);
+		entry->cb(entry->name, entry->data);
+		free(entry->name);
+		free(entry);
+		dispatched++;
+	}
+
+	return dispatched;
+}
+
+int64_t syspower_alarm_sched_next(struct syspower_alarm_sched *s)
+{
+	int64_t next = -1;
+	uint64_t now;
+
+	if (!s)
+		return -EINVAL;
+
+	pthread_mutex_lock(&s->lock);
+
+	if (s->programmed_ms) {
+		now = __clock_ns(CLOCK_BOOTTIME) / 1000000;
+		next = s->programmed_ms > now ? s->programmed_ms - now : 0;
+	}
+
+	pthread_mutex_unlock(&s->lock);
+
+	return next;
+}
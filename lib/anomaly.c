@@ -0,0 +1,251 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * This file is part of libsyspower.
+ *
+ * Copyright (C) 2022 Loic Poulain <loic.poulain@linaro.org>
+ */
+
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <syspower.h>
+
+#include "internal.h"
+
+/*
+ * Streaming anomaly detection.
+ *
+ * Each metric (discharge power, wakeups per hour) keeps, per caller defined
+ * state (e.g. screen on/off), an exponentially weighted mean and variance in
+ * fixed point. A sample is O(1): it is compared against mean + k x sigma of
+ * the baseline, then folded into it. Anomalies are reported through the
+ * event API, as SYSPOWER_EVENT_ANOMALY with the metric as name, the state as
+ * index and the baseline threshold.
+ */
+
+static const char path_suspend_success[] = "/sys/power/suspend_stats/success";
+
+#define ANOMALY_FP_SHIFT 8 /* fixed point fraction bits */
+
+static const char * const metrics[] = {
+	[SYSPOWER_ANOMALY_DRAIN] = "drain",
+	[SYSPOWER_ANOMALY_WAKEUPS] = "wakeups",
+};
+
+struct anomaly_stat {
+	uint64_t samples;
+	int64_t mean; /* fixed point */
+	int64_t var; /* fixed point, squared */
+};
+
+struct syspower_anomaly {
+	pthread_mutex_t lock;
+	unsigned int weight_shift;
+	unsigned int sigma_tenths;
+	unsigned int warmup;
+	struct anomaly_stat stats[SYSPOWER_ANOMALY_METRIC_MAX][SYSPOWER_ANOMALY_STATES];
+
+	char battery[64];
+	int fd_success;
+	uint64_t success;
+	uint64_t success_ns;
+};
+
+static uint64_t __isqrt(uint64_t v)
+{
+	uint64_t x = v, y = (v + 1) / 2;
+
+	while (y < x) {
+		x = y;
+		y = (x + v / x) / 2;
+	}
+
+	return x;
+}
+
+static int64_t __anomaly_threshold(struct syspower_anomaly *a,
+				   const struct anomaly_stat *st)
+{
+	int64_t sigma = __isqrt(st->var);
+
+	/* A perfectly stable baseline must not flag the slightest change */
+	if (sigma < st->mean / 32)
+		sigma = st->mean / 32;
+
+	return (st->mean + sigma * a->sigma_tenths / 10) >> ANOMALY_FP_SHIFT;
+}
+
+struct syspower_anomaly *syspower_anomaly_create(const struct syspower_anomaly_config *config)
+{
+	struct syspower_anomaly *a;
+
+	a = calloc(1, sizeof(*a));
+	if (!a)
+		return NULL;
+
+	pthread_mutex_init(&a->lock, NULL);
+	a->weight_shift = config && config->weight_shift ? config->weight_shift : 4;
+	a->sigma_tenths = config && config->sigma_tenths ? config->sigma_tenths : 30;
+	a->warmup = config && config->warmup ? config->warmup : 16;
+
+	if (config && config->battery) {
+		snprintf(a->battery, sizeof(a->battery), "%.63s", config->battery);
+	} else {
+		__supply_first_battery(a->battery, sizeof(a->battery));
+	}
+
+	a->fd_success = open(path_suspend_success, O_RDONLY | O_CLOEXEC);
+
+	return a;
+}
+
+void syspower_anomaly_destroy(struct syspower_anomaly *a)
+{
+	if (!a)
+		return;
+
+	if (a->fd_success >= 0)
+		close(a->fd_success);
+
+	pthread_mutex_destroy(&a->lock);
+	free(a);
+}
+
+/* Called with a->lock held, return true if value is an anomaly */
+static bool __anomaly_update(struct syspower_anomaly *a, struct anomaly_stat *st,
+			     int64_t value, int64_t *threshold)
+{
+	bool anomaly = false;
+	int64_t diff;
+
+	if (st->samples >= a->warmup) {
+		*threshold = __anomaly_threshold(a, st);
+		anomaly = value > *threshold;
+	}
+
+	/* EWMA of mean and variance, weight 1/2^shift (values may be negative) */
+	diff = value * (1 << ANOMALY_FP_SHIFT) - st->mean;
+	if (!st->samples) {
+		st->mean = value * (1 << ANOMALY_FP_SHIFT);
+	} else {
+		st->mean += diff >> a->weight_shift;
+		st->var += (diff * diff - st->var) >> a->weight_shift;
+	}
+	st->samples++;
+
+	return anomaly;
+}
+
+int syspower_anomaly_feed(struct syspower_anomaly *a,
+			  enum syspower_anomaly_metric metric,
+			  unsigned int state, int64_t value)
+{
+	int64_t threshold = 0;
+	bool anomaly;
+
+	if (!a || metric >= SYSPOWER_ANOMALY_METRIC_MAX ||
+	    state >= SYSPOWER_ANOMALY_STATES)
+		return -EINVAL;
+
+	pthread_mutex_lock(&a->lock);
+	anomaly = __anomaly_update(a, &a->stats[metric][state], value, &threshold);
+	pthread_mutex_unlock(&a->lock);
+
+	if (anomaly)
+		__event_emit(SYSPOWER_EVENT_ANOMALY, metrics[metric], state, value,
+			     threshold);
+
+	return anomaly;
+}
+
+int syspower_anomaly_sample(struct syspower_anomaly *a, unsigned int state)
+{
+	struct syspower_supply_snapshot snap;
+	int64_t value = 0, threshold = 0;
+	bool anomaly = false;
+	uint64_t success, now;
+	int ret, flagged = 0;
+
+	if (!a || state >= SYSPOWER_ANOMALY_STATES)
+		return -EINVAL;
+
+	/* Discharge power, mV x mA = uW */
+	if (a->battery[0] && !syspower_supply_snapshot(a->battery, &snap) &&
+	    !snap.stale && snap.status == SYSPOWER_BATTERY_STATUS_DISCHARGING) {
+		ret = syspower_anomaly_feed(a, SYSPOWER_ANOMALY_DRAIN, state,
+					    abs(snap.voltage_mv * snap.current_ma) / 1000);
+		if (ret < 0)
+			return ret;
+		flagged += ret;
+	}
+
+	/* Wakeups per hour, from successful suspends since the previous sample */
+	if (a->fd_success < 0)
+		return flagged;
+
+	pthread_mutex_lock(&a->lock);
+
+	if (__pread_u64(a->fd_success, &success)) {
+		pthread_mutex_unlock(&a->lock);
+		return flagged;
+	}
+
+	now = __clock_ns(CLOCK_BOOTTIME);
+	if (a->success_ns && success >= a->success && now > a->success_ns) {
+		value = (success - a->success) * 3600000000000ULL / (now - a->success_ns);
+		anomaly = __anomaly_update(a, &a->stats[SYSPOWER_ANOMALY_WAKEUPS][state],
+					   value, &threshold);
+	}
+
+	a->success = success;
+	a->success_ns = now;
+
+	pthread_mutex_unlock(&a->lock);
+
+	if (anomaly) {
+		__event_emit(SYSPOWER_EVENT_ANOMALY, metrics[SYSPOWER_ANOMALY_WAKEUPS],
+			     state, value, threshold);
+		flagged++;
+	}
+
+	return flagged;
+}
+
+int syspower_anomaly_baseline(struct syspower_anomaly *a,
+			      enum syspower_anomaly_metric metric,
+			      unsigned int state,
+			      struct syspower_anomaly_baseline *baseline)
+{
+	struct anomaly_stat *st;
+
+	if (!a || !baseline || metric >= SYSPOWER_ANOMALY_METRIC_MAX ||
+	    state >= SYSPOWER_ANOMALY_STATES)
+		return -EINVAL;
+
+	pthread_mutex_lock(&a->lock);
+
+	st = &a->stats[metric][state];
+	baseline->samples = st->samples;
+	baseline->mean = st->mean >> ANOMALY_FP_SHIFT;
+	baseline->stddev = __isqrt(st->var) >> ANOMALY_FP_SHIFT;
+	baseline->threshold = st->samples >= a->warmup ? __anomaly_threshold(a, st) : 0;
+
+	pthread_mutex_unlock(&a->lock);
+
+	return 0;
+}
+
+const char *syspower_anomaly_metric_str(enum syspower_anomaly_metric metric)
+{
+	if (metric >= SYSPOWER_ANOMALY_METRIC_MAX)
+		return "unknown";
+
+	return metrics[metric];
+}
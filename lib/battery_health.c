@@ -0,0 +1,316 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * This file is part of libsyspower.
+ *
+ * Copyright (C) 2022 Loic Poulain <loic.poulain@linaro.org>
+ */
+
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+#include <syspower.h>
+
+#include "internal.h"
+
+/*
+ * Battery health trend and charge cycle detection.
+ *
+ * Battery snapshots (from supply events, or fed by the caller) drive a small
+ * state machine: a charge or discharge segment opens when the status turns
+ * to charging or discharging, and closes when it changes again. While open,
+ * temperature and power are integrated over time, each sample holding until
+ * the next one (left rectangles), so that a closed segment
+ * is summarized into a fixed-size record (depth, duration, average
+ * temperature and power, health at that time). Records are kept in a bounded
+ * ring, oldest first out, raw samples are never stored.
+ *
+ * Partial cycles are accounted as equivalent full cycles: the sum of
+ * discharge depths, 100% making one cycle.
+ */
+
+struct battery_segment {
+	bool open;
+	enum syspower_battery_cycle_kind kind;
+	uint64_t start_ns;
+	uint64_t last_ns;
+	int start_capacity;
+	int last_capacity;
+	int last_temp_dc;
+	uint64_t last_power_uw;
+	int64_t temp_dcns; /* decidegree x nanoseconds */
+	uint64_t energy_uj;
+	uint64_t duration_ns;
+};
+
+struct syspower_battery_health {
+	pthread_mutex_t lock;
+	char battery[64];
+	bool listening;
+	struct battery_segment seg;
+	struct syspower_battery_cycle *cycles;
+	unsigned int size;
+	unsigned int head; /* next record */
+	struct syspower_battery_health_summary summary;
+};
+
+static int __battery_capacity(const struct syspower_supply_snapshot *snap)
+{
+	if (snap->capacity >= 0)
+		return snap->capacity;
+
+	if (snap->charge_full_uah > 0)
+		return snap->charge_now_uah * 100 / snap->charge_full_uah;
+
+	if (snap->energy_full_uwh > 0)
+		return snap->energy_now_uwh * 100 / snap->energy_full_uwh;
+
+	return -1;
+}
+
+static unsigned int __battery_health(const struct syspower_supply_snapshot *snap)
+{
+	if (snap->charge_full_design_uah > 0)
+		return snap->charge_full_uah * 1000 / snap->charge_full_design_uah;
+
+	if (snap->energy_full_design_uwh > 0)
+		return snap->energy_full_uwh * 1000 / snap->energy_full_design_uwh;
+
+	return 0;
+}
+
+/* Called with h->lock held */
+static void __segment_close(struct syspower_battery_health *h)
+{
+	struct battery_segment *seg = &h->seg;
+	struct syspower_battery_health_summary *sum = &h->summary;
+	struct syspower_battery_cycle *c;
+	unsigned int depth;
+
+	seg->open = false;
+
+	if (seg->start_capacity < 0 || seg->last_capacity < 0)
+		return;
+
+	depth = abs(seg->last_capacity - seg->start_capacity);
+	if (!depth)
+		return;
+
+	c = &h->cycles[h->head];
+	h->head = (h->head + 1) % h->size;
+	if (sum->records < h->size)
+		sum->records++;
+	sum->total_records++;
+
+	c->kind = seg->kind;
+	c->start_ns = seg->start_ns;
+	c->duration_s = seg->duration_ns / 1000000000;
+	c->start_capacity = seg->start_capacity;
+	c->end_capacity = seg->last_capacity;
+	c->depth = depth;
+	c->avg_temp_dc = seg->duration_ns ? seg->temp_dcns / (int64_t)seg->duration_ns : 0;
+	c->avg_power_mw = seg->duration_ns ? seg->energy_uj * 1000000 / seg->duration_ns : 0;
+	c->health_permille = sum->health_permille;
+	c->cycle_count = sum->cycle_count;
+
+	if (seg->kind == SYSPOWER_BATTERY_DISCHARGE)
+		sum->equivalent_cycles_permille += depth * 10;
+}
+
+static void __battery_feed(struct syspower_battery_health *h,
+			   const struct syspower_supply_snapshot *snap)
+{
+	struct syspower_battery_health_summary *sum = &h->summary;
+	struct battery_segment *seg = &h->seg;
+	enum syspower_battery_cycle_kind kind;
+	int capacity = __battery_capacity(snap);
+	unsigned int health = __battery_health(snap);
+	uint64_t power_uw = abs(snap->voltage_mv * snap->current_ma); /* mV x mA */
+	bool active = true;
+
+	/* Wear trend, first known values are the reference */
+	if (health) {
+		if (!sum->initial_health_permille)
+			sum->initial_health_permille = health;
+		sum->health_permille = health;
+	}
+
+	if (snap->cycle_count >= 0) {
+		if (sum->initial_cycle_count < 0)
+			sum->initial_cycle_count = snap->cycle_count;
+		sum->cycle_count = snap->cycle_count;
+	}
+
+	switch (snap->status) {
+	case SYSPOWER_BATTERY_STATUS_CHARGING:
+		kind = SYSPOWER_BATTERY_CHARGE;
+		break;
+	case SYSPOWER_BATTERY_STATUS_DISCHARGING:
+		kind = SYSPOWER_BATTERY_DISCHARGE;
+		break;
+	default:
+		kind = SYSPOWER_BATTERY_CHARGE;
+		active = false;
+		break;
+	}
+
+	if (seg->open && snap->timestamp_ns > seg->last_ns) {
+		uint64_t dt_ns = snap->timestamp_ns - seg->last_ns;
+
+		/* The previous sample held until this one */
+		seg->duration_ns += dt_ns;
+		seg->temp_dcns += (int64_t)seg->last_temp_dc * (int64_t)dt_ns;
+		seg->energy_uj += (unsigned __int128)seg->last_power_uw * dt_ns / 1000000000;
+		seg->last_ns = snap->timestamp_ns;
+		seg->last_temp_dc = snap->temp_dc;
+		seg->last_power_uw = power_uw;
+		if (capacity >= 0)
+			seg->last_capacity = capacity;
+	}
+
+	if (seg->open && (!active || kind != seg->kind))
+		__segment_close(h);
+
+	if (!seg->open && active) {
+		memset(seg, 0, sizeof(*seg));
+		seg->open = true;
+		seg->kind = kind;
+		seg->start_ns = seg->last_ns = snap->timestamp_ns;
+		seg->start_capacity = seg->last_capacity = capacity;
+		seg->last_temp_dc = snap->temp_dc;
+		seg->last_power_uw = power_uw;
+	}
+}
+
+static void __battery_event(const struct syspower_event *ev, void *data)
+{
+	struct syspower_battery_health *h = data;
+	struct syspower_supply_snapshot snap;
+
+	(void)ev;
+
+	/* Charger plug events change the battery status too */
+	if (syspower_supply_snapshot(h->battery, &snap) || snap.stale)
+		return;
+
+	pthread_mutex_lock(&h->lock);
+	__battery_feed(h, &snap);
+	pthread_mutex_unlock(&h->lock);
+}
+
+struct syspower_battery_health *syspower_battery_health_open(const char *battery,
+							     unsigned int max_records,
+							     bool events)
+{
+	struct syspower_battery_health *h;
+	int ret;
+
+	if (!max_records) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	h = calloc(1, sizeof(*h));
+	if (!h)
+		return NULL;
+
+	h->cycles = calloc(max_records, sizeof(*h->cycles));
+	if (!h->cycles) {
+		free(h);
+		return NULL;
+	}
+
+	pthread_mutex_init(&h->lock, NULL);
+	h->size = max_records;
+	h->summary.cycle_count = -1;
+	h->summary.initial_cycle_count = -1;
+
+	if (battery) {
+		snprintf(h->battery, sizeof(h->battery), "%.63s", battery);
+	} else {
+		__supply_first_battery(h->battery, sizeof(h->battery));
+	}
+
+	if (!h->battery[0]) {
+		syspower_battery_health_close(h);
+		errno = ENODEV;
+		return NULL;
+	}
+
+	if (events) {
+		ret = syspower_event_register(SYSPOWER_EVENT_MASK(SYSPOWER_EVENT_SUPPLY),
+					      __battery_event, h);
+		if (ret) {
+			syspower_battery_health_close(h);
+			errno = -ret;
+			return NULL;
+		}
+		h->listening = true;
+	}
+
+	return h;
+}
+
+void syspower_battery_health_close(struct syspower_battery_health *h)
+{
+	if (!h)
+		return;
+
+	if (h->listening)
+		syspower_event_unregister(__battery_event, h);
+
+	pthread_mutex_destroy(&h->lock);
+	free(h->cycles);
+	free(h);
+}
+
+int syspower_battery_health_feed(struct syspower_battery_health *h,
+				 const struct syspower_supply_snapshot *snap)
+{
+	if (!h || !snap)
+		return -EINVAL;
+
+	pthread_mutex_lock(&h->lock);
+	__battery_feed(h, snap);
+	pthread_mutex_unlock(&h->lock);
+
+	return 0;
+}
+
+int syspower_battery_health_summary(struct syspower_battery_health *h,
+				    struct syspower_battery_health_summary *summary)
+{
+	if (!h || !summary)
+		return -EINVAL;
+
+	pthread_mutex_lock(&h->lock);
+	*summary = h->summary;
+	pthread_mutex_unlock(&h->lock);
+
+	return 0;
+}
+
+int syspower_battery_health_cycle(struct syspower_battery_health *h,
+				  unsigned int index,
+				  struct syspower_battery_cycle *cycle)
+{
+	int ret = 0;
+
+	if (!h || !cycle)
+		return -EINVAL;
+
+	pthread_mutex_lock(&h->lock);
+
+	if (index < h->summary.records)
+		*cycle = h->cycles[(h->head + h->size - h->summary.records + index) % h->size];
+	else
+		ret = -ENOENT;
+
+	pthread_mutex_unlock(&h->lock);
+
+	return ret;
+}
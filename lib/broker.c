@@ -0,0 +1,442 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * This file is part of libsyspower.
+ *
+ * Copyright (C) 2022 Loic Poulain <loic.poulain@linaro.org>
+ */
+
+#define _GNU_SOURCE /* struct ucred */
+
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <syspower.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "internal.h"
+
+/*
+ * Wake lock broker.
+ *
+ * Clients connect to the broker unix socket and send the name of their lock,
+ * the lock is then held for as long as the connection stays open, whatever
+ * the way the client dies. All client locks are aggregated into a single
+ * kernel wake lock, so that sysfs is only written on aggregate busy/idle
+ * transitions.
+ *
+ * Messages are SOCK_SEQPACKET datagrams, with a one byte opcode:
+ *   'L' <name>	hold lock <name> until disconnect, acked with a 4-byte status
+ *   'S'		dump per-client accounting, one message per client, then
+ *			disconnect
+ *   'T'		dump per lock name statistics, one message per name, then
+ *			disconnect
+ */
+
+static const char path_broker[] = "/run/syspower-lockd.sock";
+
+#define BROKER_LOCK_NAME	"syspower-broker"
+#define BROKER_NAME_LEN		64
+#define BROKER_MSG_LEN		(BROKER_NAME_LEN + 1)
+#define BROKER_OP_LOCK		'L'
+#define BROKER_OP_STATS		'S'
+#define BROKER_OP_LOCK_STATS	'T'
+
+struct broker_client {
+	char name[BROKER_NAME_LEN + 1];
+	pid_t pid;
+	uid_t uid;
+	bool locked;
+	uint64_t since_ms;
+	struct wakelock_stat *stat;
+};
+
+static struct {
+	struct pollfd *fds; /* fds[0] is the listening socket */
+	struct broker_client *clients; /* indexed as fds */
+	unsigned int count;
+	unsigned int size;
+	unsigned int locked;
+	struct syspower_wakelock *wl;
+} broker;
+
+static void __broker_addr(struct sockaddr_un *addr, const char *path)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	strncpy(addr->sun_path, path ? path : path_broker, sizeof(addr->sun_path) - 1);
+}
+
+int syspower_broker_lock(const char *path, const char *name)
+{
+	char msg[BROKER_MSG_LEN];
+	struct sockaddr_un addr;
+	size_t len;
+	int32_t status;
+	int fd, ret;
+
+	if (!name || !*name || (len = strlen(name)) > BROKER_NAME_LEN)
+		return -EINVAL;
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	__broker_addr(&addr, path);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)))
+		goto error;
+
+	msg[0] = BROKER_OP_LOCK;
+	memcpy(msg + 1, name, len);
+	if (WRITE_RETRY(fd, msg, len + 1) != (int)len + 1)
+		goto error;
+
+	/* Wait for the broker to actually hold the kernel lock */
+	ret = READ_RETRY(fd, &status, sizeof(status));
+	if (ret != sizeof(status)) {
+		errno = ret < 0 ? errno : ECONNRESET;
+		goto error;
+	}
+
+	if (status) {
+		close(fd);
+		return status;
+	}
+
+	return fd;
+
+error:
+	ret = -errno;
+	close(fd);
+	return ret;
+}
+
+void syspower_broker_unlock(int fd)
+{
+	if (fd >= 0)
+		close(fd);
+}
+
+/* Connect and send a single opcode request */
+static int __broker_request(const char *path, char op)
+{
+	struct sockaddr_un addr;
+	int fd, ret;
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	__broker_addr(&addr, path);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    WRITE_RETRY(fd, &op, 1) != 1) {
+		ret = -errno;
+		close(fd);
+		return ret;
+	}
+
+	return fd;
+}
+
+int syspower_broker_clients(const char *path,
+			    void (*cb)(const struct syspower_broker_client *client,
+				       void *data),
+			    void *data)
+{
+	struct syspower_broker_client client;
+	char buf[256];
+	int fd, ret;
+
+	fd = __broker_request(path, BROKER_OP_STATS);
+	if (fd < 0)
+		return fd;
+
+	while ((ret = READ_RETRY(fd, buf, sizeof(buf) - 1)) > 0) {
+		buf[ret] = '\0';
+		if (sscanf(buf, "%d %u %64s %"SCNu64, &client.pid, &client.uid,
+			   client.name, &client.held_ms) == 4)
+			cb(&client, data);
+	}
+
+	ret = ret < 0 ? -errno : 0;
+	close(fd);
+
+	return ret;
+}
+
+int syspower_broker_wakelock_stats(const char *path,
+				   void (*cb)(const struct syspower_wakelock_stats *stats,
+					      void *data),
+				   void *data)
+{
+	struct syspower_wakelock_stats stats;
+	char name[BROKER_NAME_LEN + 1];
+	char buf[512];
+	int fd, ret, n, i;
+	char *p;
+
+	fd = __broker_request(path, BROKER_OP_LOCK_STATS);
+	if (fd < 0)
+		return fd;
+
+	stats.name = name;
+
+	while ((ret = READ_RETRY(fd, buf, sizeof(buf) - 1)) > 0) {
+		buf[ret] = '\0';
+		if (sscanf(buf, "%64s %"SCNu64" %"SCNu64" %"SCNu64" %"SCNu64"%n",
+			   name, &stats.acquire_count, &stats.current_hold_ms,
+			   &stats.total_hold_ms, &stats.max_hold_ms, &n) != 5)
+			continue;
+
+		for (p = buf + n, i = 0; i < SYSPOWER_WAKELOCK_HIST_BUCKETS; i++)
+			stats.hist[i] = strtoull(p, &p, 10);
+
+		cb(&stats, data);
+	}
+
+	ret = ret < 0 ? -errno : 0;
+	close(fd);
+
+	return ret;
+}
+
+static int __broker_add(int fd)
+{
+	struct broker_client *client;
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (broker.count == broker.size) {
+		unsigned int size = broker.size ? broker.size * 2 : 16;
+		struct broker_client *clients;
+		struct pollfd *fds;
+
+		fds = realloc(broker.fds, size * sizeof(*fds));
+		if (!fds)
+			return -ENOMEM;
+		broker.fds = fds;
+
+		clients = realloc(broker.clients, size * sizeof(*clients));
+		if (!clients)
+			return -ENOMEM;
+		broker.clients = clients;
+
+		broker.size = size;
+	}
+
+	client = &broker.clients[broker.count];
+	memset(client, 0, sizeof(*client));
+
+	if (!getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len)) {
+		client->pid = cred.pid;
+		client->uid = cred.uid;
+	}
+
+	broker.fds[broker.count].fd = fd;
+	broker.fds[broker.count].events = POLLIN;
+	broker.fds[broker.count].revents = 0;
+	broker.count++;
+
+	return 0;
+}
+
+static void __broker_remove(unsigned int i)
+{
+	struct broker_client *client = &broker.clients[i];
+
+	if (client->locked) {
+		__wakelock_stat_unhold(client->stat);
+		if (!--broker.locked)
+			syspower_wakelock_release(broker.wl);
+	}
+
+	close(broker.fds[i].fd);
+
+	/* Move last entry to the free slot */
+	broker.count--;
+	broker.fds[i] = broker.fds[broker.count];
+	broker.clients[i] = broker.clients[broker.count];
+}
+
+/*
+ * Replies never block the broker loop, a client not reading them would stall
+ * lock service for everyone: the client is dropped once its socket is full.
+ */
+static int __broker_send(int fd, const void *buf, size_t len)
+{
+	ssize_t ret;
+
+	do {
+		ret = send(fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+	} while (ret < 0 && errno == EINTR);
+
+	return ret < 0 ? -errno : 0;
+}
+
+static void __broker_stats(int fd)
+{
+	uint64_t now = __clock_ns(CLOCK_BOOTTIME) / 1000000;
+	unsigned int i;
+	char buf[256];
+	int len;
+
+	for (i = 1; i < broker.count; i++) {
+		struct broker_client *client = &broker.clients[i];
+
+		if (!client->locked)
+			continue;
+
+		len = snprintf(buf, sizeof(buf), "%d %u %s %"PRIu64"\n",
+			       (int)client->pid, (unsigned int)client->uid,
+			       client->name, now - client->since_ms);
+		if (__broker_send(fd, buf, len))
+			break;
+	}
+}
+
+static void __broker_lock_stats(int fd)
+{
+	struct syspower_wakelock_stats stats;
+	unsigned int i = 0, j;
+	char buf[512];
+	int len;
+
+	while (!syspower_wakelock_stats_get(i++, &stats)) {
+		len = snprintf(buf, sizeof(buf), "%s %"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64,
+			       stats.name, stats.acquire_count, stats.current_hold_ms,
+			       stats.total_hold_ms, stats.max_hold_ms);
+		for (j = 0; j < SYSPOWER_WAKELOCK_HIST_BUCKETS; j++)
+			len += snprintf(buf + len, sizeof(buf) - len, " %"PRIu64,
+					stats.hist[j]);
+		if (__broker_send(fd, buf, len))
+			break;
+	}
+}
+
+static int __broker_process(unsigned int i)
+{
+	struct broker_client *client = &broker.clients[i];
+	char msg[BROKER_MSG_LEN + 1];
+	int32_t status = 0;
+	int ret;
+
+	ret = READ_RETRY(broker.fds[i].fd, msg, BROKER_MSG_LEN);
+	if (ret <= 0)
+		return -ECONNRESET;
+
+	msg[ret] = '\0';
+
+	switch (msg[0]) {
+	case BROKER_OP_LOCK:
+		if (client->locked || ret < 2)
+			return -EPROTO;
+
+		memcpy(client->name, msg + 1, ret);
+		client->since_ms = __clock_ns(CLOCK_BOOTTIME) / 1000000;
+		client->locked = true;
+		client->stat = __wakelock_stat_intern(client->name);
+		__wakelock_stat_acquire(client->stat);
+		__wakelock_stat_hold(client->stat);
+
+		if (!broker.locked++)
+			status = syspower_wakelock_acquire(broker.wl);
+
+		if (__broker_send(broker.fds[i].fd, &status, sizeof(status)) || status)
+			return -ECONNRESET;
+		break;
+	case BROKER_OP_STATS:
+		__broker_stats(broker.fds[i].fd);
+		return -ECONNRESET;
+	case BROKER_OP_LOCK_STATS:
+		__broker_lock_stats(broker.fds[i].fd);
+		return -ECONNRESET;
+	default:
+		return -EPROTO;
+	}
+
+	return 0;
+}
+
+int syspower_broker_run(const char *path)
+{
+	struct sockaddr_un addr;
+	unsigned int i;
+	int fd, ret;
+
+	broker.wl = syspower_wakelock_create(BROKER_LOCK_NAME);
+	if (!broker.wl)
+		return -errno;
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		ret = -errno;
+		goto err_wl;
+	}
+
+	__broker_addr(&addr, path);
+	unlink(addr.sun_path);
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 64)) {
+		ret = -errno;
+		close(fd);
+		goto err_wl;
+	}
+
+	ret = __broker_add(fd);
+	if (ret) {
+		close(fd);
+		goto err_wl;
+	}
+
+	while (1) {
+		ret = poll(broker.fds, broker.count, -1);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0) {
+			ret = -errno;
+			break;
+		}
+
+		/* Walk backward, __broker_remove moves the last entry */
+		for (i = broker.count - 1; i > 0; i--) {
+			if (!broker.fds[i].revents)
+				continue;
+
+			if (__broker_process(i))
+				__broker_remove(i);
+		}
+
+		if (broker.fds[0].revents & POLLIN) {
+			int cfd = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+
+			if (cfd >= 0 && __broker_add(cfd))
+				close(cfd);
+		}
+	}
+
+	while (broker.count > 1)
+		__broker_remove(broker.count - 1);
+
+	close(fd);
+	unlink(addr.sun_path);
+	free(broker.fds);
+	free(broker.clients);
+	broker.fds = NULL;
+	broker.clients = NULL;
+	broker.count = broker.size = 0;
+
+err_wl:
+	syspower_wakelock_destroy(broker.wl);
+	broker.wl = NULL;
+
+	return ret;
+}
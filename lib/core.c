@@ -19,23 +19,20 @@
 #include <libgen.h>
 #include <libudev.h>
 
+#include "internal.h"
+
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
-#include <linux/rtc.h>
 #include <linux/limits.h>
 
 
-#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
-
 static const char path_autosleep[] = "/sys/power/autosleep";
-static const char path_wake_unlock[] = "/sys/power/wake_unlock";
-static const char path_wake_lock[] = "/sys/power/wake_lock";
 static const char path_state[] = "/sys/power/state";
 static const char path_wakeup_irq[] = "/sys/power/pm_wakeup_irq";
-static const char path_rtc_dev[] = "/dev/rtc";
 static const char path_supply[128] = "/sys/class/power_supply";
 static struct udev_monitor *udevmon;
+static unsigned int udevmon_filter;
 
 #define WAKEDEV_COUNT 128
 
@@ -45,11 +42,8 @@ struct wakeup_source {
 };
 
 static struct {
-	int fd_lock;
-	int fd_unlock;
 	int fd_state;
 	int fd_autosleep;
-	int fd_rtc;
 	unsigned int sleep_mask;
 	struct wakeup_source *wakeup_cache[WAKEDEV_COUNT];
 } syspower;
@@ -61,44 +55,7 @@ static const char *sleep_state[] = {
 	[SYSPOWER_SLEEP_TYPE_HIBERNATE] = "disk\n",
 };
 
-static inline int OPEN_RETRY(const char *path, int flags)
-{
-	int fd;
-
-	do {
-		fd = open(path, flags | O_SYNC);
-	} while (fd == -1 && errno == EINTR);
-
-	/* If required pseudo-file not present, operation is not supported */
-	if (fd == -1 && errno == ENOENT)
-		errno = ENOTSUP;
-
-	return fd;
-}
-
-static inline int READ_RETRY(int fd, void *buf, size_t len)
-{
-	int ret;
-
-	do {
-		ret = read(fd, buf, len);
-	} while (ret == -1 && errno == EINTR);
-
-	return ret;
-}
-
-static inline int WRITE_RETRY(int fd, const void *buf, size_t len)
-{
-	int ret;
-
-	do {
-		ret = write(fd, buf, len);
-	} while (ret == -1 && errno == EINTR);
-
-	return ret;
-}
-
-static int __open_once(int *fd, const char *path, int flags)
+int __open_once(int *fd, const char *path, int flags)
 {
 	int file;
 
@@ -113,46 +70,6 @@ static int __open_once(int *fd, const char *path, int flags)
 	return 0;
 }
 
-int syspower_rtc_wakealarm(unsigned int seconds, bool wait)
-{
-	struct rtc_time rtc_tm;
-	unsigned long data;
-	int ret;
-
-	if ((ret = __open_once(&syspower.fd_rtc, path_rtc_dev, O_RDWR)))
-		return ret;
-
-	ret = ioctl(syspower.fd_rtc, RTC_RD_TIME, &rtc_tm);
-	if (ret == -1)
-		return -errno;
-
-	rtc_tm.tm_sec += seconds;
-	if (rtc_tm.tm_sec >= 60) {
-		rtc_tm.tm_sec %= 60;
-		rtc_tm.tm_min++;
-	}
-	if (rtc_tm.tm_min == 60) {
-		rtc_tm.tm_min = 0;
-		rtc_tm.tm_hour++;
-	}
-	if (rtc_tm.tm_hour == 24)
-		rtc_tm.tm_hour = 0;
-
-	ret = ioctl(syspower.fd_rtc, RTC_ALM_SET, &rtc_tm);
-	if (ret == -1)
-		return -errno;
-
-	ioctl(syspower.fd_rtc, RTC_UIE_OFF, 0);
-	ret = ioctl(syspower.fd_rtc, RTC_AIE_ON, 0);
-	if (ret == -1)
-		return -errno;
-
-	if (wait)
-		ret = READ_RETRY(syspower.fd_rtc, &data, sizeof(unsigned long));
-
-	return ret;
-}
-
 int syspower_autosleep_enable(enum syspower_sleep_type type)
 {
 	int ret, len;
@@ -201,34 +118,16 @@ int syspower_suspend(enum syspower_sleep_type type)
 	if ((ret = __open_once(&syspower.fd_state, path_state, O_RDWR)))
 		return ret;
 
-	ret = WRITE_RETRY(syspower.fd_state, sleep_state[type], len);
-	if (ret != (int)len)
-		return -errno;
-
-	return 0;
-}
-
-int syspower_wake_lock(const char *name, unsigned int timeout_ms)
-{
-	char buf[128];
-	size_t len;
-	int ret;
-
-	if ((ret = __open_once(&syspower.fd_lock, path_wake_lock, O_WRONLY)))
-		return ret;
-
-	if (timeout_ms)
-		sprintf(buf, "%s %"PRIu64"\n", name, (uint64_t)timeout_ms * 1000 * 1000);
-	else
-		sprintf(buf, "%s\n", name);
+	__residency_update();
+	__event_emit(SYSPOWER_EVENT_SUSPEND, "suspend", type, 1, 0);
 
-	len = strlen(buf) + 1;
+	ret = WRITE_RETRY(syspower.fd_state, sleep_state[type], len);
+	ret = ret != (int)len ? -errno : 0;
 
-	ret = WRITE_RETRY(syspower.fd_lock, buf, len);
-	if (ret != (int)len)
-		return -errno;
+	__event_emit(SYSPOWER_EVENT_SUSPEND, "suspend", type, 0, 0);
+	__residency_update();
 
-	return 0;
+	return ret;
 }
 
 int syspower_wakeup_reason(char *reason, size_t reason_len)
@@ -258,25 +157,13 @@ int syspower_wakeup_reason(char *reason, size_t reason_len)
 
 	close(fd);
 
-	return irq;
-}
-
-int syspower_wake_unlock(const char *name)
-{
-	size_t len = strlen(name) + 1;
-	int ret;
-
-	if ((ret = __open_once(&syspower.fd_unlock, path_wake_unlock, O_RDWR)))
-		return -errno;
-
-	ret = WRITE_RETRY(syspower.fd_unlock, name, len);
-	if (ret != (int)len)
-		return -errno;
+	if (ret > 0)
+		__event_emit(SYSPOWER_EVENT_WAKEUP, reason, 0, irq, 0);
 
-	return 0;
+	return irq;
 }
 
-static int __read_attribute(char *value, const char *path, const char *name)
+int __read_attribute(char *value, const char *path, const char *name)
 {
 	char attr_path[PATH_MAX + 1];
 	int fd, ret;
@@ -301,7 +188,7 @@ static int __read_attribute(char *value, const char *path, const char *name)
 	return 0;
 }
 
-static int __write_attribute(char *value, const char *path, const char *name)
+int __write_attribute(char *value, const char *path, const char *name)
 {
 	char attr_path[PATH_MAX + 1];
 	int fd, ret;
@@ -323,7 +210,78 @@ static int __write_attribute(char *value, const char *path, const char *name)
 	return 0;
 }
 
-static void __sysfs_devices_parse(char *path, void (*cb)(char *devpath))
+int __open_attribute(const char *path, const char *name, int flags)
+{
+	char attr_path[PATH_MAX + 1];
+	int fd;
+
+	snprintf(attr_path, sizeof(attr_path), "%s/%s", path, name);
+
+	fd = OPEN_RETRY(attr_path, flags | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	return fd;
+}
+
+int __pread_attribute(int fd, char *value, size_t len)
+{
+	int ret;
+
+	do {
+		ret = pread(fd, value, len - 1, 0);
+	} while (ret == -1 && errno == EINTR);
+
+	if (ret < 0)
+		return -errno;
+
+	/* remove \n from attribute */
+	if (ret && value[ret - 1] == '\n')
+		ret--;
+	value[ret] = '\0';
+
+	return ret;
+}
+
+int __pread_u64(int fd, uint64_t *value)
+{
+	char attr[32];
+	int ret;
+
+	ret = __pread_attribute(fd, attr, sizeof(attr));
+	if (ret < 0)
+		return ret;
+
+	*value = strtoull(attr, NULL, 0);
+
+	return 0;
+}
+
+int __pwrite_attribute(int fd, const char *value)
+{
+	size_t len = strlen(value);
+	int ret;
+
+	do {
+		ret = pwrite(fd, value, len, 0);
+	} while (ret == -1 && errno == EINTR);
+
+	if (ret != (int)len)
+		return -errno;
+
+	return 0;
+}
+
+uint64_t __clock_ns(clockid_t clk)
+{
+	struct timespec ts;
+
+	clock_gettime(clk, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void __sysfs_devices_parse(char *path, void (*cb)(char *devpath))
 {
 	size_t len = strlen(path);
 	struct dirent *dir;
@@ -480,32 +438,38 @@ char *syspower_supply_get(unsigned int index)
 	return supply;
 }
 
+/*
+ * Supply getters go through the held fds of supply_worker.c, so that the
+ * supply deadline applies to them too (last known value once exceeded).
+ */
+static int __supply_attribute(const char *supplyname, const char *name,
+			      char *value, size_t len)
+{
+	bool stale;
+	int ret;
+
+	ret = __supply_read(supplyname, name, value, len, -1, &stale);
+
+	return ret < 0 ? ret : 0;
+}
+
 bool syspower_supply_present(const char *supplyname)
 {
-	char path[128];
 	char attr[8] = "";
 
-	sprintf(path, "%s/%s", path_supply, supplyname);
-	__read_attribute(attr, path, "present");
+	__supply_attribute(supplyname, "present", attr, sizeof(attr));
 	if (!strncmp("1", attr, strlen("1")))
 		return true;
 
-	sprintf(path, "%s/%s", path_supply, supplyname);
-	__read_attribute(attr, path, "online");
+	__supply_attribute(supplyname, "online", attr, sizeof(attr));
 	if (!strncmp("1", attr, strlen("1")))
 		return true;
 
 	return false;
 }
 
-enum syspower_supply_type syspower_supply_type(const char *supplyname)
+enum syspower_supply_type __supply_type_parse(const char *attr)
 {
-	char path[128];
-	char attr[128] = "";
-
-	sprintf(path, "%s/%s", path_supply, supplyname);
-	__read_attribute(attr, path, "type");
-
 	if (!strncmp("Battery", attr, strlen("Battery")))
 		return SYSPOWER_SUPPLY_TYPE_BATTERY;
 	if (!strncmp("USB", attr, strlen("USB")))
@@ -524,27 +488,51 @@ enum syspower_supply_type syspower_supply_type(const char *supplyname)
 	return SYSPOWER_SUPPLY_TYPE_UNKNOWN;
 }
 
+enum syspower_supply_type syspower_supply_type(const char *supplyname)
+{
+	char attr[256] = "";
+
+	__supply_attribute(supplyname, "type", attr, sizeof(attr));
+
+	return __supply_type_parse(attr);
+}
+
+int __supply_first_battery(char *name, size_t len)
+{
+	unsigned int i;
+	char *supply;
+
+	for (i = 0; (supply = syspower_supply_get(i)); i++) {
+		bool battery = syspower_supply_type(supply) == SYSPOWER_SUPPLY_TYPE_BATTERY;
+
+		if (battery)
+			snprintf(name, len, "%s", supply);
+		free(supply);
+		if (battery)
+			return 0;
+	}
+
+	return -ENODEV;
+}
+
 int syspower_supply_current(const char *supplyname,
 			    enum syspower_supply_current current_type)
 {
-	char attr[10] = "0";
-	char path[128];
+	char attr[16] = "0";
 	int ret, mA;
 
 	if (current_type > SYSPOWER_SUPPLY_CURRENT_MAX)
 		return -EINVAL;
 
-	sprintf(path, "%s/%s", path_supply, supplyname);
-
 	switch (current_type) {
 	case SYSPOWER_SUPPLY_CURRENT_MAX:
-		ret = __read_attribute(attr, path, "current_max");
+		ret = __supply_attribute(supplyname, "current_max", attr, sizeof(attr));
 		break;
 	case SYSPOWER_SUPPLY_CURRENT_AVG:
-		ret = __read_attribute(attr, path, "current_avg");
+		ret = __supply_attribute(supplyname, "current_avg", attr, sizeof(attr));
 		break;
 	case SYSPOWER_SUPPLY_CURRENT_NOW:
-		ret = __read_attribute(attr, path, "current_now");
+		ret = __supply_attribute(supplyname, "current_now", attr, sizeof(attr));
 		break;
 	default:
 		return -EINVAL;
@@ -562,27 +550,24 @@ int syspower_supply_current(const char *supplyname,
 int syspower_supply_voltage(const char *supplyname,
 			    enum syspower_supply_voltage voltage_type)
 {
-	char attr[10] = "0";
-	char path[128];
+	char attr[16] = "0";
 	int ret, mV;
 
 	if (voltage_type > SYSPOWER_SUPPLY_VOLTAGE_MAX)
 		return -EINVAL;
 
-	sprintf(path, "%s/%s", path_supply, supplyname);
-
 	switch (voltage_type) {
 	case SYSPOWER_SUPPLY_VOLTAGE_AVG:
-		ret = __read_attribute(attr, path, "voltage_avg");
+		ret = __supply_attribute(supplyname, "voltage_avg", attr, sizeof(attr));
 		break;
 	case SYSPOWER_SUPPLY_VOLTAGE_MAX:
-		ret = __read_attribute(attr, path, "voltage_max");
+		ret = __supply_attribute(supplyname, "voltage_max", attr, sizeof(attr));
 		break;
 	case SYSPOWER_SUPPLY_VOLTAGE_MIN:
-		ret = __read_attribute(attr, path, "voltage_min");
+		ret = __supply_attribute(supplyname, "voltage_min", attr, sizeof(attr));
 		break;
 	case SYSPOWER_SUPPLY_VOLTAGE_NOW:
-		ret = __read_attribute(attr, path, "voltage_now");
+		ret = __supply_attribute(supplyname, "voltage_now", attr, sizeof(attr));
 		break;
 	default:
 		return -EINVAL;
@@ -614,16 +599,25 @@ static const char *supply_health[] = {
 	"No battery"
 };
 
-enum syspower_supply_health syspower_supply_health(const char *supplyname, char *health_str)
+enum syspower_supply_health __supply_health_parse(const char *attr)
 {
-	char attr[30] = "0";
 	unsigned int i = 0;
-	char path[128];
-	int ret;
 
-	sprintf(path, "%s/%s", path_supply, supplyname);
+	while (i < ARRAY_SIZE(supply_health)) {
+		if (!strncmp(supply_health[i], attr, strlen(supply_health[i])))
+			return i;
+		i++;
+	}
+
+	return -EINVAL;
+}
+
+enum syspower_supply_health syspower_supply_health(const char *supplyname, char *health_str)
+{
+	char attr[256] = "0";
+	int ret;
 
-	ret  = __read_attribute(attr, path, "health");
+	ret = __supply_attribute(supplyname, "health", attr, sizeof(attr));
 	if (ret) {
 		strcpy(health_str, "Unknown");
 		return SYSPOWER_SUPPLY_HEALTH_UNKWOWN;
@@ -632,56 +626,38 @@ enum syspower_supply_health syspower_supply_health(const char *supplyname, char
 	if (health_str)
 		strcpy(health_str, attr);
 
-	while (i < ARRAY_SIZE(supply_health)) {
-		if (!strncmp(supply_health[i], attr, strlen(supply_health[i])))
-			return i;
-		i++;
-	}
-
-	return -EINVAL;
+	return __supply_health_parse(attr);
 }
 
 uint8_t syspower_supply_capacity(const char *supplyname)
 {
-	char path[128];
 	char attr[8] = "255";
 
-	sprintf(path, "%s/%s", path_supply, supplyname);
-	__read_attribute(attr, path, "capacity");
+	__supply_attribute(supplyname, "capacity", attr, sizeof(attr));
 
 	return (uint8_t)atoi(attr);
 }
 
 uint8_t syspower_supply_capacity_min(const char *supplyname)
 {
-	char path[128];
 	char attr[8] = "255";
 
-	sprintf(path, "%s/%s", path_supply, supplyname);
-	__read_attribute(attr, path, "capacity_alert_min");
+	__supply_attribute(supplyname, "capacity_alert_min", attr, sizeof(attr));
 
 	return (uint8_t)atoi(attr);
 }
 
 uint8_t syspower_supply_capacity_max(const char *supplyname)
 {
-	char path[128];
 	char attr[8] = "255";
 
-	sprintf(path, "%s/%s", path_supply, supplyname);
-	__read_attribute(attr, path, "capacity_alert_max");
+	__supply_attribute(supplyname, "capacity_alert_max", attr, sizeof(attr));
 
 	return (uint8_t)atoi(attr);
 }
 
-enum syspower_supply_status syspower_supply_status(const char *supplyname)
+enum syspower_supply_status __supply_status_parse(const char *attr)
 {
-	char attr[32] = "";
-	char path[128];
-
-	sprintf(path, "%s/%s", path_supply, supplyname);
-	__read_attribute(attr, path, "status");
-
 	if (!strncmp("Charging", attr, strlen("USB")))
 		return SYSPOWER_BATTERY_STATUS_CHARGING;
 	if (!strncmp("Discharging", attr, strlen("UPS")))
@@ -694,9 +670,24 @@ enum syspower_supply_status syspower_supply_status(const char *supplyname)
 		return SYSPOWER_BATTERY_STATUS_UNKWOWN;
 }
 
-int syspower_supply_get_monitorfd(void)
+enum syspower_supply_status syspower_supply_status(const char *supplyname)
+{
+	char attr[256] = "";
+
+	__supply_attribute(supplyname, "status", attr, sizeof(attr));
+
+	return __supply_status_parse(attr);
+}
+
+/*
+ * A single uevent monitor is shared by power_supply and thermal users, so that
+ * one fd drives both. Subsystems are added to the filter on first use.
+ */
+int __monitor_get(const char *subsystem)
 {
+	static const char *subsystems[] = { "power_supply", "thermal" };
 	struct udev *udev;
+	unsigned int i;
 
 	if (udevmon) {
 		udev = udev_ref(udev_monitor_get_udev(udevmon));
@@ -704,30 +695,90 @@ int syspower_supply_get_monitorfd(void)
 	} else {
 		udev = udev_new();
 		udevmon = udev_monitor_new_from_netlink(udev, "kernel");
-		udev_monitor_filter_add_match_subsystem_devtype(udevmon, "power_supply", NULL);
+		if (!udevmon) {
+			udev_unref(udev);
+			return -ENOMEM;
+		}
 		udev_monitor_enable_receiving(udevmon);
 	}
 
+	for (i = 0; i < ARRAY_SIZE(subsystems); i++) {
+		if (strcmp(subsystem, subsystems[i]) || udevmon_filter & (1 << i))
+			continue;
+
+		udev_monitor_filter_add_match_subsystem_devtype(udevmon, subsystem, NULL);
+		udev_monitor_filter_update(udevmon);
+		udevmon_filter |= 1 << i;
+	}
+
 	return udev_monitor_get_fd(udevmon);
 }
 
-int syspower_supply_read_monitorfd(int fd, char *supplyname, size_t maxlen)
+void __monitor_put(void)
 {
-	struct udev_device *dev;
+	udev_unref(udev_monitor_get_udev(udevmon));
+	udevmon = udev_monitor_unref(udevmon);
+	if (!udevmon)
+		udevmon_filter = 0;
+}
 
-	if (fd < 0 || !udevmon)
-		return -EINVAL;
+/* Receive one uevent, return 1 if it was a thermal one (handled internally) */
+static int __monitor_receive(char *supplyname, size_t maxlen)
+{
+	struct udev_device *dev;
+	const char *subsystem, *sysname;
+	int ret = 0;
 
 	dev = udev_monitor_receive_device(udevmon);
 	if (!dev)
 		return -errno;
 
-	if (supplyname)
-		strncpy(supplyname, udev_device_get_sysname(dev), maxlen);
+	subsystem = udev_device_get_subsystem(dev);
+	sysname = udev_device_get_sysname(dev);
+
+	if (subsystem && !strcmp(subsystem, "thermal")) {
+		__thermal_uevent(sysname);
+		ret = 1;
+	} else {
+		if (supplyname)
+			strncpy(supplyname, sysname, maxlen);
+		__event_emit(SYSPOWER_EVENT_SUPPLY, sysname, 0, 0, 0);
+	}
 
 	udev_device_unref(dev);
 
-	return 0;
+	return ret;
+}
+
+int syspower_supply_get_monitorfd(void)
+{
+	return __monitor_get("power_supply");
+}
+
+int syspower_supply_read_monitorfd(int fd, char *supplyname, size_t maxlen)
+{
+	int ret;
+
+	if (fd < 0 || !udevmon)
+		return -EINVAL;
+
+	ret = __monitor_receive(supplyname, maxlen);
+
+	return ret > 0 ? -EAGAIN : ret;
+}
+
+int syspower_monitor_dispatch(int fd)
+{
+	int count = 0;
+
+	if (fd < 0 || !udevmon)
+		return -EINVAL;
+
+	/* Drain pending uevents, listeners are notified through events */
+	while (__monitor_receive(NULL, 0) >= 0)
+		count++;
+
+	return count;
 }
 
 void syspower_supply_put_monitorfd(int fd)
@@ -735,6 +786,5 @@ void syspower_supply_put_monitorfd(int fd)
 	if (fd < 0)
 		return;
 
-	udev_unref(udev_monitor_get_udev(udevmon));
-	udevmon = udev_monitor_unref(udevmon);
+	__monitor_put();
 }
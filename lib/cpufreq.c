@@ -0,0 +1,304 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * This file is part of libsyspower.
+ *
+ * Copyright (C) 2022 Loic Poulain <loic.poulain@linaro.org>
+ */
+
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <syspower.h>
+
+#include <linux/limits.h>
+
+#include "internal.h"
+
+/*
+ * cpufreq policies are discovered once, their attributes are kept open and
+ * sampled with pread() into preallocated structs, so that sampling all the
+ * policies is allocation free and costs a handful of syscalls per policy.
+ */
+
+static const char path_cpufreq[] = "/sys/devices/system/cpu/cpufreq";
+
+struct cpufreq_policy {
+	int fd_cur;
+	int fd_min;
+	int fd_max;
+	int fd_time_in_state;
+	uint32_t written_max_khz; /* last cap written by us, 0 if none */
+	struct syspower_cpufreq_policy policy;
+};
+
+struct syspower_cpufreq {
+	struct cpufreq_policy *policies;
+	unsigned int count;
+};
+
+static uint32_t __read_khz(const char *path, const char *name)
+{
+	char value[256];
+
+	if (__read_attribute(value, path, name))
+		return 0;
+
+	return strtoul(value, NULL, 0);
+}
+
+static void __cpufreq_cpus(struct syspower_cpufreq_policy *policy, const char *path)
+{
+	char value[256], *p = value;
+
+	if (__read_attribute(value, path, "related_cpus"))
+		return;
+
+	policy->cpu_count = 0;
+	policy->first_cpu = strtoul(p, NULL, 0);
+
+	while (*p) {
+		strtoul(p, &p, 0);
+		policy->cpu_count++;
+		p += strspn(p, " ");
+	}
+}
+
+static int __cpufreq_policy_init(struct cpufreq_policy *p, const char *base,
+				 const char *name)
+{
+	struct syspower_cpufreq_policy *policy = &p->policy;
+	char path[PATH_MAX + 1];
+
+	snprintf(path, sizeof(path), "%s/%s", base, name);
+	snprintf(policy->name, sizeof(policy->name), "%s", name);
+
+	p->fd_cur = __open_attribute(path, "scaling_cur_freq", O_RDONLY);
+	if (p->fd_cur < 0)
+		return p->fd_cur;
+
+	p->fd_min = __open_attribute(path, "scaling_min_freq", O_RDWR);
+	if (p->fd_min == -EACCES)
+		p->fd_min = __open_attribute(path, "scaling_min_freq", O_RDONLY);
+	p->fd_max = __open_attribute(path, "scaling_max_freq", O_RDWR);
+	if (p->fd_max == -EACCES)
+		p->fd_max = __open_attribute(path, "scaling_max_freq", O_RDONLY);
+	p->fd_time_in_state = __open_attribute(path, "stats/time_in_state", O_RDONLY);
+
+	policy->hw_min_khz = __read_khz(path, "cpuinfo_min_freq");
+	policy->hw_max_khz = __read_khz(path, "cpuinfo_max_freq");
+	__cpufreq_cpus(policy, path);
+
+	return 0;
+}
+
+static void __cpufreq_policy_close(struct cpufreq_policy *p)
+{
+	int fds[] = { p->fd_cur, p->fd_min, p->fd_max, p->fd_time_in_state };
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(fds); i++) {
+		if (fds[i] >= 0)
+			close(fds[i]);
+	}
+}
+
+static int __cmp_policy(const void *a, const void *b)
+{
+	const struct cpufreq_policy *pa = a, *pb = b;
+
+	return (int)pa->policy.first_cpu - (int)pb->policy.first_cpu;
+}
+
+struct syspower_cpufreq *syspower_cpufreq_open(const char *path)
+{
+	struct syspower_cpufreq *cf;
+	struct dirent *dir;
+	DIR *d;
+
+	if (!path)
+		path = path_cpufreq;
+
+	d = opendir(path);
+	if (!d)
+		return NULL;
+
+	cf = calloc(1, sizeof(*cf));
+	if (!cf)
+		goto error;
+
+	while ((dir = readdir(d))) {
+		struct cpufreq_policy *policies;
+
+		if (strncmp(dir->d_name, "policy", strlen("policy")))
+			continue;
+
+		policies = realloc(cf->policies, (cf->count + 1) * sizeof(*policies));
+		if (!policies)
+			goto error;
+		cf->policies = policies;
+
+		memset(&policies[cf->count], 0, sizeof(*policies));
+		if (!__cpufreq_policy_init(&policies[cf->count], path, dir->d_name))
+			cf->count++;
+	}
+
+	closedir(d);
+
+	qsort(cf->policies, cf->count, sizeof(*cf->policies), __cmp_policy);
+
+	return cf;
+
+error:
+	syspower_cpufreq_close(cf);
+	closedir(d);
+	errno = ENOMEM;
+	return NULL;
+}
+
+void syspower_cpufreq_close(struct syspower_cpufreq *cf)
+{
+	unsigned int i;
+
+	if (!cf)
+		return;
+
+	for (i = 0; i < cf->count; i++)
+		__cpufreq_policy_close(&cf->policies[i]);
+
+	free(cf->policies);
+	free(cf);
+}
+
+unsigned int syspower_cpufreq_count(struct syspower_cpufreq *cf)
+{
+	return cf ? cf->count : 0;
+}
+
+const struct syspower_cpufreq_policy *syspower_cpufreq_get(struct syspower_cpufreq *cf,
+							   unsigned int index)
+{
+	if (!cf || index >= cf->count)
+		return NULL;
+
+	return &cf->policies[index].policy;
+}
+
+/* time_in_state: "<freq_khz> <time_10ms>" per line */
+static void __cpufreq_time_in_state(struct cpufreq_policy *p)
+{
+	struct syspower_cpufreq_policy *policy = &p->policy;
+	char buf[4096], *line = buf, *end;
+	unsigned int i = 0;
+
+	if (__pread_attribute(p->fd_time_in_state, buf, sizeof(buf)) <= 0)
+		return;
+
+	while (*line && i < SYSPOWER_CPUFREQ_MAX_STATES) {
+		uint32_t khz = strtoul(line, &end, 10);
+		uint64_t ms = strtoull(end, &end, 10) * 10;
+
+		if (end == line)
+			break;
+
+		/* frequency table is stable, a change resets the deltas */
+		if (policy->state_khz[i] != khz || ms < policy->time_in_state_ms[i])
+			policy->delta_ms[i] = 0;
+		else
+			policy->delta_ms[i] = ms - policy->time_in_state_ms[i];
+
+		policy->state_khz[i] = khz;
+		policy->time_in_state_ms[i] = ms;
+		i++;
+
+		line = end + strspn(end, "\n");
+	}
+
+	policy->nr_states = i;
+}
+
+int syspower_cpufreq_sample(struct syspower_cpufreq *cf)
+{
+	unsigned int i;
+	uint64_t value;
+
+	if (!cf)
+		return -EINVAL;
+
+	for (i = 0; i < cf->count; i++) {
+		struct cpufreq_policy *p = &cf->policies[i];
+
+		if (!__pread_u64(p->fd_cur, &value))
+			p->policy.cur_khz = value;
+		if (p->fd_min >= 0 && !__pread_u64(p->fd_min, &value))
+			p->policy.min_khz = value;
+		if (p->fd_max >= 0 && !__pread_u64(p->fd_max, &value))
+			p->policy.max_khz = value;
+		if (p->fd_time_in_state >= 0)
+			__cpufreq_time_in_state(p);
+	}
+
+	return 0;
+}
+
+int syspower_cpufreq_set_max(struct syspower_cpufreq *cf, unsigned int index,
+			     uint32_t max_khz)
+{
+	struct cpufreq_policy *p;
+	char value[16];
+	int ret;
+
+	if (!cf || index >= cf->count || !max_khz)
+		return -EINVAL;
+
+	p = &cf->policies[index];
+
+	/*
+	 * Skip writes of unchanged caps. scaling_max_freq reads back the
+	 * effective limit (thermal or QoS clamped, rounded), so compare with
+	 * what we wrote, unless it was raised above since (external writer).
+	 */
+	if (p->written_max_khz == max_khz && p->policy.max_khz <= max_khz)
+		return 0;
+
+	if (p->fd_max < 0)
+		return -ENOTSUP;
+
+	snprintf(value, sizeof(value), "%u", max_khz);
+	ret = __pwrite_attribute(p->fd_max, value);
+	if (ret)
+		return ret;
+
+	p->written_max_khz = max_khz;
+	p->policy.max_khz = max_khz;
+
+	return 1;
+}
+
+int syspower_cpufreq_set_max_all(struct syspower_cpufreq *cf,
+				 const uint32_t *max_khz)
+{
+	unsigned int i, written = 0;
+	int ret, err = 0;
+
+	if (!cf || !max_khz)
+		return -EINVAL;
+
+	for (i = 0; i < cf->count; i++) {
+		if (!max_khz[i])
+			continue;
+
+		ret = syspower_cpufreq_set_max(cf, i, max_khz[i]);
+		if (ret < 0)
+			err = ret;
+		else
+			written += ret;
+	}
+
+	return err ? err : (int)written;
+}
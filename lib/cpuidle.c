@@ -0,0 +1,254 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * This file is part of libsyspower.
+ *
+ * Copyright (C) 2022 Loic Poulain <loic.poulain@linaro.org>
+ */
+
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <syspower.h>
+
+#include <linux/limits.h>
+
+#include "internal.h"
+
+/*
+ * cpuidle states of all CPUs are discovered once and stored in a single flat
+ * array, ordered by CPU then state, each state starting on a cache line, so
+ * that a sample is a linear pass of pread() calls without any allocation.
+ */
+
+static const char path_cpu[] = "/sys/devices/system/cpu";
+
+#define CPUIDLE_CACHELINE 64
+
+struct cpuidle_entry {
+	int fd_usage;
+	int fd_time;
+	struct syspower_cpuidle_state state;
+} __attribute__((aligned(CPUIDLE_CACHELINE)));
+
+struct syspower_cpuidle {
+	struct cpuidle_entry *entries;
+	unsigned int count;
+	unsigned int size;
+	uint64_t timestamp_us;
+	uint64_t elapsed_us;
+};
+
+static struct cpuidle_entry *__cpuidle_new_entry(struct syspower_cpuidle *ci)
+{
+	struct cpuidle_entry *entries;
+	unsigned int size;
+
+	if (ci->count == ci->size) {
+		/* realloc() would not preserve the alignment */
+		size = ci->size ? ci->size * 2 : 64;
+		if (posix_memalign((void **)&entries, CPUIDLE_CACHELINE,
+				   size * sizeof(*entries)))
+			return NULL;
+
+		if (ci->entries)
+			memcpy(entries, ci->entries, ci->count * sizeof(*entries));
+		free(ci->entries);
+		ci->entries = entries;
+		ci->size = size;
+	}
+
+	entries = &ci->entries[ci->count];
+	memset(entries, 0, sizeof(*entries));
+
+	return entries;
+}
+
+static int __cpuidle_cpu(struct syspower_cpuidle *ci, const char *base,
+			 unsigned int cpu)
+{
+	char path[PATH_MAX + 1], value[256];
+	struct cpuidle_entry *e;
+	unsigned int state;
+	struct dirent *dir;
+	int ret;
+	char c;
+	DIR *d;
+
+	snprintf(path, sizeof(path), "%s/cpu%u/cpuidle", base, cpu);
+
+	d = opendir(path);
+	if (!d)
+		return 0;
+
+	while ((dir = readdir(d))) {
+		if (sscanf(dir->d_name, "state%u%c", &state, &c) != 1)
+			continue;
+
+		snprintf(path, sizeof(path), "%s/cpu%u/cpuidle/%s", base, cpu,
+			 dir->d_name);
+
+		e = __cpuidle_new_entry(ci);
+		if (!e) {
+			closedir(d);
+			return -ENOMEM;
+		}
+
+		e->fd_usage = __open_attribute(path, "usage", O_RDONLY);
+		e->fd_time = __open_attribute(path, "time", O_RDONLY);
+		/* A missing state would shift the indices of the following ones */
+		if (e->fd_usage < 0 || e->fd_time < 0) {
+			ret = e->fd_usage < 0 ? e->fd_usage : e->fd_time;
+			if (e->fd_usage >= 0)
+				close(e->fd_usage);
+			if (e->fd_time >= 0)
+				close(e->fd_time);
+			closedir(d);
+			return ret;
+		}
+
+		e->state.cpu = cpu;
+		e->state.index = state;
+		if (!__read_attribute(value, path, "name"))
+			snprintf(e->state.name, sizeof(e->state.name), "%.15s", value);
+		if (!__read_attribute(value, path, "latency"))
+			e->state.latency_us = strtoul(value, NULL, 0);
+
+		ci->count++;
+	}
+
+	closedir(d);
+
+	return 0;
+}
+
+static int __cmp_entry(const void *a, const void *b)
+{
+	const struct syspower_cpuidle_state *sa = &((const struct cpuidle_entry *)a)->state;
+	const struct syspower_cpuidle_state *sb = &((const struct cpuidle_entry *)b)->state;
+
+	if (sa->cpu != sb->cpu)
+		return sa->cpu < sb->cpu ? -1 : 1;
+
+	return (int)sa->index - (int)sb->index;
+}
+
+struct syspower_cpuidle *syspower_cpuidle_open(const char *path)
+{
+	struct syspower_cpuidle *ci;
+	struct dirent *dir;
+	unsigned int cpu;
+	int ret = -ENOMEM;
+	char c;
+	DIR *d;
+
+	if (!path)
+		path = path_cpu;
+
+	d = opendir(path);
+	if (!d)
+		return NULL;
+
+	ci = calloc(1, sizeof(*ci));
+	if (!ci)
+		goto error;
+
+	while ((dir = readdir(d))) {
+		/* skip cpufreq, cpuidle and friends */
+		if (sscanf(dir->d_name, "cpu%u%c", &cpu, &c) != 1)
+			continue;
+
+		ret = __cpuidle_cpu(ci, path, cpu);
+		if (ret)
+			goto error;
+	}
+
+	closedir(d);
+
+	qsort(ci->entries, ci->count, sizeof(*ci->entries), __cmp_entry);
+
+	return ci;
+
+error:
+	syspower_cpuidle_close(ci);
+	closedir(d);
+	errno = -ret;
+	return NULL;
+}
+
+void syspower_cpuidle_close(struct syspower_cpuidle *ci)
+{
+	unsigned int i;
+
+	if (!ci)
+		return;
+
+	for (i = 0; i < ci->count; i++) {
+		close(ci->entries[i].fd_usage);
+		close(ci->entries[i].fd_time);
+	}
+
+	free(ci->entries);
+	free(ci);
+}
+
+unsigned int syspower_cpuidle_count(struct syspower_cpuidle *ci)
+{
+	return ci ? ci->count : 0;
+}
+
+const struct syspower_cpuidle_state *syspower_cpuidle_get(struct syspower_cpuidle *ci,
+							  unsigned int index)
+{
+	if (!ci || index >= ci->count)
+		return NULL;
+
+	return &ci->entries[index].state;
+}
+
+int syspower_cpuidle_sample(struct syspower_cpuidle *ci)
+{
+	uint64_t now, usage, time_us;
+	unsigned int i;
+
+	if (!ci)
+		return -EINVAL;
+
+	now = __clock_ns(CLOCK_MONOTONIC) / 1000;
+	ci->elapsed_us = ci->timestamp_us ? now - ci->timestamp_us : 0;
+	ci->timestamp_us = now;
+
+	for (i = 0; i < ci->count; i++) {
+		struct syspower_cpuidle_state *s = &ci->entries[i].state;
+
+		if (__pread_u64(ci->entries[i].fd_usage, &usage) ||
+		    __pread_u64(ci->entries[i].fd_time, &time_us))
+			continue;
+
+		s->delta_usage = usage >= s->usage ? usage - s->usage : 0;
+		s->delta_time_us = time_us >= s->time_us ? time_us - s->time_us : 0;
+		s->usage = usage;
+		s->time_us = time_us;
+
+		/* Counters and clock are not read atomically, clamp */
+		if (!ci->elapsed_us)
+			s->residency_permille = 0;
+		else if (s->delta_time_us >= ci->elapsed_us)
+			s->residency_permille = 1000;
+		else
+			s->residency_permille = s->delta_time_us * 1000 / ci->elapsed_us;
+	}
+
+	return 0;
+}
+
+uint64_t syspower_cpuidle_elapsed_us(struct syspower_cpuidle *ci)
+{
+	return ci ? ci->elapsed_us : 0;
+}
@@ -0,0 +1,389 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * This file is part of libsyspower.
+ *
+ * Copyright (C) 2022 Loic Poulain <loic.poulain@linaro.org>
+ */
+
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <syspower.h>
+
+#include <linux/limits.h>
+
+#include "internal.h"
+
+/*
+ * devfreq devices (GPU, memory bus, DSP...) are discovered once and their
+ * attributes are kept open. The trans_stat table is sized at discovery, its
+ * transition and time matrices are preallocated so that sampling is only
+ * pread() and parsing.
+ *
+ * trans_stat format:
+ *      From  :   To
+ *            :  100000000 200000000   time(ms)
+ * *  100000000:         0         5       1000
+ *    200000000:         4         0       2000
+ * Total transition : 9
+ */
+
+static const char path_devfreq[] = "/sys/class/devfreq";
+
+#define DEVFREQ_TRANS_STAT_SIZE 4096 /* sysfs attributes are page sized */
+
+struct devfreq_device {
+	int fd_cur;
+	int fd_target;
+	int fd_min;
+	int fd_max;
+	int fd_trans_stat;
+	uint64_t written_min_hz; /* last bounds written by us, 0 if none */
+	uint64_t written_max_hz;
+	struct syspower_devfreq_device dev;
+};
+
+struct syspower_devfreq {
+	struct devfreq_device *devices;
+	unsigned int count;
+	char buf[DEVFREQ_TRANS_STAT_SIZE];
+};
+
+/* Skip the two header lines, return the first table row */
+static char *__trans_stat_rows(char *buf)
+{
+	unsigned int i;
+
+	for (i = 0; i < 2 && buf; i++) {
+		buf = strchr(buf, '\n');
+		if (buf)
+			buf++;
+	}
+
+	return buf;
+}
+
+static unsigned int __trans_stat_count(char *buf)
+{
+	unsigned int count = 0;
+	char *row = __trans_stat_rows(buf);
+
+	while (row && strchr(row, ':') && strncmp(row, "Total", strlen("Total"))) {
+		count++;
+		row = strchr(row, '\n');
+		if (row)
+			row++;
+	}
+
+	return count;
+}
+
+static int __devfreq_parse(struct syspower_devfreq_device *dev, char *buf)
+{
+	unsigned int n = dev->nr_states, i, j;
+	char *row = __trans_stat_rows(buf), *p;
+	uint64_t value;
+
+	for (i = 0; i < n && row; i++) {
+		p = row + strspn(row, " *");
+		dev->freq_hz[i] = strtoull(p, &p, 10);
+		if (*p != ':')
+			return -EINVAL;
+		p++;
+
+		for (j = 0; j < n; j++) {
+			value = strtoull(p, &p, 10);
+			dev->delta_trans[i * n + j] = value >= dev->trans[i * n + j] ?
+						      value - dev->trans[i * n + j] : 0;
+			dev->trans[i * n + j] = value;
+		}
+
+		value = strtoull(p, &p, 10);
+		dev->delta_time_ms[i] = value >= dev->time_ms[i] ?
+					value - dev->time_ms[i] : 0;
+		dev->time_ms[i] = value;
+
+		row = strchr(p, '\n');
+		if (row)
+			row++;
+	}
+
+	return i == n ? 0 : -EINVAL;
+}
+
+static int __devfreq_open_rw(const char *path, const char *name)
+{
+	int fd = __open_attribute(path, name, O_RDWR);
+
+	if (fd == -EACCES)
+		fd = __open_attribute(path, name, O_RDONLY);
+
+	return fd;
+}
+
+static int __devfreq_new_device(struct syspower_devfreq *df, const char *base,
+				const char *name)
+{
+	struct syspower_devfreq_device *dev;
+	char path[PATH_MAX + 1], value[256];
+	struct devfreq_device *devices, *d;
+	unsigned int n = 0;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", base, name);
+
+	fd = __open_attribute(path, "cur_freq", O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	devices = realloc(df->devices, (df->count + 1) * sizeof(*devices));
+	if (!devices) {
+		close(fd);
+		return -ENOMEM;
+	}
+	df->devices = devices;
+
+	d = &devices[df->count++];
+	memset(d, 0, sizeof(*d));
+	dev = &d->dev;
+
+	d->fd_cur = fd;
+	d->fd_target = __open_attribute(path, "target_freq", O_RDONLY);
+	d->fd_min = __devfreq_open_rw(path, "min_freq");
+	d->fd_max = __devfreq_open_rw(path, "max_freq");
+	d->fd_trans_stat = __open_attribute(path, "trans_stat", O_RDONLY);
+
+	snprintf(dev->name, sizeof(dev->name), "%.63s", name);
+	if (!__read_attribute(value, path, "governor"))
+		snprintf(dev->governor, sizeof(dev->governor), "%.31s", value);
+
+	/* Size the matrices once, from the frequency table */
+	if (d->fd_trans_stat >= 0 &&
+	    __pread_attribute(d->fd_trans_stat, df->buf, sizeof(df->buf)) > 0)
+		n = __trans_stat_count(df->buf);
+
+	if (n) {
+		dev->freq_hz = calloc(n, sizeof(*dev->freq_hz));
+		dev->time_ms = calloc(n, sizeof(*dev->time_ms));
+		dev->delta_time_ms = calloc(n, sizeof(*dev->delta_time_ms));
+		dev->trans = calloc(n * n, sizeof(*dev->trans));
+		dev->delta_trans = calloc(n * n, sizeof(*dev->delta_trans));
+		if (!dev->freq_hz || !dev->time_ms || !dev->delta_time_ms ||
+		    !dev->trans || !dev->delta_trans)
+			return -ENOMEM;
+
+		dev->nr_states = n;
+		__devfreq_parse(dev, df->buf);
+	}
+
+	return 0;
+}
+
+static int __cmp_device(const void *a, const void *b)
+{
+	return strcmp(((const struct devfreq_device *)a)->dev.name,
+		      ((const struct devfreq_device *)b)->dev.name);
+}
+
+struct syspower_devfreq *syspower_devfreq_open(const char *path)
+{
+	struct syspower_devfreq *df;
+	struct dirent *dir;
+	DIR *d;
+
+	if (!path)
+		path = path_devfreq;
+
+	d = opendir(path);
+	if (!d)
+		return NULL;
+
+	df = calloc(1, sizeof(*df));
+	if (!df) {
+		closedir(d);
+		return NULL;
+	}
+
+	while ((dir = readdir(d))) {
+		if (dir->d_name[0] == '.')
+			continue;
+
+		if (__devfreq_new_device(df, path, dir->d_name)) {
+			syspower_devfreq_close(df);
+			closedir(d);
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
+
+	closedir(d);
+
+	qsort(df->devices, df->count, sizeof(*df->devices), __cmp_device);
+
+	return df;
+}
+
+void syspower_devfreq_close(struct syspower_devfreq *df)
+{
+	unsigned int i, j;
+
+	if (!df)
+		return;
+
+	for (i = 0; i < df->count; i++) {
+		struct devfreq_device *d = &df->devices[i];
+		int fds[] = { d->fd_cur, d->fd_target, d->fd_min, d->fd_max,
+			      d->fd_trans_stat };
+
+		for (j = 0; j < ARRAY_SIZE(fds); j++) {
+			if (fds[j] >= 0)
+				close(fds[j]);
+		}
+
+		free(d->dev.freq_hz);
+		free(d->dev.time_ms);
+		free(d->dev.delta_time_ms);
+		free(d->dev.trans);
+		free(d->dev.delta_trans);
+	}
+
+	free(df->devices);
+	free(df);
+}
+
+unsigned int syspower_devfreq_count(struct syspower_devfreq *df)
+{
+	return df ? df->count : 0;
+}
+
+const struct syspower_devfreq_device *syspower_devfreq_get(struct syspower_devfreq *df,
+							   unsigned int index)
+{
+	if (!df || index >= df->count)
+		return NULL;
+
+	return &df->devices[index].dev;
+}
+
+int syspower_devfreq_sample(struct syspower_devfreq *df)
+{
+	unsigned int i;
+	int ret = 0;
+
+	if (!df)
+		return -EINVAL;
+
+	for (i = 0; i < df->count; i++) {
+		struct devfreq_device *d = &df->devices[i];
+		struct syspower_devfreq_device *dev = &d->dev;
+
+		__pread_u64(d->fd_cur, &dev->cur_hz);
+		if (d->fd_target >= 0)
+			__pread_u64(d->fd_target, &dev->target_hz);
+		if (d->fd_min >= 0)
+			__pread_u64(d->fd_min, &dev->min_hz);
+		if (d->fd_max >= 0)
+			__pread_u64(d->fd_max, &dev->max_hz);
+
+		if (!dev->nr_states ||
+		    __pread_attribute(d->fd_trans_stat, df->buf, sizeof(df->buf)) <= 0)
+			continue;
+
+		/* Frequency table changed (e.g. OPP update), stats are stale */
+		if (__devfreq_parse(dev, df->buf))
+			ret = -EINVAL;
+	}
+
+	return ret;
+}
+
+static int __devfreq_write(int fd, uint64_t *written, uint64_t *cur, uint64_t hz,
+			   bool max)
+{
+	char value[32];
+	int ret;
+
+	/*
+	 * min_freq/max_freq read back the effective limits (PM QoS or thermal
+	 * clamped), so compare with what we wrote, unless the effective limit
+	 * was loosened past it since (external writer).
+	 */
+	if (!hz || (*written == hz && (max ? *cur <= hz : *cur >= hz)))
+		return 0;
+
+	if (fd < 0)
+		return -ENOTSUP;
+
+	snprintf(value, sizeof(value), "%" PRIu64, hz);
+	ret = __pwrite_attribute(fd, value);
+	if (ret)
+		return ret;
+
+	*written = hz;
+	*cur = hz;
+
+	return 1;
+}
+
+int syspower_devfreq_set_range(struct syspower_devfreq *df, unsigned int index,
+			       uint64_t min_hz, uint64_t max_hz)
+{
+	struct devfreq_device *d;
+	int ret, written = 0;
+
+	if (!df || index >= df->count)
+		return -EINVAL;
+
+	d = &df->devices[index];
+
+	/* Keep min <= max at every step */
+	if (min_hz && min_hz > d->dev.max_hz) {
+		ret = __devfreq_write(d->fd_max, &d->written_max_hz,
+				      &d->dev.max_hz, max_hz, true);
+		if (ret < 0)
+			return ret;
+		written += ret;
+
+		ret = __devfreq_write(d->fd_min, &d->written_min_hz,
+				      &d->dev.min_hz, min_hz, false);
+	} else {
+		ret = __devfreq_write(d->fd_min, &d->written_min_hz,
+				      &d->dev.min_hz, min_hz, false);
+		if (ret < 0)
+			return ret;
+		written += ret;
+
+		ret = __devfreq_write(d->fd_max, &d->written_max_hz,
+				      &d->dev.max_hz, max_hz, true);
+	}
+
+	return ret < 0 ? ret : written + ret;
+}
+
+int syspower_devfreq_set_range_all(struct syspower_devfreq *df,
+				   const uint64_t *min_hz, const uint64_t *max_hz)
+{
+	unsigned int i, written = 0;
+	int ret, err = 0;
+
+	if (!df)
+		return -EINVAL;
+
+	for (i = 0; i < df->count; i++) {
+		ret = syspower_devfreq_set_range(df, i, min_hz ? min_hz[i] : 0,
+						 max_hz ? max_hz[i] : 0);
+		if (ret < 0)
+			err = ret;
+		else
+			written += ret;
+	}
+
+	return err ? err : (int)written;
+}
@@ -0,0 +1,215 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * This file is part of libsyspower.
+ *
+ * Copyright (C) 2022 Loic Poulain <loic.poulain@linaro.org>
+ */
+
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+#include <syspower.h>
+
+#include "internal.h"
+
+/*
+ * Energy accounting.
+ *
+ * Energy sources are either hardware counters (RAPL, hwmon energy), which
+ * wrap around at some range, or power readings (battery) which have to be
+ * integrated over time. Both are accumulated into the same monotonic 64-bit
+ * microjoule total, with a small history of (time, energy) points from which
+ * average power over a window is computed.
+ */
+
+void syspower_energy_init(struct syspower_energy *e, uint64_t range_uj)
+{
+	memset(e, 0, sizeof(*e));
+	e->range_uj = range_uj;
+}
+
+static void __energy_record(struct syspower_energy *e, uint64_t timestamp_ns)
+{
+	e->timestamp_ns = timestamp_ns;
+	e->head = (e->head + 1) % SYSPOWER_ENERGY_HISTORY;
+	e->history[e->head].timestamp_ns = timestamp_ns;
+	e->history[e->head].energy_uj = e->energy_uj;
+	if (e->count < SYSPOWER_ENERGY_HISTORY)
+		e->count++;
+}
+
+void syspower_energy_add(struct syspower_energy *e, uint64_t delta_uj,
+			 uint64_t timestamp_ns)
+{
+	e->energy_uj += delta_uj;
+	__energy_record(e, timestamp_ns);
+}
+
+void syspower_energy_update(struct syspower_energy *e, uint64_t raw_uj,
+			    uint64_t timestamp_ns)
+{
+	uint64_t delta = 0;
+
+	if (e->count) {
+		if (raw_uj >= e->raw_uj)
+			delta = raw_uj - e->raw_uj;
+		else if (e->range_uj && e->raw_uj <= e->range_uj)
+			delta = e->range_uj - e->raw_uj + raw_uj; /* wrapped */
+		/* else counter has been reset, restart from there */
+	}
+
+	e->raw_uj = raw_uj;
+	syspower_energy_add(e, delta, timestamp_ns);
+}
+
+void syspower_energy_add_power(struct syspower_energy *e, uint64_t power_uw,
+			       uint64_t timestamp_ns)
+{
+	uint64_t delta_uj = 0;
+
+	/* The previous reading held until this one (left rectangle) */
+	if (e->count && timestamp_ns > e->timestamp_ns)
+		delta_uj = (unsigned __int128)e->power_uw *
+			   (timestamp_ns - e->timestamp_ns) / 1000000000;
+
+	e->power_uw = power_uw;
+	syspower_energy_add(e, delta_uj, timestamp_ns);
+}
+
+uint64_t syspower_energy_power_uw(const struct syspower_energy *e,
+				  unsigned int window_ms)
+{
+	uint64_t start_ns, dt_us;
+	unsigned int i, oldest;
+
+	if (e->count < 2)
+		return 0;
+
+	/* Oldest point still within the window, at least the previous one */
+	start_ns = (uint64_t)window_ms * 1000000;
+	start_ns = e->timestamp_ns > start_ns ? e->timestamp_ns - start_ns : 0;
+	oldest = (e->head + SYSPOWER_ENERGY_HISTORY - 1) % SYSPOWER_ENERGY_HISTORY;
+
+	for (i = 2; i < e->count; i++) {
+		unsigned int idx = (e->head + SYSPOWER_ENERGY_HISTORY - i) %
+				   SYSPOWER_ENERGY_HISTORY;
+
+		if (e->history[idx].timestamp_ns < start_ns)
+			break;
+		oldest = idx;
+	}
+
+	dt_us = (e->timestamp_ns - e->history[oldest].timestamp_ns) / 1000;
+	if (!dt_us)
+		return 0;
+
+	return (e->energy_uj - e->history[oldest].energy_uj) * 1000000 / dt_us;
+}
+
+int syspower_supply_energy_update(const char *supplyname, struct syspower_energy *e)
+{
+	struct syspower_supply_snapshot snap;
+	uint64_t power_uw = 0;
+	int ret;
+
+	/* One read, current, voltage and status are consistent */
+	ret = syspower_supply_snapshot(supplyname, &snap);
+	if (ret)
+		return ret;
+
+	/* Charging current is not consumed energy, whatever its sign */
+	if (snap.status != SYSPOWER_BATTERY_STATUS_CHARGING)
+		power_uw = (uint64_t)abs(snap.voltage_mv) * abs(snap.current_ma);
+
+	syspower_energy_add_power(e, power_uw, snap.timestamp_ns);
+
+	return 0;
+}
+
+/*
+ * Zones accounting for the whole system: the platform (psys) zone alone when
+ * there is one, as it already includes the packages, otherwise the RAPL
+ * package zones. Subzones and the MMIO interface (intel-rapl-mmio) report the
+ * same energy again and are never selected.
+ */
+unsigned int __powercap_system_zones(struct syspower_powercap *pc,
+				     unsigned int *zones, unsigned int max)
+{
+	const struct syspower_powercap_zone *zone;
+	unsigned int i, count = 0;
+
+	for (i = 0; (zone = syspower_powercap_get(pc, i)); i++) {
+		if (!strcmp(zone->type, "psys") && max) {
+			zones[0] = i;
+			return 1;
+		}
+	}
+
+	for (i = 0; (zone = syspower_powercap_get(pc, i)) && count < max; i++) {
+		if (!strncmp(zone->name, "intel-rapl:", 11) &&
+		    !strchr(zone->name + 11, ':') &&
+		    !strncmp(zone->type, "package-", 8))
+			zones[count++] = i;
+	}
+
+	return count;
+}
+
+int __energy_source_open(struct energy_source *src, const char *supplyname)
+{
+	memset(src, 0, sizeof(*src));
+	syspower_energy_init(&src->energy, 0);
+
+	if (supplyname) {
+		snprintf(src->supply, sizeof(src->supply), "%.63s", supplyname);
+		return 0;
+	}
+
+	/* Prefer RAPL, falling back to the first battery */
+	src->pc = syspower_powercap_open(NULL);
+	if (src->pc) {
+		src->nr_zones = __powercap_system_zones(src->pc, src->zones,
+							ENERGY_SOURCE_ZONES);
+		if (src->nr_zones)
+			return 0;
+	}
+
+	syspower_powercap_close(src->pc);
+	src->pc = NULL;
+
+	return __supply_first_battery(src->supply, sizeof(src->supply));
+}
+
+int __energy_source_sample(struct energy_source *src, uint64_t timestamp_ns)
+{
+	uint64_t energy_uj = 0;
+	unsigned int i;
+	int ret;
+
+	if (src->supply[0])
+		return syspower_supply_energy_update(src->supply, &src->energy);
+
+	ret = syspower_powercap_sample(src->pc);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < src->nr_zones; i++)
+		energy_uj += syspower_powercap_get(src->pc, src->zones[i])->energy.energy_uj;
+
+	syspower_energy_add(&src->energy, src->energy.count ?
+			    energy_uj - src->pc_energy_uj : 0, timestamp_ns);
+	src->pc_energy_uj = energy_uj;
+
+	return 0;
+}
+
+void __energy_source_close(struct energy_source *src)
+{
+	syspower_powercap_close(src->pc);
+	src->pc = NULL;
+}
@@ -0,0 +1,281 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * This file is part of libsyspower.
+ *
+ * Copyright (C) 2022 Loic Poulain <loic.poulain@linaro.org>
+ */
+
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <syspower.h>
+
+#include <linux/limits.h>
+
+#include "internal.h"
+
+/*
+ * Energy measurement scopes.
+ *
+ * The best available energy counter is selected once and its attributes are
+ * kept open, so that beginning or ending a scope is one pread() per counter:
+ * - RAPL psys or package zones (powercap energy_uj), summed, see
+ *   __powercap_system_zones().
+ * - hwmon energy channels of the first sensor reporting any, summed.
+ * - battery energy_now, or charge_now x voltage_now, which only decreases
+ *   while discharging and is much coarser (fuel gauge update rate).
+ */
+
+static const char path_hwmon[] = "/sys/class/hwmon";
+static const char path_supply[] = "/sys/class/power_supply";
+
+static const char * const sources[] = {
+	[SYSPOWER_ENERGY_SOURCE_NONE] = "none",
+	[SYSPOWER_ENERGY_SOURCE_POWERCAP] = "powercap",
+	[SYSPOWER_ENERGY_SOURCE_HWMON] = "hwmon",
+	[SYSPOWER_ENERGY_SOURCE_BATTERY] = "battery",
+};
+
+static struct {
+	pthread_mutex_t lock;
+	bool probed;
+	enum syspower_energy_source source;
+	struct syspower_powercap *pc;
+	unsigned int zones[SYSPOWER_ENERGY_SCOPE_COUNTERS]; /* powercap only */
+	int fds[SYSPOWER_ENERGY_SCOPE_COUNTERS];
+	uint64_t range_uj[SYSPOWER_ENERGY_SCOPE_COUNTERS];
+	unsigned int count;
+	int fd_voltage; /* battery charge_now only */
+} meter = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.fd_voltage = -1,
+};
+
+static void __meter_add(int fd, uint64_t range_uj)
+{
+	if (meter.count == SYSPOWER_ENERGY_SCOPE_COUNTERS) {
+		close(fd);
+		return;
+	}
+
+	meter.fds[meter.count] = fd;
+	meter.range_uj[meter.count++] = range_uj;
+}
+
+static bool __meter_powercap(void)
+{
+	unsigned int i;
+
+	meter.pc = syspower_powercap_open(NULL);
+	if (!meter.pc)
+		return false;
+
+	meter.count = __powercap_system_zones(meter.pc, meter.zones,
+					      SYSPOWER_ENERGY_SCOPE_COUNTERS);
+	if (!meter.count) {
+		syspower_powercap_close(meter.pc);
+		meter.pc = NULL;
+		return false;
+	}
+
+	for (i = 0; i < meter.count; i++)
+		meter.range_uj[i] = syspower_powercap_get(meter.pc, meter.zones[i])->energy.range_uj;
+
+	return true;
+}
+
+static bool __meter_hwmon(void)
+{
+	char path[PATH_MAX + 1];
+	struct dirent *dir, *attr;
+	unsigned int index;
+	DIR *d, *dev;
+	int fd;
+
+	d = opendir(path_hwmon);
+	if (!d)
+		return false;
+
+	while (!meter.count && (dir = readdir(d))) {
+		if (dir->d_name[0] == '.')
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", path_hwmon, dir->d_name);
+
+		dev = opendir(path);
+		if (!dev)
+			continue;
+
+		while ((attr = readdir(dev))) {
+			char suffix[8];
+
+			if (sscanf(attr->d_name, "energy%u_%7s", &index, suffix) != 2 ||
+			    strcmp(suffix, "input"))
+				continue;
+
+			fd = __open_attribute(path, attr->d_name, O_RDONLY);
+			if (fd >= 0)
+				__meter_add(fd, 0);
+		}
+
+		closedir(dev);
+	}
+
+	closedir(d);
+
+	return meter.count;
+}
+
+static bool __meter_battery(void)
+{
+	char path[PATH_MAX + 1], name[64];
+	int fd;
+
+	if (__supply_first_battery(name, sizeof(name)))
+		return false;
+
+	snprintf(path, sizeof(path), "%s/%s", path_supply, name);
+
+	fd = __open_attribute(path, "energy_now", O_RDONLY);
+	if (fd < 0) {
+		fd = __open_attribute(path, "charge_now", O_RDONLY);
+		if (fd < 0)
+			return false;
+
+		meter.fd_voltage = __open_attribute(path, "voltage_now", O_RDONLY);
+		if (meter.fd_voltage < 0) {
+			close(fd);
+			return false;
+		}
+	}
+
+	__meter_add(fd, 0);
+
+	return true;
+}
+
+/* Called with meter.lock held */
+static int __meter_probe(void)
+{
+	if (meter.probed)
+		return meter.source ? 0 : -ENODEV;
+
+	meter.probed = true;
+
+	if (__meter_powercap())
+		meter.source = SYSPOWER_ENERGY_SOURCE_POWERCAP;
+	else if (__meter_hwmon())
+		meter.source = SYSPOWER_ENERGY_SOURCE_HWMON;
+	else if (__meter_battery())
+		meter.source = SYSPOWER_ENERGY_SOURCE_BATTERY;
+
+	return meter.source ? 0 : -ENODEV;
+}
+
+/* Called with meter.lock held, battery counters are reported in uJ too */
+static int __meter_read(uint64_t *raw)
+{
+	uint64_t uv;
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < meter.count; i++) {
+		if (meter.pc)
+			ret = __powercap_read(meter.pc, meter.zones[i], &raw[i]);
+		else
+			ret = __pread_u64(meter.fds[i], &raw[i]);
+		if (ret)
+			return ret;
+	}
+
+	if (meter.source != SYSPOWER_ENERGY_SOURCE_BATTERY)
+		return 0;
+
+	if (meter.fd_voltage >= 0) {
+		/* uAh x uV */
+		ret = __pread_u64(meter.fd_voltage, &uv);
+		if (ret)
+			return ret;
+		raw[0] = raw[0] * uv / 1000000;
+	}
+
+	raw[0] *= 3600; /* uWh */
+
+	return 0;
+}
+
+int syspower_energy_scope_begin(struct syspower_energy_scope *scope)
+{
+	int ret;
+
+	if (!scope)
+		return -EINVAL;
+
+	pthread_mutex_lock(&meter.lock);
+
+	ret = __meter_probe();
+	if (!ret)
+		ret = __meter_read(scope->raw);
+
+	pthread_mutex_unlock(&meter.lock);
+
+	scope->timestamp_ns = __clock_ns(CLOCK_MONOTONIC);
+
+	return ret;
+}
+
+int syspower_energy_scope_end(struct syspower_energy_scope *scope,
+			      struct syspower_energy_result *result)
+{
+	uint64_t raw[SYSPOWER_ENERGY_SCOPE_COUNTERS], now;
+	unsigned int i;
+	int ret;
+
+	if (!scope || !result)
+		return -EINVAL;
+
+	pthread_mutex_lock(&meter.lock);
+
+	now = __clock_ns(CLOCK_MONOTONIC);
+
+	ret = __meter_probe();
+	if (!ret)
+		ret = __meter_read(raw);
+
+	memset(result, 0, sizeof(*result));
+	result->source = meter.source;
+	result->duration_ns = now - scope->timestamp_ns;
+
+	for (i = 0; !ret && i < meter.count; i++) {
+		if (meter.source == SYSPOWER_ENERGY_SOURCE_BATTERY)
+			/* discharge, nothing measured while charging */
+			result->energy_uj += scope->raw[i] > raw[i] ? scope->raw[i] - raw[i] : 0;
+		else if (raw[i] >= scope->raw[i])
+			result->energy_uj += raw[i] - scope->raw[i];
+		else if (meter.range_uj[i] && scope->raw[i] <= meter.range_uj[i])
+			result->energy_uj += meter.range_uj[i] - scope->raw[i] + raw[i];
+	}
+
+	pthread_mutex_unlock(&meter.lock);
+
+	if (result->duration_ns >= 1000)
+		result->power_uw = result->energy_uj * 1000000 / (result->duration_ns / 1000);
+
+	return ret;
+}
+
+const char *syspower_energy_source_str(enum syspower_energy_source source)
+{
+	if (source >= ARRAY_SIZE(sources))
+		return "unknown";
+
+	return sources[source];
+}
@@ -0,0 +1,182 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * This file is part of libsyspower.
+ *
+ * Copyright (C) 2022 Loic Poulain <loic.poulain@linaro.org>
+ */
+
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <syspower.h>
+
+#include "internal.h"
+
+/*
+ * Library events (supply changes, thermal trips...) are delivered to the
+ * registered listeners. Listeners are copied under the lock and called
+ * unlocked, so that they can (un)register from their callback. Events nobody
+ * listens to are dropped without locking, emission points may be hot paths
+ * (wake locks).
+ *
+ * Unregistering waits for the dispatches in progress on other threads, so
+ * that the listener data can be freed right after. Dispatches are counted in
+ * two alternating epochs: unregister switches new dispatches to the other
+ * epoch and only waits for the previous one to drain, which cannot be starved
+ * by a steady flow of events. A callback unregistering does not wait, as the
+ * dispatch it runs from would never complete.
+ */
+
+struct event_listener {
+	unsigned int mask;
+	syspower_event_cb_t cb;
+	void *data;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	struct event_listener listeners[SYSPOWER_EVENT_LISTENERS_MAX];
+	unsigned int count;
+	unsigned int mask; /* union of listener masks */
+	pthread_cond_t drained;
+	unsigned int active[2]; /* dispatches in progress per epoch */
+	unsigned int epoch;
+	bool quiescing;
+} events = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.drained = PTHREAD_COND_INITIALIZER,
+};
+
+/* Dispatches in progress on the current thread */
+static __thread unsigned int event_depth;
+
+int syspower_event_register(unsigned int mask, syspower_event_cb_t cb, void *data)
+{
+	int ret = 0;
+
+	if (!cb || !mask)
+		return -EINVAL;
+
+	pthread_mutex_lock(&events.lock);
+
+	if (events.count == ARRAY_SIZE(events.listeners)) {
+		ret = -ENOSPC;
+	} else {
+		events.listeners[events.count].mask = mask;
+		events.listeners[events.count].cb = cb;
+		events.listeners[events.count].data = data;
+		events.count++;
+		__atomic_or_fetch(&events.mask, mask, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_unlock(&events.lock);
+
+	return ret;
+}
+
+int syspower_event_unregister(syspower_event_cb_t cb, void *data)
+{
+	unsigned int i, mask = 0;
+	int ret = -ENOENT;
+
+	pthread_mutex_lock(&events.lock);
+
+	for (i = 0; i < events.count; i++) {
+		if (events.listeners[i].cb == cb && events.listeners[i].data == data) {
+			events.listeners[i] = events.listeners[--events.count];
+			ret = 0;
+			break;
+		}
+	}
+
+	for (i = 0; i < events.count; i++)
+		mask |= events.listeners[i].mask;
+	__atomic_store_n(&events.mask, mask, __ATOMIC_RELEASE);
+
+	if (!ret && !event_depth) {
+		unsigned int epoch;
+
+		/* One epoch switch at a time, the other one must be drained */
+		while (events.quiescing)
+			pthread_cond_wait(&events.drained, &events.lock);
+
+		events.quiescing = true;
+		epoch = events.epoch;
+		events.epoch ^= 1;
+
+		while (events.active[epoch])
+			pthread_cond_wait(&events.drained, &events.lock);
+
+		events.quiescing = false;
+		pthread_cond_broadcast(&events.drained);
+	}
+
+	pthread_mutex_unlock(&events.lock);
+
+	return ret;
+}
+
+void __event_emit(enum syspower_event_type type, const char *name, int index,
+		  int64_t value, int64_t threshold)
+{
+	struct event_listener listeners[SYSPOWER_EVENT_LISTENERS_MAX];
+	struct syspower_event ev = {
+		.type = type,
+		.name = name,
+		.index = index,
+		.value = value,
+		.threshold = threshold,
+	};
+	unsigned int i, epoch, count = 0;
+
+	if (!(__atomic_load_n(&events.mask, __ATOMIC_ACQUIRE) & SYSPOWER_EVENT_MASK(type)))
+		return;
+
+	pthread_mutex_lock(&events.lock);
+	for (i = 0; i < events.count; i++) {
+		if (events.listeners[i].mask & SYSPOWER_EVENT_MASK(type))
+			listeners[count++] = events.listeners[i];
+	}
+	epoch = events.epoch;
+	if (count)
+		events.active[epoch]++;
+	pthread_mutex_unlock(&events.lock);
+
+	if (!count)
+		return;
+
+	ev.timestamp_ns = __clock_ns(CLOCK_BOOTTIME);
+
+	event_depth++;
+	for (i = 0; i < count; i++)
+		listeners[i].cb(&ev, listeners[i].data);
+	event_depth--;
+
+	pthread_mutex_lock(&events.lock);
+	if (!--events.active[epoch])
+		pthread_cond_broadcast(&events.drained);
+	pthread_mutex_unlock(&events.lock);
+}
+
+const char *syspower_event_type_str(enum syspower_event_type type)
+{
+	static const char *types[] = {
+		[SYSPOWER_EVENT_SUPPLY] = "supply",
+		[SYSPOWER_EVENT_THERMAL_TRIP] = "thermal_trip",
+		[SYSPOWER_EVENT_ANOMALY] = "anomaly",
+		[SYSPOWER_EVENT_SUSPEND] = "suspend",
+		[SYSPOWER_EVENT_WAKEUP] = "wakeup",
+		[SYSPOWER_EVENT_WAKELOCK] = "wakelock",
+		[SYSPOWER_EVENT_ALARM] = "alarm",
+	};
+
+	if (type >= ARRAY_SIZE(types) || !types[type])
+		return "unknown";
+
+	return types[type];
+}
@@ -0,0 +1,355 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * This file is part of libsyspower.
+ *
+ * Copyright (C) 2022 Loic Poulain <loic.poulain@linaro.org>
+ */
+
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <syspower.h>
+
+#include "internal.h"
+
+/*
+ * Battery-aware CPU power budget governor.
+ *
+ * The power budget is picked from the battery capacity band, or the AC budget
+ * when an external supply (mains, USB, wireless) is online. Supplies are
+ * listed once at creation, then only the supply an event is about is read
+ * again, so that plugging or unplugging AC is acted upon immediately rather
+ * than at the next control step, at the cost of a single snapshot.
+ *
+ * Each control step measures power over the previous interval and moves a
+ * single performance level shared by all cpufreq policies: multiplicatively
+ * down when over budget, one level up when comfortably under it. Levels map
+ * linearly to each policy range, rounded down to an available frequency, and
+ * caps are only written when they change.
+ */
+
+struct governor_supply {
+	char name[64];
+	bool external; /* mains, USB, wireless... */
+	bool online;
+};
+
+struct syspower_governor {
+	pthread_mutex_t lock;
+	char battery[64];
+	struct governor_supply *supplies; /* known supplies, battery excluded */
+	unsigned int nr_supplies;
+	unsigned int ac_budget_mw;
+	struct syspower_governor_band *bands;
+	unsigned int nr_bands;
+
+	struct energy_source source;
+	struct syspower_cpufreq *cf;
+	uint32_t *caps;
+
+	struct syspower_governor_status status;
+};
+
+static bool __governor_external(enum syspower_supply_type type)
+{
+	return type != SYSPOWER_SUPPLY_TYPE_BATTERY &&
+	       type != SYSPOWER_SUPPLY_TYPE_UPS &&
+	       type != SYSPOWER_SUPPLY_TYPE_BMS;
+}
+
+/* Called with gov->lock held, re-read a single supply */
+static void __governor_supply_update(struct syspower_governor *gov,
+				     const char *name)
+{
+	struct syspower_supply_snapshot snap;
+	struct governor_supply *s = NULL, *supplies;
+	unsigned int i;
+	int ret;
+
+	if (!strcmp(name, gov->battery)) {
+		if (!syspower_supply_snapshot(gov->battery, &snap))
+			gov->status.capacity = snap.capacity;
+		return;
+	}
+
+	for (i = 0; i < gov->nr_supplies; i++) {
+		if (!strcmp(gov->supplies[i].name, name)) {
+			s = &gov->supplies[i];
+			break;
+		}
+	}
+
+	/* Other batteries never feed us */
+	if (s && !s->external)
+		return;
+
+	ret = syspower_supply_snapshot(name, &snap);
+
+	if (!s) {
+		/* Hotplugged (e.g. Type-C source), or removed unseen */
+		if (ret)
+			return;
+
+		supplies = realloc(gov->supplies,
+				   (gov->nr_supplies + 1) * sizeof(*supplies));
+		if (!supplies)
+			return;
+
+		gov->supplies = supplies;
+		s = &supplies[gov->nr_supplies++];
+		snprintf(s->name, sizeof(s->name), "%.63s", name);
+		s->external = __governor_external(snap.type);
+	}
+
+	s->online = !ret && s->external && snap.online;
+}
+
+/* Called with gov->lock held, return true if the budget changed */
+static bool __governor_refresh(struct syspower_governor *gov)
+{
+	struct syspower_governor_status *st = &gov->status;
+	unsigned int budget = 0, i;
+
+	st->ac = false;
+	for (i = 0; i < gov->nr_supplies; i++)
+		st->ac |= gov->supplies[i].online;
+
+	if (st->ac) {
+		budget = gov->ac_budget_mw;
+	} else {
+		/* Lowest band covering the current capacity */
+		for (i = 0; i < gov->nr_bands; i++) {
+			if (st->capacity >= 0 && st->capacity <= gov->bands[i].capacity) {
+				budget = gov->bands[i].budget_mw;
+				break;
+			}
+		}
+	}
+
+	if (budget == st->budget_mw)
+		return false;
+
+	st->budget_mw = budget;
+
+	return true;
+}
+
+/* Called with gov->lock held */
+static int __governor_apply(struct syspower_governor *gov)
+{
+	const struct syspower_cpufreq_policy *p;
+	unsigned int level = gov->status.level, i, j;
+	int ret;
+
+	for (i = 0; i < syspower_cpufreq_count(gov->cf); i++) {
+		uint32_t khz;
+
+		p = syspower_cpufreq_get(gov->cf, i);
+		khz = p->hw_min_khz + (uint64_t)(p->hw_max_khz - p->hw_min_khz) *
+		      level / SYSPOWER_GOVERNOR_LEVELS;
+
+		/* Highest available frequency within the cap */
+		if (p->nr_states) {
+			uint32_t best = 0;
+
+			for (j = 0; j < p->nr_states; j++) {
+				if (p->state_khz[j] <= khz && p->state_khz[j] > best)
+					best = p->state_khz[j];
+			}
+
+			if (best)
+				khz = best;
+		}
+
+		gov->caps[i] = khz;
+	}
+
+	ret = syspower_cpufreq_set_max_all(gov->cf, gov->caps);
+	if (ret > 0)
+		gov->status.writes += ret;
+
+	return ret;
+}
+
+/* Called with gov->lock held */
+static int __governor_control(struct syspower_governor *gov)
+{
+	struct syspower_governor_status *st = &gov->status;
+	unsigned int level = st->level;
+
+	if (!st->budget_mw) {
+		level = SYSPOWER_GOVERNOR_LEVELS;
+	} else if (st->power_mw > st->budget_mw) {
+		/* Power roughly scales with frequency, converge in a few steps */
+		level = (uint64_t)level * st->budget_mw / st->power_mw;
+		if (level == st->level && level)
+			level--;
+	} else if (st->power_mw < st->budget_mw - st->budget_mw / 8 &&
+		   level < SYSPOWER_GOVERNOR_LEVELS) {
+		level++;
+	}
+
+	st->level = level;
+
+	return __governor_apply(gov);
+}
+
+static void __governor_event(const struct syspower_event *ev, void *data)
+{
+	struct syspower_governor *gov = data;
+
+	if (!ev->name)
+		return;
+
+	pthread_mutex_lock(&gov->lock);
+
+	__governor_supply_update(gov, ev->name);
+
+	if (__governor_refresh(gov)) {
+		__governor_control(gov);
+		gov->status.reaction_us = (__clock_ns(CLOCK_BOOTTIME) - ev->timestamp_ns) / 1000;
+	}
+
+	pthread_mutex_unlock(&gov->lock);
+}
+
+struct syspower_governor *syspower_governor_create(const struct syspower_governor_config *config)
+{
+	struct syspower_governor *gov;
+	unsigned int i;
+	char *name;
+	int ret;
+
+	if (!config || (config->nr_bands && !config->bands)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	gov = calloc(1, sizeof(*gov));
+	if (!gov)
+		return NULL;
+
+	pthread_mutex_init(&gov->lock, NULL);
+	gov->ac_budget_mw = config->ac_budget_mw;
+	gov->status.capacity = -1;
+	gov->status.level = SYSPOWER_GOVERNOR_LEVELS;
+
+	if (config->battery) {
+		snprintf(gov->battery, sizeof(gov->battery), "%.63s", config->battery);
+	} else {
+		__supply_first_battery(gov->battery, sizeof(gov->battery));
+	}
+
+	gov->bands = calloc(config->nr_bands + 1, sizeof(*gov->bands));
+	if (!gov->bands)
+		goto err;
+	memcpy(gov->bands, config->bands, config->nr_bands * sizeof(*gov->bands));
+	gov->nr_bands = config->nr_bands;
+
+	ret = __energy_source_open(&gov->source, config->source);
+	if (ret) {
+		errno = -ret;
+		goto err;
+	}
+
+	gov->cf = syspower_cpufreq_open(config->cpufreq);
+	if (!gov->cf || syspower_cpufreq_sample(gov->cf))
+		goto err;
+
+	gov->caps = calloc(syspower_cpufreq_count(gov->cf) + 1, sizeof(*gov->caps));
+	if (!gov->caps)
+		goto err;
+
+	for (i = 0; (name = syspower_supply_get(i)); i++) {
+		__governor_supply_update(gov, name);
+		free(name);
+	}
+
+	__governor_refresh(gov);
+
+	ret = syspower_event_register(SYSPOWER_EVENT_MASK(SYSPOWER_EVENT_SUPPLY),
+				      __governor_event, gov);
+	if (ret) {
+		errno = -ret;
+		goto err;
+	}
+
+	return gov;
+
+err:
+	ret = errno;
+	__energy_source_close(&gov->source);
+	syspower_cpufreq_close(gov->cf);
+	free(gov->caps);
+	free(gov->bands);
+	free(gov->supplies);
+	free(gov);
+	errno = ret;
+
+	return NULL;
+}
+
+void syspower_governor_destroy(struct syspower_governor *gov)
+{
+	if (!gov)
+		return;
+
+	syspower_event_unregister(__governor_event, gov);
+
+	__energy_source_close(&gov->source);
+	syspower_cpufreq_close(gov->cf);
+	pthread_mutex_destroy(&gov->lock);
+	free(gov->caps);
+	free(gov->bands);
+	free(gov->supplies);
+	free(gov);
+}
+
+int syspower_governor_step(struct syspower_governor *gov)
+{
+	uint64_t start = __clock_ns(CLOCK_MONOTONIC) / 1000, elapsed;
+	int ret;
+
+	if (!gov)
+		return -EINVAL;
+
+	pthread_mutex_lock(&gov->lock);
+
+	ret = __energy_source_sample(&gov->source, __clock_ns(CLOCK_BOOTTIME));
+	if (ret)
+		goto unlock;
+
+	gov->status.power_mw = syspower_energy_power_uw(&gov->source.energy, 0) / 1000;
+	gov->status.steps++;
+
+	ret = __governor_control(gov);
+
+	elapsed = __clock_ns(CLOCK_MONOTONIC) / 1000 - start;
+	gov->status.step_us = elapsed;
+	if (elapsed > gov->status.max_step_us)
+		gov->status.max_step_us = elapsed;
+
+unlock:
+	pthread_mutex_unlock(&gov->lock);
+
+	return ret;
+}
+
+int syspower_governor_status(struct syspower_governor *gov,
+			     struct syspower_governor_status *status)
+{
+	if (!gov || !status)
+		return -EINVAL;
+
+	pthread_mutex_lock(&gov->lock);
+	*status = gov->status;
+	pthread_mutex_unlock(&gov->lock);
+
+	return 0;
+}
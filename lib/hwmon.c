@@ -0,0 +1,282 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * This file is part of libsyspower.
+ *
+ * Copyright (C) 2022 Loic Poulain <loic.poulain@linaro.org>
+ */
+
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <syspower.h>
+
+#include <linux/limits.h>
+
+#include "internal.h"
+
+/*
+ * hwmon sensors (INA2xx and friends) are discovered once, only power, energy,
+ * current and voltage input channels are retained and kept open. A sample is
+ * a single pass of pread() over all channels. Power and energy channels are
+ * also accumulated into energy accounting, which gives per-rail energy and
+ * windowed power.
+ */
+
+static const char path_hwmon[] = "/sys/class/hwmon";
+
+static const struct {
+	const char *prefix;
+	enum syspower_hwmon_type type;
+} hwmon_types[] = {
+	{ "power", SYSPOWER_HWMON_POWER },
+	{ "energy", SYSPOWER_HWMON_ENERGY },
+	{ "curr", SYSPOWER_HWMON_CURRENT },
+	{ "in", SYSPOWER_HWMON_VOLTAGE },
+};
+
+struct hwmon_channel {
+	unsigned int hwmon;
+	unsigned int index;
+	int fd;
+	struct syspower_hwmon_channel channel;
+};
+
+struct syspower_hwmon {
+	struct hwmon_channel *channels;
+	unsigned int count;
+	unsigned int size;
+};
+
+static int __hwmon_new_channel(struct syspower_hwmon *hw, int dirfd,
+			       const char *path, const char *chip,
+			       unsigned int hwmon, const char *attr)
+{
+	char prefix[16], suffix[16], name[64], value[256];
+	struct hwmon_channel *c;
+	unsigned int i, index;
+	int fd;
+
+	if (sscanf(attr, "%15[a-z]%u_%15s", prefix, &index, suffix) != 3)
+		return 0;
+
+	/* power channels may only report an average */
+	if (strcmp(suffix, "input") &&
+	    (strcmp(prefix, "power") || strcmp(suffix, "average")))
+		return 0;
+
+	for (i = 0; i < ARRAY_SIZE(hwmon_types); i++) {
+		if (!strcmp(prefix, hwmon_types[i].prefix))
+			break;
+	}
+
+	if (i == ARRAY_SIZE(hwmon_types))
+		return 0;
+
+	/* Prefer powerX_input over powerX_average */
+	if (!strcmp(suffix, "average")) {
+		snprintf(name, sizeof(name), "power%u_input", index);
+		if (!faccessat(dirfd, name, F_OK, 0))
+			return 0;
+	}
+
+	fd = __open_attribute(path, attr, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	if (hw->count == hw->size) {
+		unsigned int size = hw->size ? hw->size * 2 : 16;
+		struct hwmon_channel *channels;
+
+		channels = realloc(hw->channels, size * sizeof(*channels));
+		if (!channels) {
+			close(fd);
+			return -ENOMEM;
+		}
+
+		hw->channels = channels;
+		hw->size = size;
+	}
+
+	c = &hw->channels[hw->count++];
+	memset(c, 0, sizeof(*c));
+	c->hwmon = hwmon;
+	c->index = index;
+	c->fd = fd;
+	c->channel.type = hwmon_types[i].type;
+	snprintf(c->channel.chip, sizeof(c->channel.chip), "%.31s", chip);
+
+	snprintf(name, sizeof(name), "%s%u_label", prefix, index);
+	if (!__read_attribute(value, path, name))
+		snprintf(c->channel.label, sizeof(c->channel.label), "%.31s", value);
+	else
+		snprintf(c->channel.label, sizeof(c->channel.label), "%s%u",
+			 prefix, index);
+
+	syspower_energy_init(&c->channel.energy, 0);
+
+	return 0;
+}
+
+static int __hwmon_device(struct syspower_hwmon *hw, const char *base,
+			  const char *name, unsigned int hwmon)
+{
+	char path[PATH_MAX + 1], chip[256];
+	struct dirent *dir;
+	int ret = 0;
+	DIR *d;
+
+	snprintf(path, sizeof(path), "%s/%s", base, name);
+
+	if (__read_attribute(chip, path, "name"))
+		snprintf(chip, sizeof(chip), "%s", name);
+	chip[31] = '\0';
+
+	d = opendir(path);
+	if (!d)
+		return 0;
+
+	while (!ret && (dir = readdir(d)))
+		ret = __hwmon_new_channel(hw, dirfd(d), path, chip, hwmon, dir->d_name);
+
+	closedir(d);
+
+	return ret;
+}
+
+static int __cmp_channel(const void *a, const void *b)
+{
+	const struct hwmon_channel *ca = a, *cb = b;
+
+	if (ca->hwmon != cb->hwmon)
+		return ca->hwmon < cb->hwmon ? -1 : 1;
+	if (ca->channel.type != cb->channel.type)
+		return ca->channel.type < cb->channel.type ? -1 : 1;
+
+	return (int)ca->index - (int)cb->index;
+}
+
+struct syspower_hwmon *syspower_hwmon_open(const char *path)
+{
+	struct syspower_hwmon *hw;
+	struct dirent *dir;
+	unsigned int hwmon;
+	char c;
+	DIR *d;
+
+	if (!path)
+		path = path_hwmon;
+
+	d = opendir(path);
+	if (!d)
+		return NULL;
+
+	hw = calloc(1, sizeof(*hw));
+	if (!hw) {
+		closedir(d);
+		return NULL;
+	}
+
+	while ((dir = readdir(d))) {
+		if (sscanf(dir->d_name, "hwmon%u%c", &hwmon, &c) != 1)
+			continue;
+
+		if (__hwmon_device(hw, path, dir->d_name, hwmon)) {
+			syspower_hwmon_close(hw);
+			closedir(d);
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
+
+	closedir(d);
+
+	qsort(hw->channels, hw->count, sizeof(*hw->channels), __cmp_channel);
+
+	return hw;
+}
+
+void syspower_hwmon_close(struct syspower_hwmon *hw)
+{
+	unsigned int i;
+
+	if (!hw)
+		return;
+
+	for (i = 0; i < hw->count; i++)
+		close(hw->channels[i].fd);
+
+	free(hw->channels);
+	free(hw);
+}
+
+unsigned int syspower_hwmon_count(struct syspower_hwmon *hw)
+{
+	return hw ? hw->count : 0;
+}
+
+const struct syspower_hwmon_channel *syspower_hwmon_get(struct syspower_hwmon *hw,
+							unsigned int index)
+{
+	if (!hw || index >= hw->count)
+		return NULL;
+
+	return &hw->channels[index].channel;
+}
+
+int syspower_hwmon_sample(struct syspower_hwmon *hw)
+{
+	char value[32];
+	unsigned int i;
+	uint64_t now;
+	int ret = 0;
+
+	if (!hw)
+		return -EINVAL;
+
+	now = __clock_ns(CLOCK_BOOTTIME);
+
+	for (i = 0; i < hw->count; i++) {
+		struct syspower_hwmon_channel *ch = &hw->channels[i].channel;
+		struct syspower_energy *e = &ch->energy;
+		int64_t v;
+		int err;
+
+		err = __pread_attribute(hw->channels[i].fd, value, sizeof(value));
+		if (err <= 0) {
+			ret = err ? err : -EIO;
+			continue;
+		}
+
+		/*
+		 * hwmon ABI units are microwatt, microjoule, milliampere and
+		 * millivolt, which already match the library ones (uW, uJ, mA,
+		 * mV). Only currents are signed, report magnitudes like
+		 * syspower_supply_current() does.
+		 */
+		v = strtoll(value, NULL, 0);
+		if (v < 0)
+			v = -v;
+
+		switch (ch->type) {
+		case SYSPOWER_HWMON_POWER:
+			syspower_energy_add_power(e, v, now);
+			break;
+		case SYSPOWER_HWMON_ENERGY:
+			syspower_energy_update(e, v, now);
+			break;
+		default:
+			break;
+		}
+
+		ch->value = v;
+	}
+
+	return ret;
+}
@@ -0,0 +1,129 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * This file is part of libsyspower.
+ *
+ * Copyright (C) 2022 Loic Poulain <loic.poulain@linaro.org>
+ */
+
+#ifndef __LIBSYSPOWER_INTERNAL_H__
+#define __LIBSYSPOWER_INTERNAL_H__
+
+#include <unistd.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <syspower.h>
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+static inline int OPEN_RETRY(const char *path, int flags)
+{
+	int fd;
+
+	do {
+		fd = open(path, flags | O_SYNC);
+	} while (fd == -1 && errno == EINTR);
+
+	/* If required pseudo-file not present, operation is not supported */
+	if (fd == -1 && errno == ENOENT)
+		errno = ENOTSUP;
+
+	return fd;
+}
+
+static inline int READ_RETRY(int fd, void *buf, size_t len)
+{
+	int ret;
+
+	do {
+		ret = read(fd, buf, len);
+	} while (ret == -1 && errno == EINTR);
+
+	return ret;
+}
+
+static inline int WRITE_RETRY(int fd, const void *buf, size_t len)
+{
+	int ret;
+
+	do {
+		ret = write(fd, buf, len);
+	} while (ret == -1 && errno == EINTR);
+
+	return ret;
+}
+
+/* Helpers shared by the library modules (core.c) */
+int __open_once(int *fd, const char *path, int flags);
+int __read_attribute(char *value, const char *path, const char *name);
+int __write_attribute(char *value, const char *path, const char *name);
+void __sysfs_devices_parse(char *path, void (*cb)(char *devpath));
+uint64_t __clock_ns(clockid_t clk);
+int __supply_first_battery(char *name, size_t len);
+
+/* Held fd attribute access, for modules sampling sysfs repeatedly */
+int __open_attribute(const char *path, const char *name, int flags);
+int __pread_attribute(int fd, char *value, size_t len);
+int __pread_u64(int fd, uint64_t *value);
+int __pwrite_attribute(int fd, const char *value);
+
+/* Wake lock statistics hooks (wakelock_stats.c) */
+struct wakelock_stat;
+struct wakelock_stat *__wakelock_stat_intern(const char *name);
+struct wakelock_stat *__wakelock_stat_find(const char *name);
+void __wakelock_stat_acquire(struct wakelock_stat *st);
+void __wakelock_stat_hold(struct wakelock_stat *st);
+void __wakelock_stat_unhold(struct wakelock_stat *st);
+void __wakelock_stat_set(struct wakelock_stat *st, bool held);
+
+/* Supply property parsers (core.c) */
+enum syspower_supply_type __supply_type_parse(const char *attr);
+enum syspower_supply_status __supply_status_parse(const char *attr);
+enum syspower_supply_health __supply_health_parse(const char *attr);
+
+/* Deadline bound supply attribute reads (supply_worker.c) */
+int __supply_read(const char *supplyname, const char *name, char *value,
+		  size_t len, int timeout_ms, bool *stale);
+void __supply_release(void);
+
+/* Shared uevent monitor (core.c) */
+int __monitor_get(const char *subsystem);
+void __monitor_put(void);
+
+/* Currently programmed RTC wake alarm, 0 if disabled (rtc.c) */
+int __rtc_wakealarm_read(time_t *when);
+
+/* Event delivery (event.c) */
+void __event_emit(enum syspower_event_type type, const char *name, int index,
+		  int64_t value, int64_t threshold);
+
+/* System energy source, RAPL psys or package zones, or battery (energy.c) */
+#define ENERGY_SOURCE_ZONES	8
+
+struct energy_source {
+	char supply[64]; /* empty for powercap */
+	struct syspower_powercap *pc;
+	unsigned int zones[ENERGY_SOURCE_ZONES];
+	unsigned int nr_zones;
+	uint64_t pc_energy_uj; /* latest sum of the selected zones */
+	struct syspower_energy energy;
+};
+
+int __energy_source_open(struct energy_source *src, const char *supplyname);
+int __energy_source_sample(struct energy_source *src, uint64_t timestamp_ns);
+void __energy_source_close(struct energy_source *src);
+unsigned int __powercap_system_zones(struct syspower_powercap *pc,
+				     unsigned int *zones, unsigned int max);
+
+/* Single zone counter read, no accounting (powercap.c) */
+int __powercap_read(struct syspower_powercap *pc, unsigned int index, uint64_t *raw_uj);
+
+/* Thermal uevent hook (thermal.c) */
+void __thermal_uevent(const char *sysname);
+
+/* Residency accounting hook (residency.c) */
+void __residency_update(void);
+
+#endif /* __LIBSYSPOWER_INTERNAL_H__ */
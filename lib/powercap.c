@@ -0,0 +1,187 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * This file is part of libsyspower.
+ *
+ * Copyright (C) 2022 Loic Poulain <loic.poulain@linaro.org>
+ */
+
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <syspower.h>
+
+#include <linux/limits.h>
+
+#include "internal.h"
+
+/*
+ * powercap (RAPL) zones are discovered once and their energy_uj counter is
+ * kept open. The counters wrap at max_energy_range_uj, wrap-arounds are
+ * corrected by the energy accounting which keeps a monotonic total.
+ *
+ * Note that energy_uj is usually only readable by root, zones that cannot be
+ * opened are skipped.
+ */
+
+static const char path_powercap[] = "/sys/class/powercap";
+
+struct powercap_zone {
+	int fd_energy;
+	struct syspower_powercap_zone zone;
+};
+
+struct syspower_powercap {
+	struct powercap_zone *zones;
+	unsigned int count;
+};
+
+static int __powercap_new_zone(struct syspower_powercap *pc, const char *base,
+			       const char *name)
+{
+	char path[PATH_MAX + 1], value[256];
+	struct powercap_zone *zones, *z;
+	uint64_t range = 0;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", base, name);
+
+	/* Control types (intel-rapl) have no energy counter */
+	fd = __open_attribute(path, "energy_uj", O_RDONLY);
+	if (fd < 0)
+		return fd;
+
+	zones = realloc(pc->zones, (pc->count + 1) * sizeof(*zones));
+	if (!zones) {
+		close(fd);
+		return -ENOMEM;
+	}
+	pc->zones = zones;
+
+	z = &zones[pc->count++];
+	memset(z, 0, sizeof(*z));
+	z->fd_energy = fd;
+
+	if (!__read_attribute(value, path, "max_energy_range_uj"))
+		range = strtoull(value, NULL, 0);
+
+	snprintf(z->zone.name, sizeof(z->zone.name), "%.63s", name);
+	if (!__read_attribute(value, path, "name"))
+		snprintf(z->zone.type, sizeof(z->zone.type), "%.31s", value);
+	syspower_energy_init(&z->zone.energy, range);
+
+	return 0;
+}
+
+static int __cmp_zone(const void *a, const void *b)
+{
+	return strcmp(((const struct powercap_zone *)a)->zone.name,
+		      ((const struct powercap_zone *)b)->zone.name);
+}
+
+struct syspower_powercap *syspower_powercap_open(const char *path)
+{
+	struct syspower_powercap *pc;
+	struct dirent *dir;
+	DIR *d;
+
+	if (!path)
+		path = path_powercap;
+
+	d = opendir(path);
+	if (!d)
+		return NULL;
+
+	pc = calloc(1, sizeof(*pc));
+	if (!pc) {
+		closedir(d);
+		return NULL;
+	}
+
+	while ((dir = readdir(d))) {
+		if (dir->d_name[0] == '.')
+			continue;
+
+		if (__powercap_new_zone(pc, path, dir->d_name) == -ENOMEM) {
+			syspower_powercap_close(pc);
+			closedir(d);
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
+
+	closedir(d);
+
+	qsort(pc->zones, pc->count, sizeof(*pc->zones), __cmp_zone);
+
+	return pc;
+}
+
+void syspower_powercap_close(struct syspower_powercap *pc)
+{
+	unsigned int i;
+
+	if (!pc)
+		return;
+
+	for (i = 0; i < pc->count; i++)
+		close(pc->zones[i].fd_energy);
+
+	free(pc->zones);
+	free(pc);
+}
+
+unsigned int syspower_powercap_count(struct syspower_powercap *pc)
+{
+	return pc ? pc->count : 0;
+}
+
+const struct syspower_powercap_zone *syspower_powercap_get(struct syspower_powercap *pc,
+							   unsigned int index)
+{
+	if (!pc || index >= pc->count)
+		return NULL;
+
+	return &pc->zones[index].zone;
+}
+
+int __powercap_read(struct syspower_powercap *pc, unsigned int index, uint64_t *raw_uj)
+{
+	if (!pc || index >= pc->count)
+		return -EINVAL;
+
+	return __pread_u64(pc->zones[index].fd_energy, raw_uj);
+}
+
+int syspower_powercap_sample(struct syspower_powercap *pc)
+{
+	uint64_t now, raw;
+	unsigned int i;
+	int ret = 0;
+
+	if (!pc)
+		return -EINVAL;
+
+	now = __clock_ns(CLOCK_BOOTTIME);
+
+	for (i = 0; i < pc->count; i++) {
+		struct powercap_zone *z = &pc->zones[i];
+		int err;
+
+		err = __pread_u64(z->fd_energy, &raw);
+		if (err) {
+			ret = err;
+			continue;
+		}
+
+		syspower_energy_update(&z->zone.energy, raw, now);
+	}
+
+	return ret;
+}
@@ -0,0 +1,367 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * This file is part of libsyspower.
+ *
+ * Copyright (C) 2022 Loic Poulain <loic.poulain@linaro.org>
+ */
+
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <syspower.h>
+
+#include <linux/limits.h>
+
+#include "internal.h"
+
+/*
+ * Per-process energy attribution.
+ *
+ * Each sample measures the system energy consumed since the previous one
+ * (RAPL package zones, or a battery power integration) and the CPU ticks
+ * consumed by every process, from /proc/<pid>/stat, and by the idle loop,
+ * from /proc/stat. Energy is then apportioned to processes proportionally to
+ * their tick deltas, the idle share being accounted apart.
+ *
+ * Processes are tracked in an open-addressing (linear probing) table keyed by
+ * pid, so that a sample is one pass over /proc with O(1) accumulator lookups.
+ * Exited processes are dropped when the table is rehashed, their energy being
+ * folded into the exited total.
+ */
+
+static const char path_proc[] = "/proc";
+
+#define PROC_ENERGY_MIN_SIZE 256 /* power of two */
+
+struct proc_entry {
+	uint64_t generation; /* latest sample it was seen in, 0 if free */
+	uint64_t starttime; /* detects pid reuse */
+	struct syspower_proc_energy_entry entry;
+};
+
+struct syspower_proc_energy {
+	struct energy_source system;
+
+	struct proc_entry *table;
+	unsigned int size;
+	unsigned int used;
+	uint64_t generation;
+	uint64_t idle_ticks;
+
+	struct syspower_proc_energy_stats stats;
+	char buf[1024];
+};
+
+static unsigned int __pid_hash(int pid, unsigned int size)
+{
+	/* Fibonacci hashing, consecutive pids are common */
+	return ((uint32_t)pid * 2654435769U) & (size - 1);
+}
+
+static struct proc_entry *__proc_lookup(struct syspower_proc_energy *pe, int pid)
+{
+	unsigned int i = __pid_hash(pid, pe->size);
+
+	while (pe->table[i].generation && pe->table[i].entry.pid != pid)
+		i = (i + 1) & (pe->size - 1);
+
+	return &pe->table[i];
+}
+
+/* Resize the table, dropping processes not seen since the keep sample */
+static int __proc_rehash(struct syspower_proc_energy *pe, unsigned int size,
+			 uint64_t keep)
+{
+	struct proc_entry *old = pe->table, *table;
+	unsigned int i, old_size = pe->size;
+
+	table = calloc(size, sizeof(*table));
+	if (!table)
+		return -ENOMEM;
+
+	pe->table = table;
+	pe->size = size;
+	pe->used = 0;
+
+	for (i = 0; i < old_size; i++) {
+		if (!old[i].generation)
+			continue;
+
+		if (old[i].generation < keep) {
+			pe->stats.exited_uj += old[i].entry.energy_uj;
+			continue;
+		}
+
+		*__proc_lookup(pe, old[i].entry.pid) = old[i];
+		pe->used++;
+	}
+
+	free(old);
+
+	return 0;
+}
+
+static uint64_t __idle_ticks(struct syspower_proc_energy *pe)
+{
+	uint64_t v[5] = { 0 };
+	char path[PATH_MAX + 1];
+	int fd, len;
+
+	snprintf(path, sizeof(path), "%s/stat", path_proc);
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+
+	len = read(fd, pe->buf, sizeof(pe->buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return 0;
+	pe->buf[len] = '\0';
+
+	/* cpu user nice system idle iowait ... */
+	if (sscanf(pe->buf, "cpu %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64,
+		   &v[0], &v[1], &v[2], &v[3], &v[4]) != 5)
+		return 0;
+
+	return v[3] + v[4];
+}
+
+/* Parse /proc/<pid>/stat, comm may contain spaces and parentheses */
+static int __proc_stat(struct syspower_proc_energy *pe, int pid, char *comm,
+		       size_t len, uint64_t *ticks, uint64_t *starttime)
+{
+	char path[PATH_MAX + 1], *start, *end;
+	uint64_t utime, stime;
+	int fd, n;
+
+	snprintf(path, sizeof(path), "%s/%d/stat", path_proc, pid);
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	n = read(fd, pe->buf, sizeof(pe->buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return -EIO;
+	pe->buf[n] = '\0';
+
+	start = strchr(pe->buf, '(');
+	end = strrchr(pe->buf, ')');
+	if (!start || !end || end < start)
+		return -EINVAL;
+
+	snprintf(comm, len, "%.*s", (int)(end - start - 1), start + 1);
+
+	/* Fields 14/15 (utime, stime) and 22 (starttime), 3 is the state */
+	if (sscanf(end + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %" SCNu64
+		   " %" SCNu64 " %*d %*d %*d %*d %*d %*d %" SCNu64,
+		   &utime, &stime, starttime) != 3)
+		return -EINVAL;
+
+	*ticks = utime + stime;
+
+	return 0;
+}
+
+struct syspower_proc_energy *syspower_proc_energy_open(const char *supplyname)
+{
+	struct syspower_proc_energy *pe;
+	int ret;
+
+	pe = calloc(1, sizeof(*pe));
+	if (!pe)
+		return NULL;
+
+	pe->table = calloc(PROC_ENERGY_MIN_SIZE, sizeof(*pe->table));
+	if (!pe->table) {
+		free(pe);
+		return NULL;
+	}
+	pe->size = PROC_ENERGY_MIN_SIZE;
+
+	ret = __energy_source_open(&pe->system, supplyname);
+	if (ret) {
+		syspower_proc_energy_close(pe);
+		errno = -ret;
+		return NULL;
+	}
+
+	return pe;
+}
+
+void syspower_proc_energy_close(struct syspower_proc_energy *pe)
+{
+	if (!pe)
+		return;
+
+	__energy_source_close(&pe->system);
+	free(pe->table);
+	free(pe);
+}
+
+int syspower_proc_energy_sample(struct syspower_proc_energy *pe)
+{
+	uint64_t energy_uj, idle_ticks, total_ticks, now, ticks, starttime;
+	struct syspower_proc_energy_stats *stats;
+	struct proc_entry *p;
+	struct dirent *dir;
+	unsigned int i;
+	char comm[16];
+	int pid;
+	int ret;
+	DIR *d;
+
+	if (!pe)
+		return -EINVAL;
+
+	stats = &pe->stats;
+	now = __clock_ns(CLOCK_BOOTTIME);
+	energy_uj = pe->system.energy.energy_uj;
+
+	ret = __energy_source_sample(&pe->system, now);
+	if (ret)
+		return ret;
+
+	energy_uj = pe->system.energy.energy_uj - energy_uj;
+
+	d = opendir(path_proc);
+	if (!d)
+		return -errno;
+
+	pe->generation++;
+	stats->processes = 0;
+	total_ticks = 0;
+
+	while ((dir = readdir(d))) {
+		pid = atoi(dir->d_name);
+		if (pid <= 0)
+			continue;
+
+		if (__proc_stat(pe, pid, comm, sizeof(comm), &ticks, &starttime))
+			continue; /* exited meanwhile */
+
+		/* Keep the load factor under 1/2 */
+		if ((pe->used + 1) * 2 > pe->size) {
+			ret = __proc_rehash(pe, pe->size * 2, pe->generation - 1);
+			if (ret)
+				break;
+		}
+
+		p = __proc_lookup(pe, pid);
+		if (p->generation && p->starttime != starttime) {
+			/* pid reused, fold the previous process */
+			stats->exited_uj += p->entry.energy_uj;
+			p->generation = 0;
+			pe->used--;
+		}
+
+		if (!p->generation) {
+			memset(p, 0, sizeof(*p));
+			p->entry.pid = pid;
+			p->starttime = starttime;
+			p->entry.cpu_ticks = ticks; /* account from now on */
+			pe->used++;
+		}
+
+		snprintf(p->entry.comm, sizeof(p->entry.comm), "%s", comm);
+		p->entry.delta_ticks = ticks - p->entry.cpu_ticks;
+		p->entry.cpu_ticks = ticks;
+		p->entry.delta_uj = 0;
+		p->generation = pe->generation;
+
+		total_ticks += p->entry.delta_ticks;
+		stats->processes++;
+	}
+
+	closedir(d);
+
+	idle_ticks = __idle_ticks(pe);
+	if (pe->idle_ticks && idle_ticks >= pe->idle_ticks)
+		total_ticks += idle_ticks - pe->idle_ticks;
+	pe->idle_ticks = idle_ticks;
+
+	/* Apportion the interval energy */
+	if (total_ticks) {
+		uint64_t attributed = 0;
+
+		for (i = 0; i < pe->size; i++) {
+			struct syspower_proc_energy_entry *e = &pe->table[i].entry;
+
+			if (pe->table[i].generation != pe->generation || !e->delta_ticks)
+				continue;
+
+			e->delta_uj = energy_uj * e->delta_ticks / total_ticks;
+			e->energy_uj += e->delta_uj;
+			attributed += e->delta_uj;
+		}
+
+		stats->idle_uj += energy_uj - attributed;
+	} else {
+		stats->idle_uj += energy_uj;
+	}
+
+	stats->energy_uj = pe->system.energy.energy_uj;
+	stats->power_uw = syspower_energy_power_uw(&pe->system.energy, 0);
+
+	/* Shrink back once exited processes dominate */
+	if (pe->size > PROC_ENERGY_MIN_SIZE && stats->processes * 8 < pe->size)
+		__proc_rehash(pe, pe->size / 2, pe->generation);
+
+	return ret ? ret : (int)stats->processes;
+}
+
+int syspower_proc_energy_stats(struct syspower_proc_energy *pe,
+			       struct syspower_proc_energy_stats *stats)
+{
+	if (!pe || !stats)
+		return -EINVAL;
+
+	*stats = pe->stats;
+
+	return 0;
+}
+
+int syspower_proc_energy_top(struct syspower_proc_energy *pe,
+			     const struct syspower_proc_energy_entry **entries,
+			     unsigned int max, bool interval)
+{
+	unsigned int i, j, count = 0;
+
+	if (!pe || !entries)
+		return -EINVAL;
+
+	/* Insertion into the bounded sorted output, max is small */
+	for (i = 0; i < pe->size; i++) {
+		const struct syspower_proc_energy_entry *e = &pe->table[i].entry;
+		uint64_t v = interval ? e->delta_uj : e->energy_uj;
+
+		if (pe->table[i].generation != pe->generation || !v)
+			continue;
+
+		for (j = count; j > 0; j--) {
+			if ((interval ? entries[j - 1]->delta_uj :
+			     entries[j - 1]->energy_uj) >= v)
+				break;
+			if (j < max)
+				entries[j] = entries[j - 1];
+		}
+
+		if (j < max) {
+			entries[j] = e;
+			if (count < max)
+				count++;
+		}
+	}
+
+	return count;
+}
@@ -0,0 +1,298 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * This file is part of libsyspower.
+ *
+ * Copyright (C) 2022 Loic Poulain <loic.poulain@linaro.org>
+ */
+
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <syspower.h>
+
+#include "internal.h"
+
+/*
+ * PM QoS latency requests.
+ *
+ * The kernel keeps a CPU latency request for as long as /dev/cpu_dma_latency
+ * stays open, and takes the value of the latest 32-bit write. All in-process
+ * requests are merged into a single held fd: the effective constraint is the
+ * minimum of the active requests, and the fd is only written when that
+ * minimum changes. Device resume latency is handled the same way, per
+ * device, through power/pm_qos_resume_latency_us.
+ */
+
+static const char path_cpu_dma_latency[] = "/dev/cpu_dma_latency";
+
+#define QOS_LATENCY_NONE INT32_MAX
+
+struct qos_target {
+	char devpath[256]; /* empty for cpu_dma_latency */
+	int fd;
+	int32_t applied;
+	char initial[16]; /* device constraint before any request */
+	unsigned int refcount;
+	struct syspower_qos_request *requests;
+	struct qos_target *next;
+};
+
+struct syspower_qos_request {
+	struct qos_target *target;
+	int32_t latency_us;
+	struct syspower_qos_request *next;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	struct qos_target cpu;
+	struct qos_target *devices;
+} qos = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cpu = { .fd = -1 },
+};
+
+static int32_t __qos_aggregate(struct qos_target *t)
+{
+	struct syspower_qos_request *req;
+	int32_t min = QOS_LATENCY_NONE;
+
+	for (req = t->requests; req; req = req->next) {
+		if (req->latency_us < min)
+			min = req->latency_us;
+	}
+
+	return min;
+}
+
+/* Called with qos.lock held */
+static int __qos_update(struct qos_target *t)
+{
+	int32_t value = __qos_aggregate(t);
+	char buf[16];
+	int ret;
+
+	if (value == t->applied)
+		return 0;
+
+	if (!t->devpath[0]) {
+		ret = WRITE_RETRY(t->fd, &value, sizeof(value));
+		if (ret != sizeof(value))
+			return -errno;
+	} else {
+		/*
+		 * sysfs semantic is inverted: "n/a" is a zero latency constraint
+		 * while 0 means no constraint.
+		 */
+		if (value == QOS_LATENCY_NONE)
+			snprintf(buf, sizeof(buf), "%s", t->initial);
+		else if (!value)
+			snprintf(buf, sizeof(buf), "n/a");
+		else
+			snprintf(buf, sizeof(buf), "%d", value);
+
+		ret = __pwrite_attribute(t->fd, buf);
+		if (ret)
+			return ret;
+	}
+
+	t->applied = value;
+
+	return 0;
+}
+
+static struct qos_target *__qos_device_get(const char *devpath)
+{
+	struct qos_target *t;
+	int fd;
+
+	for (t = qos.devices; t; t = t->next) {
+		if (!strcmp(t->devpath, devpath))
+			return t;
+	}
+
+	t = calloc(1, sizeof(*t));
+	if (!t)
+		return NULL;
+
+	snprintf(t->devpath, sizeof(t->devpath), "%s", devpath);
+
+	fd = __open_attribute(devpath, "power/pm_qos_resume_latency_us", O_RDWR);
+	if (fd < 0) {
+		free(t);
+		errno = -fd;
+		return NULL;
+	}
+
+	t->fd = fd;
+	if (__pread_attribute(fd, t->initial, sizeof(t->initial)) <= 0)
+		snprintf(t->initial, sizeof(t->initial), "0");
+	t->applied = QOS_LATENCY_NONE;
+	t->next = qos.devices;
+	qos.devices = t;
+
+	return t;
+}
+
+static void __qos_target_put(struct qos_target *t)
+{
+	struct qos_target **p;
+
+	if (--t->refcount)
+		return;
+
+	if (!t->devpath[0]) {
+		/* closing the fd drops the kernel request */
+		close(t->fd);
+		t->fd = -1;
+		return;
+	}
+
+	for (p = &qos.devices; *p; p = &(*p)->next) {
+		if (*p == t) {
+			*p = t->next;
+			break;
+		}
+	}
+
+	close(t->fd);
+	free(t);
+}
+
+/* Called with qos.lock held */
+static void __qos_request_remove(struct syspower_qos_request *req)
+{
+	struct syspower_qos_request **p;
+	struct qos_target *t = req->target;
+
+	for (p = &t->requests; *p; p = &(*p)->next) {
+		if (*p == req) {
+			*p = req->next;
+			break;
+		}
+	}
+
+	/* Last CPU request is dropped by closing the fd */
+	if (t->devpath[0] || t->refcount > 1)
+		__qos_update(t);
+
+	__qos_target_put(t);
+	free(req);
+}
+
+static struct syspower_qos_request *__qos_request_add(struct qos_target *t,
+						      int32_t latency_us)
+{
+	struct syspower_qos_request *req;
+	int ret;
+
+	req = calloc(1, sizeof(*req));
+	if (!req)
+		return NULL;
+
+	req->target = t;
+	req->latency_us = latency_us;
+	req->next = t->requests;
+	t->requests = req;
+	t->refcount++;
+
+	ret = __qos_update(t);
+	if (ret) {
+		__qos_request_remove(req);
+		errno = -ret;
+		return NULL;
+	}
+
+	return req;
+}
+
+struct syspower_qos_request *syspower_qos_cpu_latency_request(int32_t latency_us)
+{
+	struct syspower_qos_request *req = NULL;
+
+	if (latency_us < 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	pthread_mutex_lock(&qos.lock);
+
+	if (qos.cpu.fd < 0) {
+		qos.cpu.fd = OPEN_RETRY(path_cpu_dma_latency, O_RDWR | O_CLOEXEC);
+		if (qos.cpu.fd < 0)
+			goto unlock;
+		qos.cpu.applied = QOS_LATENCY_NONE;
+	}
+
+	req = __qos_request_add(&qos.cpu, latency_us);
+
+unlock:
+	pthread_mutex_unlock(&qos.lock);
+
+	return req;
+}
+
+struct syspower_qos_request *syspower_qos_resume_latency_request(const char *devpath,
+								int32_t latency_us)
+{
+	struct syspower_qos_request *req = NULL;
+	struct qos_target *t;
+
+	if (!devpath || latency_us < 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	pthread_mutex_lock(&qos.lock);
+
+	t = __qos_device_get(devpath);
+	if (t)
+		req = __qos_request_add(t, latency_us);
+
+	pthread_mutex_unlock(&qos.lock);
+
+	return req;
+}
+
+int syspower_qos_request_update(struct syspower_qos_request *req,
+				int32_t latency_us)
+{
+	int ret;
+
+	if (!req || latency_us < 0)
+		return -EINVAL;
+
+	pthread_mutex_lock(&qos.lock);
+	req->latency_us = latency_us;
+	ret = __qos_update(req->target);
+	pthread_mutex_unlock(&qos.lock);
+
+	return ret;
+}
+
+void syspower_qos_request_remove(struct syspower_qos_request *req)
+{
+	if (!req)
+		return;
+
+	pthread_mutex_lock(&qos.lock);
+	__qos_request_remove(req);
+	pthread_mutex_unlock(&qos.lock);
+}
+
+int32_t syspower_qos_cpu_latency(void)
+{
+	int32_t value;
+
+	pthread_mutex_lock(&qos.lock);
+	value = qos.cpu.fd < 0 ? -1 : qos.cpu.applied;
+	pthread_mutex_unlock(&qos.lock);
+
+	return value;
+}
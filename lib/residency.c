@@ -0,0 +1,373 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * This file is part of libsyspower.
+ *
+ * Copyright (C) 2022 Loic Poulain <loic.poulain@linaro.org>
+ */
+
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <syspower.h>
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "internal.h"
+
+/*
+ * Suspend residency accounting.
+ *
+ * The kernel does not account suspended time in CLOCK_MONOTONIC while it
+ * does in CLOCK_BOOTTIME, so (BOOTTIME - MONOTONIC) is the total time spent
+ * suspended since boot. Sampling this delta at each update gives the
+ * suspended time of the elapsed period, independently of who actually
+ * triggered the suspend (library, autosleep or another process).
+ *
+ * Results are stored in a small file-backed structure mapped shared, with
+ * one bucket per (UTC) day and running totals over the whole window, so that
+ * any process can query the suspended ratio in O(1). Writers serialize with
+ * flock(), readers are lockless and rely on a sequence counter.
+ */
+
+#define RESIDENCY_MAGIC		0x52535044 /* 'RSPD' */
+#define RESIDENCY_VERSION	1
+#define NSEC_PER_SEC		1000000000ULL
+#define SEC_PER_DAY		86400
+
+static const char path_residency[] = "/run/syspower-residency";
+static const char path_suspend_stats[] = "/sys/power/suspend_stats";
+
+struct residency_bucket {
+	int64_t day;
+	uint64_t suspended_ns;
+	uint64_t awake_ns;
+	uint64_t hw_sleep_us;
+	uint32_t suspend_count;
+	uint32_t reserved;
+};
+
+struct residency_shm {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seq;
+	uint32_t last_success;
+	uint64_t last_boottime_ns;
+	uint64_t last_monotonic_ns;
+	uint64_t last_hw_sleep_us;
+	/* running totals over all buckets */
+	uint64_t suspended_ns;
+	uint64_t awake_ns;
+	uint64_t hw_sleep_us;
+	uint64_t suspend_count;
+	struct residency_bucket bucket[SYSPOWER_RESIDENCY_DAYS];
+};
+
+static struct {
+	int fd;
+	struct residency_shm *shm;
+} residency = { .fd = -1 };
+
+static uint64_t __suspend_stat(const char *name)
+{
+	char value[256];
+
+	if (__read_attribute(value, path_suspend_stats, name))
+		return 0;
+
+	return strtoull(value, NULL, 0);
+}
+
+static void __bucket_evict(struct residency_shm *shm, struct residency_bucket *b)
+{
+	shm->suspended_ns -= b->suspended_ns;
+	shm->awake_ns -= b->awake_ns;
+	shm->hw_sleep_us -= b->hw_sleep_us;
+	shm->suspend_count -= b->suspend_count;
+	memset(b, 0, sizeof(*b));
+}
+
+static struct residency_bucket *__bucket_get(struct residency_shm *shm, int64_t day)
+{
+	struct residency_bucket *b = &shm->bucket[day % SYSPOWER_RESIDENCY_DAYS];
+	unsigned int i;
+
+	if (b->day == day)
+		return b;
+
+	/* New day, drop everything that fell out of the window */
+	for (i = 0; i < SYSPOWER_RESIDENCY_DAYS; i++) {
+		if (shm->bucket[i].day <= day - SYSPOWER_RESIDENCY_DAYS ||
+		    shm->bucket[i].day > day)
+			__bucket_evict(shm, &shm->bucket[i]);
+	}
+
+	__bucket_evict(shm, b);
+	b->day = day;
+
+	return b;
+}
+
+/*
+ * Account an elapsed period ending now to the day buckets. A period spanning
+ * UTC midnight (e.g. a night long suspend) is split at the day boundaries,
+ * proportionally, as where suspended time falls within it is unknown.
+ */
+static void __bucket_account(struct residency_shm *shm, uint64_t d_boot,
+			     uint64_t d_susp, uint64_t d_hw_sleep_us)
+{
+	uint64_t end = __clock_ns(CLOCK_REALTIME), start = end - d_boot;
+	uint64_t day_ns = (uint64_t)SEC_PER_DAY * NSEC_PER_SEC;
+	uint64_t susp_left = d_susp, hw_left = d_hw_sleep_us;
+	int64_t day = start / day_ns, today = end / day_ns;
+	struct residency_bucket *b;
+
+	/* Days out of the window are not accounted at all */
+	if (day < today - SYSPOWER_RESIDENCY_DAYS + 1) {
+		uint64_t skipped;
+
+		day = today - SYSPOWER_RESIDENCY_DAYS + 1;
+		skipped = day * day_ns - start;
+		susp_left -= (unsigned __int128)d_susp * skipped / d_boot;
+		hw_left -= (unsigned __int128)d_hw_sleep_us * skipped / d_boot;
+		start += skipped;
+	}
+
+	for (; day <= today; day++) {
+		uint64_t chunk, susp, hw;
+
+		if (day == today) {
+			chunk = end - start;
+			susp = susp_left;
+			hw = hw_left;
+		} else {
+			chunk = (day + 1) * day_ns - start;
+			susp = (unsigned __int128)d_susp * chunk / d_boot;
+			hw = (unsigned __int128)d_hw_sleep_us * chunk / d_boot;
+			if (susp > susp_left)
+				susp = susp_left;
+			if (hw > hw_left)
+				hw = hw_left;
+		}
+
+		if (susp > chunk)
+			susp = chunk;
+
+		b = __bucket_get(shm, day);
+		b->suspended_ns += susp;
+		b->awake_ns += chunk - susp;
+		b->hw_sleep_us += hw;
+		shm->suspended_ns += susp;
+		shm->awake_ns += chunk - susp;
+		shm->hw_sleep_us += hw;
+
+		susp_left -= susp;
+		hw_left -= hw;
+		start += chunk;
+	}
+}
+
+int syspower_residency_open(const char *path)
+{
+	struct stat st;
+	void *map;
+	int fd;
+
+	if (residency.shm)
+		return 0;
+
+	if (!path)
+		path = path_residency;
+
+	fd = OPEN_RETRY(path, O_RDWR | O_CREAT | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (flock(fd, LOCK_EX)) {
+		close(fd);
+		return -errno;
+	}
+
+	if (fstat(fd, &st) || (st.st_size < (off_t)sizeof(struct residency_shm) &&
+			       ftruncate(fd, sizeof(struct residency_shm)))) {
+		flock(fd, LOCK_UN);
+		close(fd);
+		return -errno;
+	}
+
+	map = mmap(NULL, sizeof(struct residency_shm), PROT_READ | PROT_WRITE,
+		   MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		flock(fd, LOCK_UN);
+		close(fd);
+		return -errno;
+	}
+
+	residency.shm = map;
+	residency.fd = fd;
+
+	if (residency.shm->magic != RESIDENCY_MAGIC ||
+	    residency.shm->version != RESIDENCY_VERSION) {
+		memset(residency.shm, 0, sizeof(struct residency_shm));
+		residency.shm->magic = RESIDENCY_MAGIC;
+		residency.shm->version = RESIDENCY_VERSION;
+	}
+
+	flock(fd, LOCK_UN);
+
+	return syspower_residency_update();
+}
+
+void syspower_residency_close(void)
+{
+	if (!residency.shm)
+		return;
+
+	munmap(residency.shm, sizeof(struct residency_shm));
+	close(residency.fd);
+	residency.shm = NULL;
+	residency.fd = -1;
+}
+
+int syspower_residency_update(void)
+{
+	struct residency_shm *shm = residency.shm;
+	uint64_t boot, mono, hw_sleep, d_boot, d_hw_sleep = 0;
+	int64_t d_susp;
+	struct residency_bucket *b;
+	uint32_t success;
+
+	if (!shm)
+		return -EINVAL;
+
+	if (flock(residency.fd, LOCK_EX))
+		return -errno;
+
+	boot = __clock_ns(CLOCK_BOOTTIME);
+	mono = __clock_ns(CLOCK_MONOTONIC);
+	success = __suspend_stat("success");
+	hw_sleep = __suspend_stat("total_hw_sleep");
+
+	__atomic_add_fetch(&shm->seq, 1, __ATOMIC_ACQ_REL);
+
+	/* First run or reboot: only record the baseline */
+	if (!shm->last_boottime_ns || boot < shm->last_boottime_ns)
+		goto baseline;
+
+	/* clocks are sampled non-atomically, clamp the jitter */
+	d_boot = boot - shm->last_boottime_ns;
+	d_susp = (int64_t)(boot - mono) -
+		 (int64_t)(shm->last_boottime_ns - shm->last_monotonic_ns);
+	if (d_susp < 0)
+		d_susp = 0;
+	else if ((uint64_t)d_susp > d_boot)
+		d_susp = d_boot;
+
+	/* suspend_stats cross-check, counters are monotonic since boot */
+	if (hw_sleep >= shm->last_hw_sleep_us)
+		d_hw_sleep = hw_sleep - shm->last_hw_sleep_us;
+
+	__bucket_account(shm, d_boot, d_susp, d_hw_sleep);
+
+	/* Suspends are counted on the day they complete */
+	if (success >= shm->last_success) {
+		b = __bucket_get(shm, __clock_ns(CLOCK_REALTIME) / NSEC_PER_SEC / SEC_PER_DAY);
+		b->suspend_count += success - shm->last_success;
+		shm->suspend_count += success - shm->last_success;
+	}
+
+baseline:
+	shm->last_boottime_ns = boot;
+	shm->last_monotonic_ns = mono;
+	shm->last_success = success;
+	shm->last_hw_sleep_us = hw_sleep;
+
+	__atomic_add_fetch(&shm->seq, 1, __ATOMIC_ACQ_REL);
+
+	flock(residency.fd, LOCK_UN);
+
+	return 0;
+}
+
+int syspower_residency_get(unsigned int day, struct syspower_residency *res)
+{
+	struct residency_shm *shm = residency.shm;
+	int64_t today;
+	uint32_t seq;
+
+	if (!shm || !res || day >= SYSPOWER_RESIDENCY_DAYS)
+		return -EINVAL;
+
+	today = __clock_ns(CLOCK_REALTIME) / NSEC_PER_SEC / SEC_PER_DAY;
+
+	do {
+		struct residency_bucket *b;
+
+		seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+
+		b = &shm->bucket[(today - day) % SYSPOWER_RESIDENCY_DAYS];
+		if (b->day == today - day) {
+			res->suspended_ms = b->suspended_ns / 1000000;
+			res->awake_ms = b->awake_ns / 1000000;
+			res->hw_sleep_ms = b->hw_sleep_us / 1000;
+			res->suspend_count = b->suspend_count;
+		} else {
+			memset(res, 0, sizeof(*res));
+		}
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || seq != __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE));
+
+	return 0;
+}
+
+int syspower_residency_total(struct syspower_residency *res)
+{
+	struct residency_shm *shm = residency.shm;
+	uint32_t seq;
+
+	if (!shm || !res)
+		return -EINVAL;
+
+	do {
+		seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+
+		res->suspended_ms = shm->suspended_ns / 1000000;
+		res->awake_ms = shm->awake_ns / 1000000;
+		res->hw_sleep_ms = shm->hw_sleep_us / 1000;
+		res->suspend_count = shm->suspend_count;
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || seq != __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE));
+
+	return 0;
+}
+
+int syspower_residency_percent(void)
+{
+	struct syspower_residency res;
+	uint64_t total;
+	int ret;
+
+	ret = syspower_residency_total(&res);
+	if (ret)
+		return ret;
+
+	total = res.suspended_ms + res.awake_ms;
+	if (!total)
+		return 0;
+
+	return (int)(res.suspended_ms * 100 / total);
+}
+
+void __residency_update(void)
+{
+	if (residency.shm)
+		syspower_residency_update();
+}
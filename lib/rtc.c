@@ -0,0 +1,369 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * This file is part of libsyspower.
+ *
+ * Copyright (C) 2022 Loic Poulain <loic.poulain@linaro.org>
+ */
+
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <syspower.h>
+
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+#include <linux/rtc.h>
+
+#include "internal.h"
+
+static const char path_rtc_dev[] = "/dev/rtc";
+
+/*
+ * The RTC fd is non-blocking, waiters poll it along with their own eventfd,
+ * so that waits can be interrupted and the fd can join any event loop. Only
+ * one read() gets the alarm: that waiter completes all the others through
+ * their eventfd, as a cancel does. Waiters register under the lock, alarms
+ * and cancels only complete the waits in progress and leave nothing behind
+ * for later ones.
+ */
+struct rtc_waiter {
+	int fd_wake;
+	int result; /* 1 while pending, protected by rtc.lock */
+	struct rtc_waiter *next;
+};
+
+static struct {
+	int fd_rtc;
+	pthread_mutex_t lock;
+	struct rtc_waiter *waiters;
+} rtc = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* The hardware RTC is expected to run in UTC */
+static time_t __rtc_to_time(const struct rtc_time *rtc_tm)
+{
+	struct tm tm = {
+		.tm_sec = rtc_tm->tm_sec,
+		.tm_min = rtc_tm->tm_min,
+		.tm_hour = rtc_tm->tm_hour,
+		.tm_mday = rtc_tm->tm_mday,
+		.tm_mon = rtc_tm->tm_mon,
+		.tm_year = rtc_tm->tm_year,
+	};
+
+	return timegm(&tm);
+}
+
+static void __time_to_rtc(time_t t, struct rtc_time *rtc_tm)
+{
+	struct tm tm;
+
+	gmtime_r(&t, &tm);
+
+	memset(rtc_tm, 0, sizeof(*rtc_tm));
+	rtc_tm->tm_sec = tm.tm_sec;
+	rtc_tm->tm_min = tm.tm_min;
+	rtc_tm->tm_hour = tm.tm_hour;
+	rtc_tm->tm_mday = tm.tm_mday;
+	rtc_tm->tm_mon = tm.tm_mon;
+	rtc_tm->tm_year = tm.tm_year;
+	rtc_tm->tm_wday = tm.tm_wday;
+	rtc_tm->tm_yday = tm.tm_yday;
+	rtc_tm->tm_isdst = -1;
+}
+
+static int __rtc_open(void)
+{
+	int ret;
+
+	if ((ret = __open_once(&rtc.fd_rtc, path_rtc_dev,
+			       O_RDWR | O_CLOEXEC | O_NONBLOCK)))
+		return -errno;
+
+	return rtc.fd_rtc;
+}
+
+int syspower_rtc_time(time_t *now)
+{
+	struct rtc_time rtc_tm;
+	int fd;
+
+	fd = __rtc_open();
+	if (fd < 0)
+		return fd;
+
+	if (ioctl(fd, RTC_RD_TIME, &rtc_tm) == -1)
+		return -errno;
+
+	*now = __rtc_to_time(&rtc_tm);
+
+	return 0;
+}
+
+int syspower_rtc_get_alarmfd(void)
+{
+	return __rtc_open();
+}
+
+/* Complete all the waits in progress */
+static int __rtc_waiters_complete(int result)
+{
+	struct rtc_waiter *waiter;
+	uint64_t one = 1;
+	int ret = 0;
+
+	pthread_mutex_lock(&rtc.lock);
+	for (waiter = rtc.waiters; waiter; waiter = waiter->next) {
+		if (waiter->result != 1)
+			continue;
+
+		waiter->result = result;
+		if (WRITE_RETRY(waiter->fd_wake, &one, sizeof(one)) < 0 && !ret)
+			ret = -errno;
+	}
+	pthread_mutex_unlock(&rtc.lock);
+
+	return ret;
+}
+
+int syspower_rtc_read_alarmfd(int fd)
+{
+	unsigned long data;
+
+	if (fd < 0)
+		return -EINVAL;
+
+	if (READ_RETRY(fd, &data, sizeof(data)) < 0)
+		return -errno;
+
+	if (!(data & RTC_AF))
+		return -EAGAIN;
+
+	/* Whoever reads the shared fd gets the alarm for all the waiters */
+	if (fd > 0 && fd == rtc.fd_rtc)
+		__rtc_waiters_complete(0);
+
+	return 0;
+}
+
+int syspower_rtc_alarm_wait(int timeout_ms)
+{
+	struct rtc_waiter waiter, **pw;
+	uint64_t deadline = 0, now;
+	struct pollfd fds[2];
+	int fd, ret, remaining = timeout_ms;
+
+	fd = __rtc_open();
+	if (fd < 0)
+		return fd;
+
+	waiter.fd_wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (waiter.fd_wake < 0)
+		return -errno;
+	waiter.result = 1;
+
+	pthread_mutex_lock(&rtc.lock);
+	waiter.next = rtc.waiters;
+	rtc.waiters = &waiter;
+	pthread_mutex_unlock(&rtc.lock);
+
+	fds[0].fd = fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = waiter.fd_wake;
+	fds[1].events = POLLIN;
+
+	if (timeout_ms > 0)
+		deadline = __clock_ns(CLOCK_MONOTONIC) / 1000000 + timeout_ms;
+
+	while (1) {
+		ret = poll(fds, 2, remaining);
+		if (ret < 0 && errno != EINTR) {
+			ret = -errno;
+			break;
+		}
+		if (!ret) {
+			ret = -ETIMEDOUT;
+			break;
+		}
+
+		/* Completed by a cancel or by the waiter which got the alarm */
+		if (ret > 0 && fds[1].revents & POLLIN) {
+			pthread_mutex_lock(&rtc.lock);
+			ret = waiter.result;
+			pthread_mutex_unlock(&rtc.lock);
+			break;
+		}
+
+		if (ret > 0 && fds[0].revents & POLLIN) {
+			ret = syspower_rtc_read_alarmfd(fd);
+			if (ret != -EAGAIN)
+				break;
+		}
+
+		/* Interrupted or spurious wakeup, the timeout keeps running */
+		if (deadline) {
+			now = __clock_ns(CLOCK_MONOTONIC) / 1000000;
+			if (now >= deadline) {
+				ret = -ETIMEDOUT;
+				break;
+			}
+			remaining = deadline - now;
+		}
+	}
+
+	pthread_mutex_lock(&rtc.lock);
+	for (pw = &rtc.waiters; *pw; pw = &(*pw)->next) {
+		if (*pw == &waiter) {
+			*pw = waiter.next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&rtc.lock);
+
+	close(waiter.fd_wake);
+
+	return ret;
+}
+
+int syspower_rtc_alarm_cancel(void)
+{
+	int ret;
+
+	ret = syspower_rtc_wakealarm_at(0, false);
+	if (ret)
+		return ret;
+
+	return __rtc_waiters_complete(-ECANCELED);
+}
+
+int syspower_rtc_wakealarm_at(time_t when, bool wait)
+{
+	struct rtc_wkalrm alarm = {};
+	int fd;
+
+	fd = __rtc_open();
+	if (fd < 0)
+		return fd;
+
+	if (when) {
+		alarm.enabled = 1;
+		__time_to_rtc(when, &alarm.time);
+	}
+
+	if (ioctl(fd, RTC_WKALM_SET, &alarm) == -1) {
+		time_t now;
+		int ret;
+
+		/* Legacy drivers only support the 24h alarm */
+		if (errno != EINVAL && errno != ENOTTY)
+			return -errno;
+
+		if (!when)
+			return ioctl(fd, RTC_AIE_OFF, 0) == -1 ? -errno : 0;
+
+		if ((ret = syspower_rtc_time(&now)))
+			return ret;
+
+		if (when <= now || when - now >= 24 * 3600)
+			return -ERANGE;
+
+		if (ioctl(fd, RTC_ALM_SET, &alarm.time) == -1 ||
+		    ioctl(fd, RTC_AIE_ON, 0) == -1)
+			return -errno;
+	}
+
+	if (when && wait)
+		return syspower_rtc_alarm_wait(-1);
+
+	return 0;
+}
+
+int __rtc_wakealarm_read(time_t *when)
+{
+	struct rtc_wkalrm alarm = {};
+	int fd;
+
+	fd = __rtc_open();
+	if (fd < 0)
+		return fd;
+
+	if (ioctl(fd, RTC_WKALM_RD, &alarm) == -1)
+		return -errno;
+
+	*when = alarm.enabled ? __rtc_to_time(&alarm.time) : 0;
+
+	return 0;
+}
+
+int syspower_rtc_wakealarm(unsigned int seconds, bool wait)
+{
+	time_t now;
+	int ret;
+
+	if (!seconds)
+		return syspower_rtc_wakealarm_at(0, false);
+
+	/* Stick to the RTC clock, which may drift from system time */
+	if ((ret = syspower_rtc_time(&now)))
+		return ret;
+
+	return syspower_rtc_wakealarm_at(now + seconds, wait);
+}
+
+int syspower_alarm_timer_open(void)
+{
+	int fd;
+
+	fd = timerfd_create(CLOCK_BOOTTIME_ALARM, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (fd < 0)
+		return -errno;
+
+	return fd;
+}
+
+int syspower_alarm_timer_set(int fd, uint64_t delay_ms)
+{
+	struct itimerspec its = {
+		.it_value.tv_sec = delay_ms / 1000,
+		.it_value.tv_nsec = (delay_ms % 1000) * 1000000,
+	};
+
+	if (fd < 0)
+		return -EINVAL;
+
+	if (timerfd_settime(fd, 0, &its, NULL))
+		return -errno;
+
+	return 0;
+}
+
+int syspower_alarm_timer_set_abs(int fd, uint64_t boottime_ms)
+{
+	struct itimerspec its = {
+		.it_value.tv_sec = boottime_ms / 1000,
+		.it_value.tv_nsec = (boottime_ms % 1000) * 1000000,
+	};
+
+	if (fd < 0 || !boottime_ms)
+		return -EINVAL;
+
+	if (timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL))
+		return -errno;
+
+	return 0;
+}
+
+void syspower_alarm_timer_close(int fd)
+{
+	if (fd >= 0)
+		close(fd);
+}
@@ -0,0 +1,302 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * This file is part of libsyspower.
+ *
+ * Copyright (C) 2022 Loic Poulain <loic.poulain@linaro.org>
+ */
+
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <syspower.h>
+
+#include <linux/limits.h>
+
+#include "internal.h"
+
+/*
+ * Runtime PM devices are discovered once, from the same /sys/devices walk as
+ * wakeup sources, and their status and time attributes are kept open so that
+ * sampling all of them is a single batch of pread() calls. Policy attributes
+ * (control, autosuspend delay) are only opened when read or applied, to keep
+ * the number of open files reasonable on large systems.
+ */
+
+struct rpm_device {
+	char name[256];
+	char bus[32];
+	char devpath[PATH_MAX + 1];
+	int fd_status;
+	int fd_active;
+	int fd_suspended;
+	struct syspower_rpm_device dev;
+};
+
+static struct {
+	struct rpm_device *devices;
+	unsigned int count;
+	unsigned int size;
+	bool scanned;
+	int error; /* first scan error */
+} rpm;
+
+static const char *rpm_status[] = {
+	[SYSPOWER_RPM_STATUS_UNKNOWN] = "unknown",
+	[SYSPOWER_RPM_STATUS_ACTIVE] = "active",
+	[SYSPOWER_RPM_STATUS_SUSPENDED] = "suspended",
+	[SYSPOWER_RPM_STATUS_SUSPENDING] = "suspending",
+	[SYSPOWER_RPM_STATUS_RESUMING] = "resuming",
+	[SYSPOWER_RPM_STATUS_ERROR] = "error",
+};
+
+/* Policy attributes stay readable without write permission */
+static int __rpm_open_rw(const char *devpath, const char *name)
+{
+	int fd = __open_attribute(devpath, name, O_RDWR);
+
+	if (fd == -EACCES)
+		fd = __open_attribute(devpath, name, O_RDONLY);
+
+	return fd;
+}
+
+static void __rpm_error(int err)
+{
+	if (!rpm.error)
+		rpm.error = err;
+}
+
+static void __rpm_new_device(char *devpath)
+{
+	char value[256], link[PATH_MAX + 16];
+	struct rpm_device *d;
+	char *devname;
+	int fd, ret;
+
+	/* Filter devices without runtime PM support */
+	fd = __open_attribute(devpath, "power/runtime_status", O_RDONLY);
+	if (fd < 0) {
+		if (fd != -ENOTSUP)
+			__rpm_error(fd);
+		return;
+	}
+
+	if (__pread_attribute(fd, value, sizeof(value)) < 0 ||
+	    !strcmp(value, "unsupported")) {
+		close(fd);
+		return;
+	}
+
+	if (rpm.count == rpm.size) {
+		unsigned int size = rpm.size ? rpm.size * 2 : 64;
+		struct rpm_device *devices;
+
+		devices = realloc(rpm.devices, size * sizeof(*devices));
+		if (!devices) {
+			__rpm_error(-ENOMEM);
+			close(fd);
+			return;
+		}
+
+		rpm.devices = devices;
+		rpm.size = size;
+	}
+
+	d = &rpm.devices[rpm.count++];
+	memset(d, 0, sizeof(*d));
+
+	devname = basename(devpath);
+	snprintf(d->name, sizeof(d->name), "%s", devname);
+	if (!realpath(devpath, d->devpath))
+		snprintf(d->devpath, sizeof(d->devpath), "%s", devpath);
+
+	snprintf(link, sizeof(link), "%s/subsystem", d->devpath);
+	ret = readlink(link, value, sizeof(value) - 1);
+	if (ret > 0) {
+		value[ret] = '\0';
+		snprintf(d->bus, sizeof(d->bus), "%s", basename(value));
+	}
+
+	d->fd_status = fd;
+	d->fd_active = __open_attribute(d->devpath, "power/runtime_active_time", O_RDONLY);
+	d->fd_suspended = __open_attribute(d->devpath, "power/runtime_suspended_time", O_RDONLY);
+	if (d->fd_active < 0 && d->fd_active != -ENOTSUP)
+		__rpm_error(d->fd_active);
+	if (d->fd_suspended < 0 && d->fd_suspended != -ENOTSUP)
+		__rpm_error(d->fd_suspended);
+
+	d->dev.name = d->name;
+	d->dev.bus = d->bus;
+	d->dev.devpath = d->devpath;
+}
+
+static void __rpm_device_close(struct rpm_device *d)
+{
+	int *fds[] = { &d->fd_status, &d->fd_active, &d->fd_suspended };
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(fds); i++) {
+		if (*fds[i] >= 0)
+			close(*fds[i]);
+		*fds[i] = -1;
+	}
+}
+
+void syspower_rpm_release(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < rpm.count; i++)
+		__rpm_device_close(&rpm.devices[i]);
+
+	free(rpm.devices);
+	memset(&rpm, 0, sizeof(rpm));
+}
+
+int syspower_rpm_scan(void)
+{
+	char current_path[PATH_MAX + 1] = "/sys/devices";
+
+	syspower_rpm_release();
+
+	__sysfs_devices_parse(current_path, __rpm_new_device);
+	rpm.scanned = true;
+
+	return rpm.error ? rpm.error : (int)rpm.count;
+}
+
+static void __rpm_device_sample(struct rpm_device *d)
+{
+	struct syspower_rpm_device *dev = &d->dev;
+	uint64_t active = 0, suspended = 0;
+	char value[256];
+	unsigned int i;
+
+	dev->status = SYSPOWER_RPM_STATUS_UNKNOWN;
+	if (__pread_attribute(d->fd_status, value, sizeof(value)) > 0) {
+		for (i = 0; i < ARRAY_SIZE(rpm_status); i++) {
+			if (!strcmp(value, rpm_status[i]))
+				dev->status = i;
+		}
+	}
+
+	if (d->fd_active >= 0)
+		__pread_u64(d->fd_active, &active);
+	if (d->fd_suspended >= 0)
+		__pread_u64(d->fd_suspended, &suspended);
+
+	dev->delta_active_ms = active >= dev->active_ms ? active - dev->active_ms : 0;
+	dev->delta_suspended_ms = suspended >= dev->suspended_ms ?
+				  suspended - dev->suspended_ms : 0;
+	dev->active_ms = active;
+	dev->suspended_ms = suspended;
+	dev->suspended_permille = active + suspended ?
+				  suspended * 1000 / (active + suspended) : 0;
+
+	dev->autosuspend = false;
+	if (!__read_attribute(value, d->devpath, "power/control"))
+		dev->autosuspend = !strcmp(value, "auto");
+
+	dev->autosuspend_delay_ms = -1;
+	if (!__read_attribute(value, d->devpath, "power/autosuspend_delay_ms"))
+		dev->autosuspend_delay_ms = atoi(value);
+}
+
+int syspower_rpm_sample(void)
+{
+	unsigned int i;
+
+	if (!rpm.scanned)
+		syspower_rpm_scan();
+
+	for (i = 0; i < rpm.count; i++)
+		__rpm_device_sample(&rpm.devices[i]);
+
+	return rpm.count;
+}
+
+const struct syspower_rpm_device *syspower_rpm_get(unsigned int index)
+{
+	if (!rpm.scanned)
+		syspower_rpm_scan();
+
+	if (index >= rpm.count)
+		return NULL;
+
+	return &rpm.devices[index].dev;
+}
+
+int syspower_rpm_apply(const char *bus, bool autosuspend, int delay_ms)
+{
+	const char *control = autosuspend ? "auto" : "on";
+	unsigned int i, changed = 0;
+	char value[32];
+	int ret = 0, err, fd;
+
+	if (!rpm.scanned)
+		syspower_rpm_scan();
+
+	for (i = 0; i < rpm.count; i++) {
+		struct rpm_device *d = &rpm.devices[i];
+
+		if (bus && strcmp(bus, d->bus))
+			continue;
+
+		/* Only write what actually differs */
+		if (delay_ms >= 0) {
+			fd = __rpm_open_rw(d->devpath, "power/autosuspend_delay_ms");
+			if (fd < 0) {
+				/* Autosuspend delay is optional */
+				if (fd != -ENOTSUP)
+					ret = fd;
+			} else if (__pread_attribute(fd, value, sizeof(value)) > 0 &&
+				   atoi(value) != delay_ms) {
+				snprintf(value, sizeof(value), "%d", delay_ms);
+				err = __pwrite_attribute(fd, value);
+				if (!err) {
+					d->dev.autosuspend_delay_ms = delay_ms;
+					changed++;
+				} else {
+					ret = err;
+				}
+			}
+			if (fd >= 0)
+				close(fd);
+		}
+
+		fd = __rpm_open_rw(d->devpath, "power/control");
+		if (fd < 0) {
+			ret = fd;
+			continue;
+		}
+
+		if (__pread_attribute(fd, value, sizeof(value)) > 0 &&
+		    strcmp(value, control)) {
+			err = __pwrite_attribute(fd, control);
+			if (!err) {
+				d->dev.autosuspend = autosuspend;
+				changed++;
+			} else {
+				ret = err;
+			}
+		}
+
+		close(fd);
+	}
+
+	return ret ? ret : (int)changed;
+}
+
+const char *syspower_rpm_status_str(enum syspower_rpm_status status)
+{
+	if (status >= ARRAY_SIZE(rpm_status))
+		return rpm_status[SYSPOWER_RPM_STATUS_UNKNOWN];
+
+	return rpm_status[status];
+}
@@ -0,0 +1,427 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * This file is part of libsyspower.
+ *
+ * Copyright (C) 2022 Loic Poulain <loic.poulain@linaro.org>
+ */
+
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <syspower.h>
+
+#include <linux/limits.h>
+
+#include "internal.h"
+
+/*
+ * Supply power-flow graph.
+ *
+ * Supplies are nodes, edges go from a supplier to the supplies it feeds, as
+ * described by the supplied_from/supplied_to attributes. Kernels which do not
+ * expose them get the default topology: every external supply (mains, USB,
+ * wireless...) feeds every battery.
+ *
+ * Each node caches its effective input (powered or not, and by which external
+ * source). On a supply event only the changed node is re-read, and the inputs
+ * of the nodes downstream of it are recomputed from the external sources, so
+ * a query is a lookup, and an update costs the subgraph below the change.
+ */
+
+static const char path_supply[] = "/sys/class/power_supply";
+
+#define SUPPLY_GRAPH_MAX 64 /* edges are node bitmasks */
+
+struct supply_node {
+	char name[64];
+	enum syspower_supply_type type;
+	bool online;
+	bool powered;
+	int source; /* external supply node index, -1 if none */
+	unsigned int depth; /* edges to the source */
+	uint64_t parents;
+	uint64_t children;
+};
+
+struct supply_topology {
+	struct supply_node nodes[SUPPLY_GRAPH_MAX];
+	unsigned int count;
+};
+
+/*
+ * Updates (events, builds) are serialized by the update lock, and do their
+ * sysfs reads with it only: a topology is built aside and swapped in, so that
+ * queries never wait for sysfs.
+ */
+static struct {
+	pthread_mutex_t lock; /* topology */
+	pthread_mutex_t update; /* updaters, listening */
+	struct supply_topology topo;
+	bool listening;
+} graph = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.update = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static int __graph_find(const struct supply_topology *t, const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < t->count; i++) {
+		if (!strcmp(t->nodes[i].name, name))
+			return i;
+	}
+
+	return -1;
+}
+
+static void __graph_link(struct supply_topology *t, int from, int to)
+{
+	if (from < 0 || to < 0 || from == to)
+		return;
+
+	t->nodes[from].children |= 1ULL << to;
+	t->nodes[to].parents |= 1ULL << from;
+}
+
+/* Link node with the names listed in its supplied_from/supplied_to attribute */
+static bool __graph_links(struct supply_topology *t, unsigned int i,
+			  const char *attr, bool from)
+{
+	char path[PATH_MAX + 1], value[256], *name, *saveptr;
+	bool linked = false;
+
+	snprintf(path, sizeof(path), "%s/%s", path_supply, t->nodes[i].name);
+	if (__read_attribute(value, path, attr))
+		return false;
+
+	for (name = strtok_r(value, " ,\t", &saveptr); name;
+	     name = strtok_r(NULL, " ,\t", &saveptr)) {
+		int j = __graph_find(t, name);
+
+		if (j < 0)
+			continue;
+
+		if (from)
+			__graph_link(t, j, i);
+		else
+			__graph_link(t, i, j);
+		linked = true;
+	}
+
+	return linked;
+}
+
+static bool __graph_external(const struct supply_node *n)
+{
+	return n->type != SYSPOWER_SUPPLY_TYPE_BATTERY &&
+	       n->type != SYSPOWER_SUPPLY_TYPE_UPS &&
+	       n->type != SYSPOWER_SUPPLY_TYPE_BMS;
+}
+
+static int __graph_read(const char *name, enum syspower_supply_type *type,
+			bool *online)
+{
+	struct syspower_supply_snapshot snap;
+	int ret;
+
+	ret = syspower_supply_snapshot(name, &snap);
+	if (ret)
+		return ret;
+
+	*type = snap.type;
+	*online = snap.online;
+
+	return 0;
+}
+
+/* Node and the nodes it feeds, directly or not */
+static uint64_t __graph_downstream(const struct supply_topology *t,
+				   unsigned int i)
+{
+	uint64_t set = 1ULL << i, pending = set;
+
+	while (pending) {
+		unsigned int j = __builtin_ctzll(pending);
+		uint64_t next = t->nodes[j].children & ~set;
+
+		pending = (pending & ~(1ULL << j)) | next;
+		set |= next;
+	}
+
+	return set;
+}
+
+/*
+ * Recompute the input of the nodes in set, in BFS order from the external
+ * sources: a node only takes its input from a parent settled one level
+ * closer to a source, so that a cycle cannot keep itself powered once its
+ * source is gone. Nodes outside set cannot be fed by it (set is closed
+ * downstream) and keep their input.
+ */
+static void __graph_eval(struct supply_topology *t, uint64_t set)
+{
+	uint64_t settled = ~set, level, pending;
+	unsigned int depth, i, j;
+
+	for (depth = 0; depth < t->count && (set & ~settled); depth++) {
+		level = 0;
+
+		for (pending = set & ~settled; pending; pending &= pending - 1) {
+			struct supply_node *n;
+
+			i = __builtin_ctzll(pending);
+			n = &t->nodes[i];
+			n->source = -1;
+
+			if (!depth && n->online && __graph_external(n))
+				n->source = i;
+
+			for (j = 0; n->source < 0 && j < t->count; j++) {
+				const struct supply_node *p = &t->nodes[j];
+
+				if ((n->parents & settled & (1ULL << j)) &&
+				    p->powered && p->depth + 1 == depth)
+					n->source = p->source;
+			}
+
+			if (n->source >= 0) {
+				n->powered = true;
+				n->depth = depth;
+				level |= 1ULL << i;
+			}
+		}
+
+		settled |= level;
+	}
+
+	/* Not fed by any online external supply */
+	for (pending = set & ~settled; pending; pending &= pending - 1) {
+		struct supply_node *n = &t->nodes[__builtin_ctzll(pending)];
+
+		n->powered = false;
+		n->source = -1;
+		n->depth = 0;
+	}
+}
+
+static int __graph_build(struct supply_topology *t)
+{
+	bool linked = false;
+	struct dirent *dir;
+	unsigned int i, j;
+	DIR *d;
+
+	t->count = 0;
+
+	d = opendir(path_supply);
+	if (!d)
+		return -errno;
+
+	while ((dir = readdir(d)) && t->count < SUPPLY_GRAPH_MAX) {
+		struct supply_node *n = &t->nodes[t->count];
+
+		if (dir->d_name[0] == '.')
+			continue;
+
+		memset(n, 0, sizeof(*n));
+		snprintf(n->name, sizeof(n->name), "%.63s", dir->d_name);
+		n->source = -1;
+		/* Unreadable (e.g. being removed), offline until its next event */
+		if (__graph_read(n->name, &n->type, &n->online))
+			n->online = false;
+		t->count++;
+	}
+
+	closedir(d);
+
+	for (i = 0; i < t->count; i++) {
+		linked |= __graph_links(t, i, "supplied_from", true);
+		linked |= __graph_links(t, i, "supplied_to", false);
+	}
+
+	if (!linked) {
+		for (i = 0; i < t->count; i++) {
+			for (j = 0; j < t->count; j++) {
+				if (__graph_external(&t->nodes[i]) &&
+				    t->nodes[j].type == SYSPOWER_SUPPLY_TYPE_BATTERY)
+					__graph_link(t, i, j);
+			}
+		}
+	}
+
+	if (t->count)
+		__graph_eval(t, ~0ULL >> (64 - t->count));
+
+	return t->count;
+}
+
+/* Called with graph.update held */
+static int __graph_rebuild(void)
+{
+	struct supply_topology *t;
+	int ret;
+
+	t = malloc(sizeof(*t));
+	if (!t)
+		return -ENOMEM;
+
+	ret = __graph_build(t);
+	if (ret >= 0) {
+		pthread_mutex_lock(&graph.lock);
+		graph.topo = *t;
+		pthread_mutex_unlock(&graph.lock);
+	}
+
+	free(t);
+
+	return ret;
+}
+
+static void __graph_event(const struct syspower_event *ev, void *data)
+{
+	enum syspower_supply_type type;
+	struct supply_node *n;
+	bool online;
+	int i, ret;
+
+	(void)data;
+
+	pthread_mutex_lock(&graph.update);
+
+	/* Updaters are serialized, nodes cannot move until we are done */
+	pthread_mutex_lock(&graph.lock);
+	i = __graph_find(&graph.topo, ev->name);
+	pthread_mutex_unlock(&graph.lock);
+
+	if (i < 0) {
+		/* Supply added, rebuild topology */
+		__graph_rebuild();
+	} else {
+		ret = __graph_read(ev->name, &type, &online);
+
+		pthread_mutex_lock(&graph.lock);
+		n = &graph.topo.nodes[i];
+		if (ret) {
+			/* Unreadable, e.g. removed: it no longer feeds anything */
+			n->online = false;
+		} else {
+			n->type = type;
+			n->online = online;
+		}
+		__graph_eval(&graph.topo, __graph_downstream(&graph.topo, i));
+		pthread_mutex_unlock(&graph.lock);
+	}
+
+	pthread_mutex_unlock(&graph.update);
+}
+
+int syspower_supply_graph_build(void)
+{
+	int ret;
+
+	pthread_mutex_lock(&graph.update);
+
+	ret = __graph_rebuild();
+	if (ret >= 0 && !graph.listening &&
+	    !syspower_event_register(SYSPOWER_EVENT_MASK(SYSPOWER_EVENT_SUPPLY),
+				     __graph_event, NULL))
+		graph.listening = true;
+
+	pthread_mutex_unlock(&graph.update);
+
+	return ret;
+}
+
+void syspower_supply_graph_release(void)
+{
+	bool listening;
+
+	pthread_mutex_lock(&graph.update);
+	listening = graph.listening;
+	graph.listening = false;
+	pthread_mutex_unlock(&graph.update);
+
+	/* Out of the update lock, an event in progress may be waiting for it */
+	if (listening)
+		syspower_event_unregister(__graph_event, NULL);
+
+	pthread_mutex_lock(&graph.update);
+	pthread_mutex_lock(&graph.lock);
+	graph.topo.count = 0;
+	pthread_mutex_unlock(&graph.lock);
+	pthread_mutex_unlock(&graph.update);
+}
+
+int syspower_supply_graph_update(const char *supplyname)
+{
+	struct syspower_event ev = { .type = SYSPOWER_EVENT_SUPPLY, .name = supplyname };
+
+	if (!supplyname)
+		return -EINVAL;
+
+	__graph_event(&ev, NULL);
+
+	return 0;
+}
+
+int syspower_supply_graph_input(const char *supplyname,
+				struct syspower_supply_input *input)
+{
+	struct supply_topology *t = &graph.topo;
+	struct supply_node *n;
+	int i, ret = 0;
+
+	if (!supplyname || !input)
+		return -EINVAL;
+
+	pthread_mutex_lock(&graph.lock);
+
+	i = __graph_find(t, supplyname);
+	if (i < 0) {
+		ret = -ENOENT;
+		goto unlock;
+	}
+
+	n = &t->nodes[i];
+	input->powered = n->powered;
+	input->depth = n->depth;
+	input->source[0] = '\0';
+	if (n->source >= 0)
+		snprintf(input->source, sizeof(input->source), "%s",
+			 t->nodes[n->source].name);
+
+unlock:
+	pthread_mutex_unlock(&graph.lock);
+
+	return ret;
+}
+
+int syspower_supply_graph_suppliers(const char *supplyname, char names[][64],
+				    unsigned int max)
+{
+	struct supply_topology *t = &graph.topo;
+	unsigned int j, count = 0;
+	int i;
+
+	if (!supplyname)
+		return -EINVAL;
+
+	pthread_mutex_lock(&graph.lock);
+
+	i = __graph_find(t, supplyname);
+	for (j = 0; i >= 0 && j < t->count && count < max; j++) {
+		if (t->nodes[i].parents & (1ULL << j))
+			snprintf(names[count++], 64, "%s", t->nodes[j].name);
+	}
+
+	pthread_mutex_unlock(&graph.lock);
+
+	return i < 0 ? -ENOENT : (int)count;
+}
@@ -0,0 +1,163 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * This file is part of libsyspower.
+ *
+ * Copyright (C) 2022 Loic Poulain <loic.poulain@linaro.org>
+ */
+
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <errno.h>
+#include <time.h>
+#include <syspower.h>
+
+#include "internal.h"
+
+/*
+ * Supply snapshot fast path.
+ *
+ * The power_supply uevent attribute holds all POWER_SUPPLY_* properties,
+ * generated in one go by the driver. Reading it once through a held fd gives
+ * an internally consistent set of values for the cost of one pread(). Reads
+ * honour the supply deadline (see supply_worker.c).
+ */
+
+#define SUPPLY_UEVENT_SIZE 4096 /* sysfs attributes are page sized */
+
+enum uevent_kind {
+	UEVENT_INT,
+	UEVENT_INT64,
+	UEVENT_MILLI, /* micro unit reported, milli unit stored */
+	UEVENT_BOOL,
+	UEVENT_TYPE,
+	UEVENT_STATUS,
+	UEVENT_HEALTH,
+};
+
+static const struct {
+	const char *key;
+	enum uevent_kind kind;
+	size_t offset;
+} uevent_props[] = {
+#define PROP(key, kind, field) { key, kind, offsetof(struct syspower_supply_snapshot, field) }
+	PROP("TYPE", UEVENT_TYPE, type),
+	PROP("STATUS", UEVENT_STATUS, status),
+	PROP("HEALTH", UEVENT_HEALTH, health),
+	PROP("PRESENT", UEVENT_BOOL, present),
+	PROP("ONLINE", UEVENT_BOOL, online),
+	PROP("CAPACITY", UEVENT_INT, capacity),
+	PROP("VOLTAGE_NOW", UEVENT_MILLI, voltage_mv),
+	PROP("CURRENT_NOW", UEVENT_MILLI, current_ma),
+	PROP("TEMP", UEVENT_INT, temp_dc),
+	PROP("CYCLE_COUNT", UEVENT_INT, cycle_count),
+	PROP("CHARGE_NOW", UEVENT_INT64, charge_now_uah),
+	PROP("CHARGE_FULL", UEVENT_INT64, charge_full_uah),
+	PROP("CHARGE_FULL_DESIGN", UEVENT_INT64, charge_full_design_uah),
+	PROP("ENERGY_NOW", UEVENT_INT64, energy_now_uwh),
+	PROP("ENERGY_FULL", UEVENT_INT64, energy_full_uwh),
+	PROP("ENERGY_FULL_DESIGN", UEVENT_INT64, energy_full_design_uwh),
+#undef PROP
+};
+
+static void __supply_uevent_prop(struct syspower_supply_snapshot *snap,
+				 const char *key, const char *value)
+{
+	unsigned int i;
+	void *field;
+
+	for (i = 0; i < ARRAY_SIZE(uevent_props); i++) {
+		if (!strcmp(key, uevent_props[i].key))
+			break;
+	}
+
+	if (i == ARRAY_SIZE(uevent_props))
+		return;
+
+	field = (char *)snap + uevent_props[i].offset;
+
+	switch (uevent_props[i].kind) {
+	case UEVENT_INT:
+		*(int *)field = atoi(value);
+		break;
+	case UEVENT_INT64:
+		*(int64_t *)field = strtoll(value, NULL, 10);
+		break;
+	case UEVENT_MILLI:
+		*(int *)field = strtoll(value, NULL, 10) / 1000;
+		break;
+	case UEVENT_BOOL:
+		*(bool *)field = atoi(value) != 0;
+		break;
+	case UEVENT_TYPE:
+		*(enum syspower_supply_type *)field = __supply_type_parse(value);
+		break;
+	case UEVENT_STATUS:
+		*(enum syspower_supply_status *)field = __supply_status_parse(value);
+		break;
+	case UEVENT_HEALTH:
+		*(enum syspower_supply_health *)field = __supply_health_parse(value);
+		break;
+	}
+}
+
+static void __supply_uevent_parse(struct syspower_supply_snapshot *snap, char *buf)
+{
+	char *line, *saveptr, *value;
+
+	for (line = strtok_r(buf, "\n", &saveptr); line;
+	     line = strtok_r(NULL, "\n", &saveptr)) {
+		if (strncmp(line, "POWER_SUPPLY_", strlen("POWER_SUPPLY_")))
+			continue;
+
+		value = strchr(line, '=');
+		if (!value)
+			continue;
+		*value++ = '\0';
+
+		__supply_uevent_prop(snap, line + strlen("POWER_SUPPLY_"), value);
+	}
+}
+
+int syspower_supply_snapshot_timeout(const char *supplyname,
+				     struct syspower_supply_snapshot *snap,
+				     int timeout_ms)
+{
+	char buf[SUPPLY_UEVENT_SIZE];
+	bool stale;
+	int ret;
+
+	if (!supplyname || !snap)
+		return -EINVAL;
+
+	ret = __supply_read(supplyname, "uevent", buf, sizeof(buf), timeout_ms,
+			    &stale);
+	if (ret < 0)
+		return ret;
+
+	memset(snap, 0, sizeof(*snap));
+	snprintf(snap->name, sizeof(snap->name), "%s", supplyname);
+	snap->capacity = -1;
+	snap->cycle_count = -1;
+	snap->stale = stale;
+	snap->timestamp_ns = __clock_ns(CLOCK_BOOTTIME);
+
+	__supply_uevent_parse(snap, buf);
+
+	return 0;
+}
+
+int syspower_supply_snapshot(const char *supplyname,
+			     struct syspower_supply_snapshot *snap)
+{
+	return syspower_supply_snapshot_timeout(supplyname, snap, -1);
+}
+
+void syspower_supply_snapshot_release(void)
+{
+	__supply_release();
+}
@@ -0,0 +1,510 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * This file is part of libsyspower.
+ *
+ * Copyright (C) 2022 Loic Poulain <loic.poulain@linaro.org>
+ */
+
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <syspower.h>
+
+#include <linux/limits.h>
+
+#include "internal.h"
+
+/*
+ * Deadline bound supply attribute reads.
+ *
+ * Fuel gauges behind I2C/SMBus can block a sysfs read for tens of
+ * milliseconds, or forever on a stuck bus. Supplies with a deadline have
+ * their reads run by a small worker pool: the caller waits at most the
+ * deadline, then gets the last known value flagged stale. An attribute never
+ * has more than one read in flight, and reads of a supply are serialized:
+ * workers skip queued attributes of a supply already being read, so a hung
+ * gauge occupies a single worker whatever the number of its attributes, and
+ * other supplies keep being served. Supplies without deadline are read
+ * synchronously, through the same held fds and latency accounting.
+ *
+ * A held fd is stale once its supply is unplugged, even if it comes back
+ * (Type-C, wireless chargers): attributes failing with ENODEV/ENOENT are
+ * reopened on their next read, once nobody reads the old fd anymore. Those
+ * failing to open are dropped, and so is their supply once it has neither
+ * attributes nor deadline left, so that unplugged or misspelled supplies do
+ * not pile up.
+ */
+
+static const char path_supply[] = "/sys/class/power_supply";
+
+#define SUPPLY_ATTR_SIZE 4096 /* sysfs attributes are page sized */
+#define SUPPLY_WORKERS 4
+
+struct supply_attr {
+	char name[32];
+	int fd;
+	bool in_flight;
+	unsigned int readers; /* synchronous reads and waiters in progress */
+	bool reopen; /* fd is stale, supply was removed */
+	bool valid;
+	int result; /* latest read length or error */
+	uint64_t seq; /* completed reads */
+	char value[SUPPLY_ATTR_SIZE];
+	struct syspower_supply_latency latency;
+	struct supply_attr *next; /* attribute list */
+	struct supply_attr *next_job; /* work queue */
+	struct supply_entry *supply;
+};
+
+struct supply_entry {
+	char name[64];
+	unsigned int deadline_ms;
+	bool busy; /* a worker is reading one of its attributes */
+	struct supply_attr *attrs;
+	struct supply_entry *next;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t done; /* CLOCK_MONOTONIC */
+	pthread_cond_t work;
+	bool started;
+	struct supply_attr *queue;
+	struct supply_attr **queue_tail;
+	struct supply_entry *supplies;
+} workers = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+};
+
+/* Called with workers.lock held */
+static struct supply_entry *__supply_entry_get(const char *supplyname)
+{
+	struct supply_entry *s;
+
+	for (s = workers.supplies; s; s = s->next) {
+		if (!strcmp(s->name, supplyname))
+			return s;
+	}
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+
+	snprintf(s->name, sizeof(s->name), "%s", supplyname);
+	s->next = workers.supplies;
+	workers.supplies = s;
+
+	return s;
+}
+
+/* Called with workers.lock held, drops the supply if nothing needs it */
+static void __supply_entry_put(struct supply_entry *s)
+{
+	struct supply_entry **p;
+
+	if (s->attrs || s->deadline_ms)
+		return;
+
+	for (p = &workers.supplies; *p != s; p = &(*p)->next)
+		;
+
+	*p = s->next;
+	free(s);
+}
+
+/* Called with workers.lock held, nobody may be reading the attribute */
+static void __supply_attr_free(struct supply_attr *a)
+{
+	struct supply_attr **p;
+
+	for (p = &a->supply->attrs; *p != a; p = &(*p)->next)
+		;
+
+	*p = a->next;
+	close(a->fd);
+	free(a);
+}
+
+/* Called with workers.lock held */
+static struct supply_attr *__supply_attr_get(const char *supplyname,
+					     const char *name, int *err)
+{
+	char path[PATH_MAX + 1];
+	struct supply_entry *s;
+	struct supply_attr *a;
+	int fd;
+
+	s = __supply_entry_get(supplyname);
+	if (!s) {
+		*err = -ENOMEM;
+		return NULL;
+	}
+
+	for (a = s->attrs; a; a = a->next) {
+		if (!strcmp(a->name, name))
+			break;
+	}
+
+	if (a && (!a->reopen || a->in_flight || a->readers))
+		return a;
+
+	snprintf(path, sizeof(path), "%s/%s", path_supply, supplyname);
+
+	if (a) {
+		fd = __open_attribute(path, name, O_RDONLY);
+		if (fd < 0) {
+			/* Still unplugged */
+			__supply_attr_free(a);
+			__supply_entry_put(s);
+			*err = fd;
+			return NULL;
+		}
+
+		close(a->fd);
+		a->fd = fd;
+		a->reopen = false;
+
+		return a;
+	}
+
+	fd = __open_attribute(path, name, O_RDONLY);
+	if (fd < 0) {
+		__supply_entry_put(s);
+		*err = fd;
+		return NULL;
+	}
+
+	a = calloc(1, sizeof(*a));
+	if (!a) {
+		close(fd);
+		__supply_entry_put(s);
+		*err = -ENOMEM;
+		return NULL;
+	}
+
+	snprintf(a->name, sizeof(a->name), "%s", name);
+	a->fd = fd;
+	a->supply = s;
+	a->next = s->attrs;
+	s->attrs = a;
+
+	return a;
+}
+
+/* Called with workers.lock held */
+static void __supply_attr_complete(struct supply_attr *a, const char *value,
+				   int ret, uint64_t elapsed_us)
+{
+	struct syspower_supply_latency *lat = &a->latency;
+
+	if (ret >= 0) {
+		memcpy(a->value, value, ret + 1);
+		a->valid = true;
+	} else if (ret == -ENODEV || ret == -ENOENT) {
+		a->reopen = true;
+	}
+
+	a->result = ret;
+	a->seq++;
+
+	lat->count++;
+	lat->last_us = elapsed_us;
+	if (elapsed_us > lat->max_us)
+		lat->max_us = elapsed_us;
+	/* EWMA, 1/8 weight */
+	lat->avg_us = lat->count == 1 ? elapsed_us :
+		      lat->avg_us - lat->avg_us / 8 + elapsed_us / 8;
+}
+
+/* Called with workers.lock held, first job of a supply not being read */
+static struct supply_attr *__supply_job_next(void)
+{
+	struct supply_attr **p, *a;
+
+	for (p = &workers.queue; (a = *p); p = &a->next_job) {
+		if (a->supply->busy)
+			continue;
+
+		*p = a->next_job;
+		if (!*p)
+			workers.queue_tail = p;
+
+		return a;
+	}
+
+	return NULL;
+}
+
+static void *__supply_worker(void *arg)
+{
+	char *value = malloc(SUPPLY_ATTR_SIZE);
+	struct supply_attr *a;
+	uint64_t start;
+	int ret;
+
+	(void)arg;
+
+	if (!value)
+		return NULL;
+
+	pthread_mutex_lock(&workers.lock);
+
+	while (1) {
+		while (!(a = __supply_job_next()))
+			pthread_cond_wait(&workers.work, &workers.lock);
+
+		a->supply->busy = true;
+
+		pthread_mutex_unlock(&workers.lock);
+
+		start = __clock_ns(CLOCK_MONOTONIC) / 1000;
+		ret = __pread_attribute(a->fd, value, SUPPLY_ATTR_SIZE);
+
+		pthread_mutex_lock(&workers.lock);
+
+		__supply_attr_complete(a, value, ret, __clock_ns(CLOCK_MONOTONIC) / 1000 - start);
+		a->in_flight = false;
+		a->supply->busy = false;
+		pthread_cond_broadcast(&workers.done);
+	}
+
+	return NULL;
+}
+
+/* Called with workers.lock held */
+static int __supply_workers_start(void)
+{
+	pthread_condattr_t attr;
+	pthread_t thread;
+	unsigned int i;
+
+	if (workers.started)
+		return 0;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&workers.done, &attr);
+	pthread_condattr_destroy(&attr);
+
+	workers.queue_tail = &workers.queue;
+
+	for (i = 0; i < SUPPLY_WORKERS; i++) {
+		if (pthread_create(&thread, NULL, __supply_worker, NULL))
+			break;
+		pthread_detach(thread);
+	}
+
+	if (!i)
+		return -EAGAIN;
+
+	workers.started = true;
+
+	return 0;
+}
+
+static int __supply_read_sync(struct supply_attr *a, char *value, size_t len)
+{
+	char page[SUPPLY_ATTR_SIZE];
+	char *buf = len >= sizeof(page) ? value : page;
+	uint64_t start;
+	int ret;
+
+	start = __clock_ns(CLOCK_MONOTONIC) / 1000;
+	ret = __pread_attribute(a->fd, buf, SUPPLY_ATTR_SIZE);
+
+	pthread_mutex_lock(&workers.lock);
+	__supply_attr_complete(a, buf, ret, __clock_ns(CLOCK_MONOTONIC) / 1000 - start);
+	a->readers--;
+	pthread_mutex_unlock(&workers.lock);
+
+	if (buf == value)
+		return ret;
+
+	/* Truncate as snprintf() would */
+	if (ret >= (int)len)
+		ret = len - 1;
+	if (ret >= 0) {
+		memcpy(value, buf, ret);
+		value[ret] = '\0';
+	}
+
+	return ret;
+}
+
+int __supply_read(const char *supplyname, const char *name, char *value,
+		  size_t len, int timeout_ms, bool *stale)
+{
+	struct supply_attr *a;
+	struct timespec ts;
+	uint64_t seq;
+	int ret = 0;
+
+	*stale = false;
+
+	pthread_mutex_lock(&workers.lock);
+
+	a = __supply_attr_get(supplyname, name, &ret);
+	if (!a)
+		goto unlock;
+
+	if (timeout_ms < 0)
+		timeout_ms = a->supply->deadline_ms;
+
+	if (!timeout_ms) {
+		a->readers++;
+		pthread_mutex_unlock(&workers.lock);
+		return __supply_read_sync(a, value, len);
+	}
+
+	ret = __supply_workers_start();
+	if (ret)
+		goto unlock;
+
+	/* Join the read in flight, if any, rather than queueing another */
+	seq = a->seq;
+	if (!a->in_flight) {
+		a->in_flight = true;
+		a->next_job = NULL;
+		*workers.queue_tail = a;
+		workers.queue_tail = &a->next_job;
+		pthread_cond_signal(&workers.work);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec += timeout_ms / 1000;
+	ts.tv_nsec += (timeout_ms % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+
+	/* Keep it from being freed or reopened while the lock is dropped */
+	a->readers++;
+	while (a->seq == seq) {
+		if (pthread_cond_timedwait(&workers.done, &workers.lock, &ts) == ETIMEDOUT)
+			break;
+	}
+	a->readers--;
+
+	if (a->seq == seq) {
+		a->latency.timeouts++;
+		if (!a->valid) {
+			ret = -ETIMEDOUT;
+			goto unlock;
+		}
+		*stale = true;
+	} else if (a->result < 0) {
+		ret = a->result;
+		goto unlock;
+	}
+
+	snprintf(value, len, "%s", a->value);
+	ret = strlen(value);
+
+unlock:
+	pthread_mutex_unlock(&workers.lock);
+
+	return ret;
+}
+
+int syspower_supply_set_deadline(const char *supplyname, unsigned int deadline_ms)
+{
+	struct supply_entry *s;
+	int ret = 0;
+
+	if (!supplyname)
+		return -EINVAL;
+
+	pthread_mutex_lock(&workers.lock);
+
+	s = __supply_entry_get(supplyname);
+	if (s) {
+		s->deadline_ms = deadline_ms;
+		__supply_entry_put(s);
+	} else {
+		ret = -ENOMEM;
+	}
+
+	pthread_mutex_unlock(&workers.lock);
+
+	return ret;
+}
+
+int syspower_supply_read_attribute(const char *supplyname, const char *attr,
+				   char *value, size_t len, int timeout_ms)
+{
+	bool stale;
+	int ret;
+
+	if (!supplyname || !attr || !value || !len)
+		return -EINVAL;
+
+	ret = __supply_read(supplyname, attr, value, len, timeout_ms, &stale);
+	if (ret < 0)
+		return ret;
+
+	return stale ? 1 : 0;
+}
+
+int syspower_supply_latency(const char *supplyname, const char *attr,
+			    struct syspower_supply_latency *latency)
+{
+	struct supply_entry *s;
+	struct supply_attr *a = NULL;
+
+	if (!supplyname || !attr || !latency)
+		return -EINVAL;
+
+	pthread_mutex_lock(&workers.lock);
+
+	for (s = workers.supplies; s && !a; s = s->next) {
+		if (strcmp(s->name, supplyname))
+			continue;
+
+		for (a = s->attrs; a; a = a->next) {
+			if (!strcmp(a->name, attr))
+				break;
+		}
+	}
+
+	if (a) {
+		*latency = a->latency;
+		latency->pending = a->in_flight;
+	}
+
+	pthread_mutex_unlock(&workers.lock);
+
+	return a ? 0 : -ENOENT;
+}
+
+void __supply_release(void)
+{
+	struct supply_entry *s, *next;
+	struct supply_attr *a, *anext;
+
+	pthread_mutex_lock(&workers.lock);
+
+	for (s = workers.supplies; s; s = next) {
+		next = s->next;
+
+		for (a = s->attrs; a; a = anext) {
+			anext = a->next;
+
+			/* A worker or a synchronous reader still owns it */
+			if (!a->in_flight && !a->readers)
+				__supply_attr_free(a);
+		}
+
+		__supply_entry_put(s);
+	}
+
+	pthread_mutex_unlock(&workers.lock);
+}
@@ -0,0 +1,288 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * This file is part of libsyspower.
+ *
+ * Copyright (C) 2022 Loic Poulain <loic.poulain@linaro.org>
+ */
+
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <syspower.h>
+
+#include <linux/limits.h>
+
+#include "internal.h"
+
+/*
+ * Thermal zones and cooling devices are discovered once, temperature and
+ * cooling state are kept open. Zones are sampled on request or on thermal
+ * uevents received by the shared monitor, and each trip point crossed since
+ * the previous sample is reported as a SYSPOWER_EVENT_THERMAL_TRIP event.
+ */
+
+static const char path_thermal[] = "/sys/class/thermal";
+
+struct thermal_zone {
+	unsigned int id;
+	int fd_temp;
+	bool sampled;
+	struct syspower_thermal_zone zone;
+};
+
+struct thermal_cdev {
+	unsigned int id;
+	int fd_cur_state;
+	struct syspower_thermal_cdev cdev;
+};
+
+static struct {
+	struct thermal_zone *zones;
+	unsigned int nr_zones;
+	struct thermal_cdev *cdevs;
+	unsigned int nr_cdevs;
+} thermal;
+
+static void __thermal_zone_trips(struct syspower_thermal_zone *zone, const char *path)
+{
+	char name[32], value[256];
+	unsigned int i;
+
+	for (i = 0; i < SYSPOWER_THERMAL_TRIPS_MAX; i++) {
+		snprintf(name, sizeof(name), "trip_point_%u_temp", i);
+		if (__read_attribute(value, path, name))
+			break;
+		zone->trip_mc[i] = strtol(value, NULL, 0);
+
+		snprintf(name, sizeof(name), "trip_point_%u_type", i);
+		if (!__read_attribute(value, path, name))
+			snprintf(zone->trip_type[i], sizeof(zone->trip_type[i]),
+				 "%.15s", value);
+	}
+
+	zone->nr_trips = i;
+}
+
+static int __thermal_new_zone(const char *base, const char *name, unsigned int id)
+{
+	char path[PATH_MAX + 1], value[256];
+	struct thermal_zone *zones, *z;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", base, name);
+
+	fd = __open_attribute(path, "temp", O_RDONLY);
+	if (fd < 0)
+		return fd;
+
+	zones = realloc(thermal.zones, (thermal.nr_zones + 1) * sizeof(*zones));
+	if (!zones) {
+		close(fd);
+		return -ENOMEM;
+	}
+	thermal.zones = zones;
+
+	z = &zones[thermal.nr_zones++];
+	memset(z, 0, sizeof(*z));
+	z->id = id;
+	z->fd_temp = fd;
+
+	snprintf(z->zone.name, sizeof(z->zone.name), "%.31s", name);
+	if (!__read_attribute(value, path, "type"))
+		snprintf(z->zone.type, sizeof(z->zone.type), "%.31s", value);
+	__thermal_zone_trips(&z->zone, path);
+
+	return 0;
+}
+
+static int __thermal_new_cdev(const char *base, const char *name, unsigned int id)
+{
+	char path[PATH_MAX + 1], value[256];
+	struct thermal_cdev *cdevs, *c;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", base, name);
+
+	fd = __open_attribute(path, "cur_state", O_RDONLY);
+	if (fd < 0)
+		return fd;
+
+	cdevs = realloc(thermal.cdevs, (thermal.nr_cdevs + 1) * sizeof(*cdevs));
+	if (!cdevs) {
+		close(fd);
+		return -ENOMEM;
+	}
+	thermal.cdevs = cdevs;
+
+	c = &cdevs[thermal.nr_cdevs++];
+	memset(c, 0, sizeof(*c));
+	c->id = id;
+	c->fd_cur_state = fd;
+
+	snprintf(c->cdev.name, sizeof(c->cdev.name), "%.31s", name);
+	if (!__read_attribute(value, path, "type"))
+		snprintf(c->cdev.type, sizeof(c->cdev.type), "%.31s", value);
+	if (!__read_attribute(value, path, "max_state"))
+		c->cdev.max_state = strtoul(value, NULL, 0);
+
+	return 0;
+}
+
+static int __cmp_zone(const void *a, const void *b)
+{
+	return (int)((const struct thermal_zone *)a)->id -
+	       (int)((const struct thermal_zone *)b)->id;
+}
+
+static int __cmp_cdev(const void *a, const void *b)
+{
+	return (int)((const struct thermal_cdev *)a)->id -
+	       (int)((const struct thermal_cdev *)b)->id;
+}
+
+void syspower_thermal_release(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < thermal.nr_zones; i++)
+		close(thermal.zones[i].fd_temp);
+
+	for (i = 0; i < thermal.nr_cdevs; i++)
+		close(thermal.cdevs[i].fd_cur_state);
+
+	free(thermal.zones);
+	free(thermal.cdevs);
+	memset(&thermal, 0, sizeof(thermal));
+}
+
+int syspower_thermal_scan(const char *path)
+{
+	struct dirent *dir;
+	unsigned int id;
+	char c;
+	DIR *d;
+
+	syspower_thermal_release();
+
+	if (!path)
+		path = path_thermal;
+
+	d = opendir(path);
+	if (!d)
+		return -errno;
+
+	while ((dir = readdir(d))) {
+		if (sscanf(dir->d_name, "thermal_zone%u%c", &id, &c) == 1)
+			__thermal_new_zone(path, dir->d_name, id);
+		else if (sscanf(dir->d_name, "cooling_device%u%c", &id, &c) == 1)
+			__thermal_new_cdev(path, dir->d_name, id);
+	}
+
+	closedir(d);
+
+	qsort(thermal.zones, thermal.nr_zones, sizeof(*thermal.zones), __cmp_zone);
+	qsort(thermal.cdevs, thermal.nr_cdevs, sizeof(*thermal.cdevs), __cmp_cdev);
+
+	return thermal.nr_zones;
+}
+
+static void __thermal_zone_sample(struct thermal_zone *z)
+{
+	struct syspower_thermal_zone *zone = &z->zone;
+	char value[32];
+	unsigned int i;
+	int temp;
+
+	/* Reading a zone whose sensor is not ready fails, keep the last value */
+	if (__pread_attribute(z->fd_temp, value, sizeof(value)) <= 0)
+		return;
+
+	temp = strtol(value, NULL, 0);
+
+	for (i = 0; z->sampled && i < zone->nr_trips; i++) {
+		int trip = zone->trip_mc[i];
+
+		if ((zone->temp_mc < trip && temp >= trip) ||
+		    (zone->temp_mc >= trip && temp < trip))
+			__event_emit(SYSPOWER_EVENT_THERMAL_TRIP, zone->name, i,
+				     temp, trip);
+	}
+
+	zone->temp_mc = temp;
+	z->sampled = true;
+}
+
+static void __thermal_cdev_sample(struct thermal_cdev *c)
+{
+	uint64_t value;
+
+	if (!__pread_u64(c->fd_cur_state, &value))
+		c->cdev.cur_state = value;
+}
+
+int syspower_thermal_sample(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < thermal.nr_zones; i++)
+		__thermal_zone_sample(&thermal.zones[i]);
+
+	for (i = 0; i < thermal.nr_cdevs; i++)
+		__thermal_cdev_sample(&thermal.cdevs[i]);
+
+	return thermal.nr_zones;
+}
+
+void __thermal_uevent(const char *sysname)
+{
+	unsigned int i;
+
+	for (i = 0; i < thermal.nr_zones; i++) {
+		if (!strcmp(thermal.zones[i].zone.name, sysname)) {
+			__thermal_zone_sample(&thermal.zones[i]);
+			return;
+		}
+	}
+
+	for (i = 0; i < thermal.nr_cdevs; i++) {
+		if (!strcmp(thermal.cdevs[i].cdev.name, sysname)) {
+			__thermal_cdev_sample(&thermal.cdevs[i]);
+			return;
+		}
+	}
+}
+
+const struct syspower_thermal_zone *syspower_thermal_zone_get(unsigned int index)
+{
+	if (index >= thermal.nr_zones)
+		return NULL;
+
+	return &thermal.zones[index].zone;
+}
+
+const struct syspower_thermal_cdev *syspower_thermal_cdev_get(unsigned int index)
+{
+	if (index >= thermal.nr_cdevs)
+		return NULL;
+
+	return &thermal.cdevs[index].cdev;
+}
+
+int syspower_thermal_get_monitorfd(void)
+{
+	return __monitor_get("thermal");
+}
+
+void syspower_thermal_put_monitorfd(int fd)
+{
+	if (fd < 0)
+		return;
+
+	__monitor_put();
+}
@@ -0,0 +1,379 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * This file is part of libsyspower.
+ *
+ * Copyright (C) 2022 Loic Poulain <loic.poulain@linaro.org>
+ */
+
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <syspower.h>
+
+#include "internal.h"
+
+/*
+ * Timeline export of library events, in Chrome JSON trace format (loadable
+ * in Perfetto UI and chrome://tracing), one track per event type:
+ * - suspend as slices, from entry to exit
+ * - wake locks as async slices, one per lock name
+ * - wakeup reasons, alarms and anomalies as instant events
+ * - supply values and thermal zone temperatures as counters
+ *
+ * Events are formatted into a memory buffer, which is written out when full
+ * or on flush, so that tracing costs one write() per few hundred events.
+ */
+
+#define TRACE_BUFFER_SIZE 65536
+#define TRACE_EVENT_MAX 512 /* formatted event max length */
+#define TRACE_PID 1
+#define TRACE_WAKELOCKS 256 /* power of two */
+
+enum trace_track {
+	TRACE_TRACK_SUSPEND = 1,
+	TRACE_TRACK_WAKEUP,
+	TRACE_TRACK_WAKELOCK,
+	TRACE_TRACK_ALARM,
+	TRACE_TRACK_SUPPLY,
+	TRACE_TRACK_THERMAL,
+	TRACE_TRACK_ANOMALY,
+	TRACE_TRACK_MAX
+};
+
+static const char * const tracks[] = {
+	[TRACE_TRACK_SUSPEND] = "suspend",
+	[TRACE_TRACK_WAKEUP] = "wakeup",
+	[TRACE_TRACK_WAKELOCK] = "wakelock",
+	[TRACE_TRACK_ALARM] = "alarm",
+	[TRACE_TRACK_SUPPLY] = "supply",
+	[TRACE_TRACK_THERMAL] = "thermal",
+	[TRACE_TRACK_ANOMALY] = "anomaly",
+};
+
+static const char * const sleep_types[] = {
+	[SYSPOWER_SLEEP_TYPE_FREEZE] = "freeze",
+	[SYSPOWER_SLEEP_TYPE_STANDBY] = "standby",
+	[SYSPOWER_SLEEP_TYPE_MEM] = "mem",
+	[SYSPOWER_SLEEP_TYPE_HIBERNATE] = "hibernate",
+};
+
+static struct {
+	pthread_mutex_t lock;
+	int fd;
+	bool first;
+	int error; /* first write error, reported on flush/stop */
+	size_t len;
+	struct {
+		uint32_t id;
+		uint64_t seq; /* latest transition traced, 0 if free */
+	} wakelocks[TRACE_WAKELOCKS];
+	char buf[TRACE_BUFFER_SIZE];
+} trace = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.fd = -1,
+};
+
+/* Called with trace.lock held */
+static int __trace_write(void)
+{
+	size_t off = 0;
+	ssize_t ret;
+
+	while (off < trace.len) {
+		ret = write(trace.fd, trace.buf + off, trace.len - off);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			if (!trace.error)
+				trace.error = ret < 0 ? -errno : -EIO;
+			break;
+		}
+		off += ret;
+	}
+
+	trace.len = 0;
+
+	return trace.error;
+}
+
+/* Called with trace.lock held, appends one event, comma separated */
+static void __trace_append(const char *fmt, ...)
+{
+	va_list ap;
+	int len;
+
+	if (trace.len + 1 + TRACE_EVENT_MAX > sizeof(trace.buf)) /* comma + event */
+		__trace_write();
+
+	if (!trace.first)
+		trace.buf[trace.len++] = ',';
+	trace.first = false;
+
+	va_start(ap, fmt);
+	len = vsnprintf(trace.buf + trace.len, TRACE_EVENT_MAX, fmt, ap);
+	va_end(ap);
+
+	if (len >= TRACE_EVENT_MAX)
+		len = TRACE_EVENT_MAX - 1; /* truncated, should not happen */
+
+	trace.len += len;
+}
+
+/* JSON string escaping, out of the lock */
+static const char *__trace_escape(char *dst, size_t size, const char *src)
+{
+	static const char hex[] = "0123456789abcdef";
+	size_t i = 0;
+
+	for (; src && *src && i + 7 < size; src++) {
+		unsigned char c = *src;
+
+		if (c == '"' || c == '\\') {
+			dst[i++] = '\\';
+			dst[i++] = c;
+		} else if (c < 0x20) {
+			memcpy(&dst[i], "\\u00", 4);
+			dst[i + 4] = hex[c >> 4];
+			dst[i + 5] = hex[c & 0xf];
+			i += 6;
+		} else {
+			dst[i++] = c;
+		}
+	}
+
+	dst[i] = '\0';
+
+	return dst;
+}
+
+/* FNV-1a, async slice id from the lock name */
+static uint32_t __trace_id(const char *name)
+{
+	uint32_t h = 2166136261u;
+
+	while (name && *name) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+/*
+ * Called with trace.lock held. Wake lock events are emitted out of the lock
+ * ordering their transitions, drop those older than the latest traced, so
+ * that a release never ends a slice that a late hold would then leave open.
+ */
+static bool __trace_wakelock_latest(uint32_t id, uint64_t seq)
+{
+	unsigned int i;
+
+	for (i = 0; i < TRACE_WAKELOCKS; i++) {
+		unsigned int slot = (id + i) & (TRACE_WAKELOCKS - 1);
+
+		if (trace.wakelocks[slot].seq && trace.wakelocks[slot].id != id)
+			continue;
+
+		if (seq <= trace.wakelocks[slot].seq)
+			return false;
+
+		trace.wakelocks[slot].id = id;
+		trace.wakelocks[slot].seq = seq;
+		break;
+	}
+
+	return true;
+}
+
+static void __trace_event(const struct syspower_event *ev, void *data)
+{
+	struct syspower_supply_snapshot snap;
+	uint64_t ts_us = ev->timestamp_ns / 1000;
+	unsigned int frac = ev->timestamp_ns % 1000;
+	char name[160];
+	bool valid = false;
+
+	(void)data;
+
+	__trace_escape(name, sizeof(name), ev->name);
+
+	/* Sample the supply before locking, reading it may take a while */
+	if (ev->type == SYSPOWER_EVENT_SUPPLY)
+		valid = !syspower_supply_snapshot(ev->name, &snap) && !snap.stale;
+
+	pthread_mutex_lock(&trace.lock);
+
+	if (trace.fd < 0)
+		goto unlock;
+
+	switch (ev->type) {
+	case SYSPOWER_EVENT_SUSPEND:
+		__trace_append("\n{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%" PRIu64 ".%03u,"
+			       "\"pid\":%d,\"tid\":%d}",
+			       (unsigned int)ev->index < ARRAY_SIZE(sleep_types) ?
+			       sleep_types[ev->index] : "suspend",
+			       ev->value ? "B" : "E", ts_us, frac, TRACE_PID,
+			       TRACE_TRACK_SUSPEND);
+		break;
+	case SYSPOWER_EVENT_WAKELOCK:
+		if (!__trace_wakelock_latest(__trace_id(ev->name), ev->threshold))
+			break;
+		__trace_append("\n{\"name\":\"%s\",\"cat\":\"wakelock\",\"ph\":\"%s\","
+			       "\"id\":\"0x%08x\",\"ts\":%" PRIu64 ".%03u,\"pid\":%d,\"tid\":%d}",
+			       name, ev->value ? "b" : "e", __trace_id(ev->name),
+			       ts_us, frac, TRACE_PID, TRACE_TRACK_WAKELOCK);
+		break;
+	case SYSPOWER_EVENT_WAKEUP:
+		__trace_append("\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%" PRIu64 ".%03u,"
+			       "\"pid\":%d,\"tid\":%d,\"args\":{\"irq\":%" PRId64 "}}",
+			       name, ts_us, frac, TRACE_PID, TRACE_TRACK_WAKEUP, ev->value);
+		break;
+	case SYSPOWER_EVENT_ALARM:
+		__trace_append("\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%" PRIu64 ".%03u,"
+			       "\"pid\":%d,\"tid\":%d}",
+			       name, ts_us, frac, TRACE_PID, TRACE_TRACK_ALARM);
+		break;
+	case SYSPOWER_EVENT_ANOMALY:
+		__trace_append("\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%" PRIu64 ".%03u,"
+			       "\"pid\":%d,\"tid\":%d,\"args\":{\"state\":%d,\"value\":%" PRId64
+			       ",\"threshold\":%" PRId64 "}}",
+			       name, ts_us, frac, TRACE_PID, TRACE_TRACK_ANOMALY,
+			       ev->index, ev->value, ev->threshold);
+		break;
+	case SYSPOWER_EVENT_THERMAL_TRIP:
+		__trace_append("\n{\"name\":\"%s trip %d\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%" PRIu64
+			       ".%03u,\"pid\":%d,\"tid\":%d,\"args\":{\"temp_mc\":%" PRId64
+			       ",\"trip_mc\":%" PRId64 "}}",
+			       name, ev->index, ts_us, frac, TRACE_PID, TRACE_TRACK_THERMAL,
+			       ev->value, ev->threshold);
+		__trace_append("\n{\"name\":\"%s temp_mc\",\"ph\":\"C\",\"ts\":%" PRIu64 ".%03u,"
+			       "\"pid\":%d,\"tid\":%d,\"args\":{\"value\":%" PRId64 "}}",
+			       name, ts_us, frac, TRACE_PID, TRACE_TRACK_THERMAL, ev->value);
+		break;
+	case SYSPOWER_EVENT_SUPPLY:
+		__trace_append("\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%" PRIu64 ".%03u,"
+			       "\"pid\":%d,\"tid\":%d}",
+			       name, ts_us, frac, TRACE_PID, TRACE_TRACK_SUPPLY);
+		if (!valid)
+			break;
+		__trace_append("\n{\"name\":\"%s\",\"ph\":\"C\",\"ts\":%" PRIu64 ".%03u,"
+			       "\"pid\":%d,\"tid\":%d,\"args\":{\"online\":%d,\"capacity\":%d,"
+			       "\"voltage_mv\":%d,\"current_ma\":%d,\"temp_dc\":%d}}",
+			       name, ts_us, frac, TRACE_PID, TRACE_TRACK_SUPPLY,
+			       snap.online, snap.capacity, snap.voltage_mv,
+			       snap.current_ma, snap.temp_dc);
+		break;
+	default:
+		break;
+	}
+
+unlock:
+	pthread_mutex_unlock(&trace.lock);
+}
+
+int syspower_trace_start(const char *path)
+{
+	unsigned int i;
+	int fd, ret;
+
+	if (!path)
+		return -EINVAL;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -errno;
+
+	pthread_mutex_lock(&trace.lock);
+
+	if (trace.fd >= 0) {
+		pthread_mutex_unlock(&trace.lock);
+		close(fd);
+		return -EBUSY;
+	}
+
+	trace.fd = fd;
+	trace.error = 0;
+	memset(trace.wakelocks, 0, sizeof(trace.wakelocks));
+	trace.len = snprintf(trace.buf, sizeof(trace.buf),
+			     "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	trace.first = true;
+
+	/* Track names */
+	__trace_append("\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+		       "\"args\":{\"name\":\"syspower\"}}", TRACE_PID);
+	for (i = 1; i < TRACE_TRACK_MAX; i++)
+		__trace_append("\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,"
+			       "\"args\":{\"name\":\"%s\"}}", TRACE_PID, i, tracks[i]);
+
+	pthread_mutex_unlock(&trace.lock);
+
+	ret = syspower_event_register(SYSPOWER_EVENT_MASK_ALL, __trace_event, NULL);
+	if (ret) {
+		pthread_mutex_lock(&trace.lock);
+		trace.fd = -1;
+		trace.len = 0;
+		pthread_mutex_unlock(&trace.lock);
+		close(fd);
+		unlink(path);
+	}
+
+	return ret;
+}
+
+int syspower_trace_flush(void)
+{
+	int ret;
+
+	pthread_mutex_lock(&trace.lock);
+
+	if (trace.fd < 0) {
+		ret = -ENOENT;
+	} else {
+		ret = __trace_write();
+	}
+
+	pthread_mutex_unlock(&trace.lock);
+
+	return ret;
+}
+
+int syspower_trace_stop(void)
+{
+	int ret;
+
+	/*
+	 * Waits for the callbacks in progress on other threads, except when
+	 * stopped from an event callback: late ones find the trace closed.
+	 */
+	syspower_event_unregister(__trace_event, NULL);
+
+	pthread_mutex_lock(&trace.lock);
+
+	if (trace.fd < 0) {
+		pthread_mutex_unlock(&trace.lock);
+		return -ENOENT;
+	}
+
+	if (trace.len + 8 > sizeof(trace.buf))
+		__trace_write();
+
+	trace.len += snprintf(trace.buf + trace.len, sizeof(trace.buf) - trace.len,
+			      "\n]}\n");
+	ret = __trace_write();
+
+	if (close(trace.fd) && !ret)
+		ret = -errno;
+	trace.fd = -1;
+
+	pthread_mutex_unlock(&trace.lock);
+
+	return ret;
+}
@@ -0,0 +1,386 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * This file is part of libsyspower.
+ *
+ * Copyright (C) 2022 Loic Poulain <loic.poulain@linaro.org>
+ */
+
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <syspower.h>
+
+#include "internal.h"
+
+static const char path_wake_unlock[] = "/sys/power/wake_unlock";
+static const char path_wake_lock[] = "/sys/power/wake_lock";
+
+/* "<name> <timeout_ns>\n" */
+#define WAKELOCK_TIMEOUT_LEN 22
+
+static struct {
+	int fd_lock;
+	int fd_unlock;
+	int fd_lock_list;
+	int fd_unlock_list;
+} wakelock;
+
+/*
+ * In-process wake lock handle. Acquisitions are refcounted with atomics so
+ * that only the 0->1 and 1->0 transitions reach sysfs. Transitions are
+ * serialized with a mutex and always re-evaluate the refcount, so that the
+ * kernel state converges to the last one whatever the interleaving. Further
+ * acquisitions only skip sysfs once the kernel hold is confirmed.
+ */
+struct syspower_wakelock {
+	unsigned int refcount;
+	pthread_mutex_t lock;
+	bool held; /* kernel state, written under lock */
+	uint64_t deadline_ns; /* pending timed acquisition (CLOCK_BOOTTIME) */
+	struct wakelock_stat *stat;
+	size_t namelen;
+	char buf[]; /* "<name>\n" + room for the timeout */
+};
+
+int syspower_wake_lock(const char *name, unsigned int timeout_ms)
+{
+	struct wakelock_stat *st;
+	char buf[128];
+	size_t len;
+	int ret;
+
+	if ((ret = __open_once(&wakelock.fd_lock, path_wake_lock, O_WRONLY)))
+		return ret;
+
+	if (timeout_ms)
+		ret = snprintf(buf, sizeof(buf), "%s %"PRIu64"\n", name,
+			       (uint64_t)timeout_ms * 1000 * 1000);
+	else
+		ret = snprintf(buf, sizeof(buf), "%s\n", name);
+
+	if (ret < 0 || ret >= (int)sizeof(buf))
+		return -ENAMETOOLONG;
+
+	len = strlen(buf) + 1;
+
+	ret = WRITE_RETRY(wakelock.fd_lock, buf, len);
+	if (ret != (int)len)
+		return -errno;
+
+	st = __wakelock_stat_intern(name);
+	__wakelock_stat_acquire(st);
+	if (!timeout_ms) /* timed locks expire silently, only count them */
+		__wakelock_stat_set(st, true);
+
+	return 0;
+}
+
+int syspower_wake_unlock(const char *name)
+{
+	size_t len = strlen(name) + 1;
+	int ret;
+
+	if ((ret = __open_once(&wakelock.fd_unlock, path_wake_unlock, O_RDWR)))
+		return -errno;
+
+	ret = WRITE_RETRY(wakelock.fd_unlock, name, len);
+	if (ret != (int)len)
+		return -errno;
+
+	__wakelock_stat_set(__wakelock_stat_find(name), false);
+
+	return 0;
+}
+
+struct syspower_wakelock *syspower_wakelock_create(const char *name)
+{
+	struct syspower_wakelock *wl;
+	size_t namelen;
+
+	if (!name || !*name || strpbrk(name, " \t\n")) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (__open_once(&wakelock.fd_lock, path_wake_lock, O_WRONLY) ||
+	    __open_once(&wakelock.fd_unlock, path_wake_unlock, O_RDWR))
+		return NULL;
+
+	namelen = strlen(name);
+
+	wl = calloc(1, sizeof(*wl) + namelen + WAKELOCK_TIMEOUT_LEN + 1);
+	if (!wl)
+		return NULL;
+
+	pthread_mutex_init(&wl->lock, NULL);
+	wl->namelen = namelen;
+	memcpy(wl->buf, name, namelen);
+	wl->stat = __wakelock_stat_intern(name);
+
+	return wl;
+}
+
+void syspower_wakelock_destroy(struct syspower_wakelock *wl)
+{
+	if (!wl)
+		return;
+
+	if (__atomic_load_n(&wl->refcount, __ATOMIC_ACQUIRE))
+		__wakelock_stat_unhold(wl->stat);
+
+	pthread_mutex_lock(&wl->lock);
+	if (wl->held)
+		WRITE_RETRY(wakelock.fd_unlock, wl->buf, wl->namelen);
+	pthread_mutex_unlock(&wl->lock);
+
+	pthread_mutex_destroy(&wl->lock);
+	free(wl);
+}
+
+const char *syspower_wakelock_name(struct syspower_wakelock *wl)
+{
+	return wl ? wl->buf : NULL;
+}
+
+/* Called with wl->lock held */
+static int __wakelock_write(struct syspower_wakelock *wl, uint64_t timeout_ns)
+{
+	size_t len = wl->namelen;
+	int ret;
+
+	if (timeout_ns)
+		len += snprintf(wl->buf + len, WAKELOCK_TIMEOUT_LEN + 1,
+				" %"PRIu64"\n", timeout_ns);
+	else
+		wl->buf[len++] = '\n';
+
+	ret = WRITE_RETRY(wakelock.fd_lock, wl->buf, len);
+	wl->buf[wl->namelen] = '\0';
+	if (ret != (int)len)
+		return -errno;
+
+	return 0;
+}
+
+/* Bring the kernel lock in line with the current refcount */
+static int __wakelock_sync(struct syspower_wakelock *wl)
+{
+	uint64_t now;
+	int ret = 0;
+
+	pthread_mutex_lock(&wl->lock);
+
+	if (__atomic_load_n(&wl->refcount, __ATOMIC_ACQUIRE)) {
+		if (!wl->held) {
+			ret = __wakelock_write(wl, 0);
+			__atomic_store_n(&wl->held, !ret, __ATOMIC_RELEASE);
+		}
+		goto unlock;
+	}
+
+	if (!wl->held)
+		goto unlock;
+
+	now = __clock_ns(CLOCK_BOOTTIME);
+	if (wl->deadline_ns > now) {
+		/* A timed acquisition is still pending, re-arm the remainder */
+		ret = __wakelock_write(wl, wl->deadline_ns - now);
+	} else {
+		ret = WRITE_RETRY(wakelock.fd_unlock, wl->buf, wl->namelen);
+		ret = ret == (int)wl->namelen ? 0 : -errno;
+	}
+
+	wl->deadline_ns = 0;
+	__atomic_store_n(&wl->held, false, __ATOMIC_RELEASE);
+
+unlock:
+	pthread_mutex_unlock(&wl->lock);
+
+	return ret;
+}
+
+int syspower_wakelock_acquire(struct syspower_wakelock *wl)
+{
+	int ret;
+
+	if (!wl)
+		return -EINVAL;
+
+	__wakelock_stat_acquire(wl->stat);
+
+	if (!__atomic_fetch_add(&wl->refcount, 1, __ATOMIC_ACQ_REL))
+		__wakelock_stat_hold(wl->stat);
+	else if (__atomic_load_n(&wl->held, __ATOMIC_ACQUIRE))
+		return 0;
+
+	/* First holder, or the first one's write is not confirmed yet */
+	ret = __wakelock_sync(wl);
+	if (ret)
+		syspower_wakelock_release(wl);
+
+	return ret;
+}
+
+int syspower_wakelock_release(struct syspower_wakelock *wl)
+{
+	unsigned int refcount;
+
+	if (!wl)
+		return -EINVAL;
+
+	refcount = __atomic_load_n(&wl->refcount, __ATOMIC_ACQUIRE);
+	do {
+		if (!refcount)
+			return -EPERM;
+	} while (!__atomic_compare_exchange_n(&wl->refcount, &refcount,
+					      refcount - 1, false,
+					      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+	if (refcount > 1)
+		return 0;
+
+	__wakelock_stat_unhold(wl->stat);
+
+	return __wakelock_sync(wl);
+}
+
+int syspower_wakelock_acquire_timeout(struct syspower_wakelock *wl,
+				      unsigned int timeout_ms)
+{
+	uint64_t timeout_ns = (uint64_t)timeout_ms * 1000 * 1000;
+	uint64_t now;
+	int ret = 0;
+
+	if (!wl || !timeout_ms)
+		return -EINVAL;
+
+	__wakelock_stat_acquire(wl->stat);
+
+	pthread_mutex_lock(&wl->lock);
+
+	now = __clock_ns(CLOCK_BOOTTIME);
+	if (now + timeout_ns > wl->deadline_ns)
+		wl->deadline_ns = now + timeout_ns;
+
+	/* Refcounted holders keep the lock, the deadline applies on release */
+	if (!__atomic_load_n(&wl->refcount, __ATOMIC_ACQUIRE)) {
+		ret = __wakelock_write(wl, wl->deadline_ns - now);
+		/* expires on its own */
+		__atomic_store_n(&wl->held, false, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_unlock(&wl->lock);
+
+	return ret;
+}
+
+static int __cmp_name(const void *a, const void *b)
+{
+	return strcmp(*(const char * const *)a, *(const char * const *)b);
+}
+
+/* Read a space separated lock list in place, names are sorted */
+static int __wake_lock_list_read(int *fd, const char *path,
+				 struct syspower_wake_lock_list *list)
+{
+	char *p, *end;
+	int ret;
+
+	if ((ret = __open_once(fd, path, O_RDONLY)))
+		return -errno;
+
+	do {
+		ret = pread(*fd, list->buf, sizeof(list->buf) - 1, 0);
+	} while (ret == -1 && errno == EINTR);
+
+	if (ret < 0)
+		return -errno;
+
+	list->buf[ret] = '\0';
+	list->count = 0;
+
+	for (p = list->buf, end = list->buf + ret; p < end; p++) {
+		if (*p == ' ' || *p == '\n') {
+			*p = '\0';
+			continue;
+		}
+
+		if (list->count == SYSPOWER_WAKE_LOCK_LIST_MAX)
+			return -ENOBUFS;
+
+		list->names[list->count++] = p;
+		p += strcspn(p, " \n") - 1;
+	}
+
+	qsort(list->names, list->count, sizeof(*list->names), __cmp_name);
+
+	return list->count;
+}
+
+int syspower_wake_lock_list(struct syspower_wake_lock_list *list)
+{
+	if (!list)
+		return -EINVAL;
+
+	return __wake_lock_list_read(&wakelock.fd_lock_list, path_wake_lock, list);
+}
+
+int syspower_wake_unlock_list(struct syspower_wake_lock_list *list)
+{
+	if (!list)
+		return -EINVAL;
+
+	return __wake_lock_list_read(&wakelock.fd_unlock_list, path_wake_unlock, list);
+}
+
+int syspower_wake_lock_diff(struct syspower_wake_lock_diff *diff)
+{
+	struct syspower_wake_lock_list *prev, *cur;
+	unsigned int i = 0, j = 0;
+	int ret;
+
+	if (!diff)
+		return -EINVAL;
+
+	prev = &diff->list[diff->cur];
+	cur = &diff->list[!diff->cur];
+
+	ret = syspower_wake_lock_list(cur);
+	if (ret < 0)
+		return ret;
+
+	diff->cur = !diff->cur;
+	diff->acquired_count = 0;
+	diff->released_count = 0;
+
+	/* Merge walk of both sorted lists */
+	while (i < prev->count || j < cur->count) {
+		int cmp;
+
+		if (i == prev->count)
+			cmp = 1;
+		else if (j == cur->count)
+			cmp = -1;
+		else
+			cmp = strcmp(prev->names[i], cur->names[j]);
+
+		if (cmp < 0) {
+			diff->released[diff->released_count++] = prev->names[i++];
+		} else if (cmp > 0) {
+			diff->acquired[diff->acquired_count++] = cur->names[j++];
+		} else {
+			i++;
+			j++;
+		}
+	}
+
+	return diff->acquired_count + diff->released_count;
+}
@@ -0,0 +1,287 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * This file is part of libsyspower.
+ *
+ * Copyright (C) 2022 Loic Poulain <loic.poulain@linaro.org>
+ */
+
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <syspower.h>
+
+#include "internal.h"
+
+/*
+ * Per lock name statistics.
+ *
+ * Entries live in a fixed size open-addressing table. A slot is claimed by
+ * installing its interned name with a compare-and-swap, and entries are never
+ * removed, so lookups and updates are lock-free and the returned pointers
+ * stay valid for the process lifetime. Handles intern their entry once at
+ * creation, keeping the hot path to a few atomic operations.
+ *
+ * Only the first hold and the last release of a name take its entry lock,
+ * to account and number the transition: refcount changes that do not cross
+ * zero stay lock-free. Held/released events are emitted once the lock is
+ * dropped, so that listeners may use wake locks of the same name, and carry
+ * the transition number for listeners to drop those delivered late.
+ */
+
+#define WAKELOCK_STATS_SIZE 256 /* power of two */
+
+struct wakelock_stat {
+	const char *name;
+	pthread_mutex_t lock; /* active 0 <-> 1 transitions */
+	unsigned int active; /* holders, the raw sysfs hold counting as one */
+	unsigned int raw; /* raw sysfs hold */
+	uint64_t seq; /* transitions */
+	uint64_t since_ns;
+	uint64_t acquire_count;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint64_t hist[SYSPOWER_WAKELOCK_HIST_BUCKETS];
+};
+
+static struct wakelock_stat wakelock_stats[WAKELOCK_STATS_SIZE] = {
+	[0 ... WAKELOCK_STATS_SIZE - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER },
+};
+
+static uint32_t __hash(const char *name)
+{
+	uint32_t hash = 2166136261u; /* FNV-1a */
+
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static struct wakelock_stat *__wakelock_stat_lookup(const char *name, bool create)
+{
+	uint32_t hash = __hash(name);
+	char *interned = NULL;
+	unsigned int i;
+
+	for (i = 0; i < WAKELOCK_STATS_SIZE; i++) {
+		struct wakelock_stat *st;
+		const char *cur;
+
+		st = &wakelock_stats[(hash + i) & (WAKELOCK_STATS_SIZE - 1)];
+		cur = __atomic_load_n(&st->name, __ATOMIC_ACQUIRE);
+
+		if (!cur) {
+			if (!create)
+				break;
+
+			if (!interned && !(interned = strdup(name)))
+				return NULL;
+
+			if (__atomic_compare_exchange_n(&st->name, &cur, interned,
+							false, __ATOMIC_ACQ_REL,
+							__ATOMIC_ACQUIRE))
+				return st;
+			/* lost the race, cur is now the winner name */
+		}
+
+		if (!strcmp(cur, name)) {
+			free(interned);
+			return st;
+		}
+	}
+
+	free(interned);
+
+	return NULL;
+}
+
+struct wakelock_stat *__wakelock_stat_intern(const char *name)
+{
+	return __wakelock_stat_lookup(name, true);
+}
+
+struct wakelock_stat *__wakelock_stat_find(const char *name)
+{
+	return __wakelock_stat_lookup(name, false);
+}
+
+void __wakelock_stat_acquire(struct wakelock_stat *st)
+{
+	if (st)
+		__atomic_add_fetch(&st->acquire_count, 1, __ATOMIC_RELAXED);
+}
+
+/* Called with st->lock held, return the transition number */
+static uint64_t __wakelock_stat_begin(struct wakelock_stat *st)
+{
+	__atomic_store_n(&st->since_ns, __clock_ns(CLOCK_BOOTTIME), __ATOMIC_RELEASE);
+
+	return ++st->seq;
+}
+
+/* Called with st->lock held, return the transition number */
+static uint64_t __wakelock_stat_end(struct wakelock_stat *st)
+{
+	uint64_t since = __atomic_load_n(&st->since_ns, __ATOMIC_ACQUIRE);
+	uint64_t now = __clock_ns(CLOCK_BOOTTIME);
+	uint64_t held = now > since ? now - since : 0;
+	uint64_t max = __atomic_load_n(&st->max_ns, __ATOMIC_RELAXED);
+	unsigned int bucket = 0;
+	uint64_t ms;
+
+	__atomic_add_fetch(&st->total_ns, held, __ATOMIC_RELAXED);
+
+	while (held > max &&
+	       !__atomic_compare_exchange_n(&st->max_ns, &max, held, true,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	/* bucket n counts holds shorter than 2^n ms */
+	for (ms = held / 1000000; ms && bucket < SYSPOWER_WAKELOCK_HIST_BUCKETS - 1; ms >>= 1)
+		bucket++;
+
+	__atomic_add_fetch(&st->hist[bucket], 1, __ATOMIC_RELAXED);
+
+	return ++st->seq;
+}
+
+/* Refcounted hold, for in-process handles and broker clients */
+void __wakelock_stat_hold(struct wakelock_stat *st)
+{
+	unsigned int active;
+	uint64_t seq = 0;
+
+	if (!st)
+		return;
+
+	/* Already held, not a transition */
+	active = __atomic_load_n(&st->active, __ATOMIC_ACQUIRE);
+	while (active) {
+		if (__atomic_compare_exchange_n(&st->active, &active, active + 1, true,
+						__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			return;
+	}
+
+	pthread_mutex_lock(&st->lock);
+	if (!__atomic_fetch_add(&st->active, 1, __ATOMIC_ACQ_REL))
+		seq = __wakelock_stat_begin(st);
+	pthread_mutex_unlock(&st->lock);
+
+	if (seq)
+		__event_emit(SYSPOWER_EVENT_WAKELOCK, st->name, 0, 1, seq);
+}
+
+void __wakelock_stat_unhold(struct wakelock_stat *st)
+{
+	unsigned int active;
+	uint64_t seq = 0;
+
+	if (!st)
+		return;
+
+	/* Other holders remain, not a transition */
+	active = __atomic_load_n(&st->active, __ATOMIC_ACQUIRE);
+	while (active > 1) {
+		if (__atomic_compare_exchange_n(&st->active, &active, active - 1, true,
+						__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			return;
+	}
+
+	pthread_mutex_lock(&st->lock);
+	if (__atomic_fetch_sub(&st->active, 1, __ATOMIC_ACQ_REL) == 1)
+		seq = __wakelock_stat_end(st);
+	pthread_mutex_unlock(&st->lock);
+
+	if (seq)
+		__event_emit(SYSPOWER_EVENT_WAKELOCK, st->name, 0, 0, seq);
+}
+
+/*
+ * Non-refcounted hold, mirroring the raw sysfs wake_lock semantic. It is
+ * tracked apart and accounts for one holder, so that it does not clobber the
+ * handle refcount of the same name.
+ */
+void __wakelock_stat_set(struct wakelock_stat *st, bool held)
+{
+	if (!st)
+		return;
+
+	if (__atomic_exchange_n(&st->raw, held, __ATOMIC_ACQ_REL) == held)
+		return;
+
+	if (held)
+		__wakelock_stat_hold(st);
+	else
+		__wakelock_stat_unhold(st);
+}
+
+static void __wakelock_stat_read(struct wakelock_stat *st,
+				 struct syspower_wakelock_stats *stats)
+{
+	unsigned int i;
+	uint64_t cur = 0;
+
+	if (__atomic_load_n(&st->active, __ATOMIC_ACQUIRE)) {
+		uint64_t since = __atomic_load_n(&st->since_ns, __ATOMIC_ACQUIRE);
+		uint64_t now = __clock_ns(CLOCK_BOOTTIME);
+
+		cur = now > since ? now - since : 0;
+	}
+
+	stats->name = st->name;
+	stats->acquire_count = __atomic_load_n(&st->acquire_count, __ATOMIC_RELAXED);
+	stats->current_hold_ms = cur / 1000000;
+	stats->total_hold_ms = (__atomic_load_n(&st->total_ns, __ATOMIC_RELAXED) + cur) / 1000000;
+	stats->max_hold_ms = __atomic_load_n(&st->max_ns, __ATOMIC_RELAXED);
+	if (cur > stats->max_hold_ms)
+		stats->max_hold_ms = cur;
+	stats->max_hold_ms /= 1000000;
+
+	for (i = 0; i < SYSPOWER_WAKELOCK_HIST_BUCKETS; i++)
+		stats->hist[i] = __atomic_load_n(&st->hist[i], __ATOMIC_RELAXED);
+}
+
+int syspower_wakelock_stats_get(unsigned int index,
+				struct syspower_wakelock_stats *stats)
+{
+	unsigned int i;
+
+	if (!stats)
+		return -EINVAL;
+
+	for (i = 0; i < WAKELOCK_STATS_SIZE; i++) {
+		struct wakelock_stat *st = &wakelock_stats[i];
+
+		if (!__atomic_load_n(&st->name, __ATOMIC_ACQUIRE))
+			continue;
+
+		if (!index--) {
+			__wakelock_stat_read(st, stats);
+			return 0;
+		}
+	}
+
+	return -ENOENT;
+}
+
+int syspower_wakelock_stats_lookup(const char *name,
+				   struct syspower_wakelock_stats *stats)
+{
+	struct wakelock_stat *st;
+
+	if (!name || !stats)
+		return -EINVAL;
+
+	st = __wakelock_stat_lookup(name, false);
+	if (!st)
+		return -ENOENT;
+
+	__wakelock_stat_read(st, stats);
+
+	return 0;
+}
@@ -0,0 +1,135 @@
+#include <syspower.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/wait.h>
+
+void usage(void)
+{
+	printf("Usage: syspowerenergy [-r repeat] [-v] -- <cmd> [args]\n"
+	"  -r <count>  - Run the command count times, report mean and deviation\n"
+	"  -v          - Report each run\n");
+
+	exit(1);
+}
+
+struct stat_acc {
+	unsigned int n;
+	double mean;
+	double m2;
+};
+
+/* Welford's online mean and variance */
+static void stat_add(struct stat_acc *acc, double v)
+{
+	double delta = v - acc->mean;
+
+	acc->n++;
+	acc->mean += delta / acc->n;
+	acc->m2 += delta * (v - acc->mean);
+}
+
+static double stat_stddev(const struct stat_acc *acc)
+{
+	double var = acc->n > 1 ? acc->m2 / (acc->n - 1) : 0, x = var;
+	unsigned int i;
+
+	/* Newton iterations, avoid libm for a single square root */
+	for (i = 0; x > 0 && i < 32; i++)
+		x = (x + var / x) / 2;
+
+	return x;
+}
+
+static void stat_print(const char *name, const char *unit,
+		       const struct stat_acc *acc)
+{
+	printf("%16.6f %-2s ", acc->mean, unit);
+	if (acc->n > 1 && acc->mean)
+		printf("%-10s ( +- %.2f%% )\n", name, stat_stddev(acc) * 100 / acc->mean);
+	else
+		printf("%s\n", name);
+}
+
+static int run(char *argv[], struct syspower_energy_result *result, int *status)
+{
+	struct syspower_energy_scope scope;
+	pid_t pid;
+	int ret;
+
+	ret = syspower_energy_scope_begin(&scope);
+	if (ret)
+		return ret;
+
+	pid = fork();
+	if (pid < 0)
+		return -errno;
+
+	if (!pid) {
+		execvp(argv[0], argv);
+		perror("exec");
+		_exit(127);
+	}
+
+	waitpid(pid, status, 0);
+
+	return syspower_energy_scope_end(&scope, result);
+}
+
+int main(int argc, char *argv[])
+{
+	struct stat_acc joules = { 0 }, watts = { 0 }, seconds = { 0 };
+	struct syspower_energy_result result;
+	unsigned int repeat = 1, i;
+	bool verbose = false;
+	int opt, ret, status = 0;
+
+	while ((opt = getopt(argc, argv, "+r:v")) != -1) {
+		switch (opt) {
+		case 'r':
+			repeat = atoi(optarg);
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind >= argc || !repeat)
+		usage();
+
+	for (i = 0; i < repeat; i++) {
+		ret = run(&argv[optind], &result, &status);
+		if (ret) {
+			fprintf(stderr, "error: %s\n", strerror(-ret));
+			return 1;
+		}
+
+		stat_add(&joules, result.energy_uj / 1e6);
+		stat_add(&watts, result.power_uw / 1e6);
+		stat_add(&seconds, result.duration_ns / 1e9);
+
+		if (verbose)
+			fprintf(stderr, "run %u: %.6f J, %.6f W, %.6f s\n", i + 1,
+				result.energy_uj / 1e6, result.power_uw / 1e6,
+				result.duration_ns / 1e9);
+	}
+
+	fprintf(stderr, "\n Energy stats for '%s' (%u runs, %s):\n\n", argv[optind],
+		repeat, syspower_energy_source_str(result.source));
+	fflush(stderr);
+
+	stat_print("energy", "J", &joules);
+	stat_print("power", "W", &watts);
+	stat_print("elapsed", "s", &seconds);
+
+	/* Propagate the (last) command exit status */
+	if (WIFEXITED(status))
+		return WEXITSTATUS(status);
+
+	return 1;
+}
@@ -33,6 +33,9 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	/* Best effort, suspended time is accounted around syspower_suspend */
+	syspower_residency_open(NULL);
+
 	ret = syspower_suspend(SYSPOWER_SLEEP_TYPE_STANDBY);
 	if (ret)
 		ret = syspower_suspend(SYSPOWER_SLEEP_TYPE_MEM);
@@ -48,5 +51,12 @@ int main(int argc, char *argv[])
 	else
 		printf("Wakeup! (unkown reason)\n");
 
+	ret = syspower_residency_percent();
+	if (ret >= 0)
+		printf("Suspended %d%% of the time over the last %u days\n",
+		       ret, SYSPOWER_RESIDENCY_DAYS);
+
+	syspower_residency_close();
+
 	return 0;
 }
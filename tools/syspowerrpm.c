@@ -0,0 +1,65 @@
+#include <syspower.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+void usage(void)
+{
+	printf("Usage: syspowerrpm <option>\n"
+	"  list [bus]                - List runtime PM devices and suspended ratio\n"
+	"  auto <bus|\"all\"> [delay]  - Enable autosuspend, with optional delay (ms)\n"
+	"  on <bus|\"all\">            - Disable autosuspend\n");
+
+	exit(1);
+}
+
+static void list_rpm(const char *bus)
+{
+	const struct syspower_rpm_device *dev;
+	unsigned int i = 0;
+
+	syspower_rpm_sample();
+
+	printf("%-30s %-10s %-10s %-6s %8s %12s %12s\n", "Device", "Bus",
+	       "Status", "Ctrl", "Delay", "Suspended", "Ratio");
+
+	while ((dev = syspower_rpm_get(i++))) {
+		if (bus && strcmp(bus, dev->bus))
+			continue;
+
+		printf("%-30s %-10s %-10s %-6s %8d %10"PRIu64"ms %10u.%u%%\n",
+		       dev->name, dev->bus, syspower_rpm_status_str(dev->status),
+		       dev->autosuspend ? "auto" : "on", dev->autosuspend_delay_ms,
+		       dev->suspended_ms, dev->suspended_permille / 10,
+		       dev->suspended_permille % 10);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	const char *bus = NULL;
+	int ret = 0;
+
+	if (argc < 2)
+		usage();
+
+	if (argc >= 3 && strcmp("all", argv[2]))
+		bus = argv[2];
+
+	if (!strcmp("list", argv[1])) {
+		list_rpm(bus);
+	} else if (!strcmp("auto", argv[1]) && argc >= 3) {
+		ret = syspower_rpm_apply(bus, true, argc >= 4 ? atoi(argv[3]) : -1);
+	} else if (!strcmp("on", argv[1]) && argc >= 3) {
+		ret = syspower_rpm_apply(bus, false, -1);
+	} else {
+		usage();
+	}
+
+	if (ret < 0) {
+		fprintf(stderr, "error: %s\n", strerror(-ret));
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,115 @@
+#include <syspower.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define TOP_MAX 64
+
+void usage(void)
+{
+	printf("Usage: syspowertop [option]\n"
+	"  -i <ms>      - Sampling interval (default 2000ms)\n"
+	"  -n <count>   - Number of processes to show (default 10)\n"
+	"  -s <supply>  - Supply measuring system power (default RAPL or battery)\n"
+	"  -t           - Rank by total energy rather than latest interval\n"
+	"  -1           - Print a single report and exit\n");
+
+	exit(1);
+}
+
+static void report(struct syspower_proc_energy *pe, unsigned int count,
+		   bool interval)
+{
+	const struct syspower_proc_energy_entry *entries[TOP_MAX];
+	struct syspower_proc_energy_stats stats;
+	int i, n;
+
+	syspower_proc_energy_stats(pe, &stats);
+
+	printf("\nSystem %"PRIu64".%03"PRIu64"W, %"PRIu64"mJ total, "
+	       "%"PRIu64"mJ idle, %"PRIu64"mJ exited, %u processes\n",
+	       stats.power_uw / 1000000, stats.power_uw / 1000 % 1000,
+	       stats.energy_uj / 1000, stats.idle_uj / 1000,
+	       stats.exited_uj / 1000, stats.processes);
+
+	printf("%-8s %-16s %8s %12s %12s\n", "PID", "Command", "Ticks",
+	       "Interval", "Total");
+
+	n = syspower_proc_energy_top(pe, entries, count, interval);
+	for (i = 0; i < n; i++) {
+		printf("%-8d %-16s %8"PRIu64" %10"PRIu64"mJ %10"PRIu64"mJ\n",
+		       entries[i]->pid, entries[i]->comm, entries[i]->delta_ticks,
+		       entries[i]->delta_uj / 1000, entries[i]->energy_uj / 1000);
+	}
+
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int interval_ms = 2000, count = 10;
+	struct syspower_proc_energy *pe;
+	const char *supply = NULL;
+	bool total = false, once = false;
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "i:n:s:t1")) != -1) {
+		switch (opt) {
+		case 'i':
+			interval_ms = atoi(optarg);
+			break;
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 's':
+			supply = optarg;
+			break;
+		case 't':
+			total = true;
+			break;
+		case '1':
+			once = true;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (!interval_ms || !count)
+		usage();
+
+	if (count > TOP_MAX)
+		count = TOP_MAX;
+
+	pe = syspower_proc_energy_open(supply);
+	if (!pe) {
+		fprintf(stderr, "Unable to measure system power: %s\n", strerror(errno));
+		return 1;
+	}
+
+	/* First sample is the baseline */
+	ret = syspower_proc_energy_sample(pe);
+
+	while (ret >= 0) {
+		usleep(interval_ms * 1000);
+
+		ret = syspower_proc_energy_sample(pe);
+		if (ret < 0)
+			break;
+
+		report(pe, count, !total);
+		if (once)
+			break;
+	}
+
+	syspower_proc_energy_close(pe);
+
+	if (ret < 0) {
+		fprintf(stderr, "error: %s\n", strerror(-ret));
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,165 @@
+#include <syspower.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+void usage(void)
+{
+	printf("Usage: syspowerwakelock <option>\n"
+	"  lock <name> [timeout_ms]  - Take a kernel wake lock\n"
+	"  unlock <name>             - Release a kernel wake lock\n"
+	"  list                      - List active kernel wake locks\n"
+	"  broker [socket]           - Run the wake lock broker daemon\n"
+	"  hold <name> <cmd> [args]  - Hold a brokered wake lock while cmd runs\n"
+	"  clients [socket]          - List broker clients holding a lock\n"
+	"  top [count] [socket]      - List locks held the longest via the broker\n");
+
+	exit(1);
+}
+
+static void print_client(const struct syspower_broker_client *client, void *data)
+{
+	(void)data;
+
+	printf("%-8d %-6u %-32s %"PRIu64"ms\n", client->pid, client->uid,
+	       client->name, client->held_ms);
+}
+
+struct top_entry {
+	char name[65];
+	struct syspower_wakelock_stats stats;
+};
+
+static struct {
+	struct top_entry *entries;
+	unsigned int count;
+} top;
+
+static void add_top_entry(const struct syspower_wakelock_stats *stats, void *data)
+{
+	struct top_entry *entries;
+
+	(void)data;
+
+	entries = realloc(top.entries, (top.count + 1) * sizeof(*entries));
+	if (!entries)
+		return;
+
+	top.entries = entries;
+	snprintf(entries[top.count].name, sizeof(entries->name), "%s", stats->name);
+	entries[top.count].stats = *stats;
+	top.count++;
+}
+
+static int cmp_top_entry(const void *a, const void *b)
+{
+	const struct top_entry *ea = a, *eb = b;
+
+	if (ea->stats.total_hold_ms == eb->stats.total_hold_ms)
+		return 0;
+
+	return ea->stats.total_hold_ms < eb->stats.total_hold_ms ? 1 : -1;
+}
+
+static int print_top(unsigned int count, const char *path)
+{
+	unsigned int i, j;
+	int ret;
+
+	ret = syspower_broker_wakelock_stats(path, add_top_entry, NULL);
+	if (ret)
+		return ret;
+
+	qsort(top.entries, top.count, sizeof(*top.entries), cmp_top_entry);
+
+	printf("%-32s %8s %10s %10s %10s  %s\n", "Lock", "Count", "Total", "Max",
+	       "Current", "Histogram (<1ms, <2ms, <4ms...)");
+
+	for (i = 0; i < top.count && (!count || i < count); i++) {
+		struct syspower_wakelock_stats *stats = &top.entries[i].stats;
+
+		printf("%-32s %8"PRIu64" %8"PRIu64"ms %8"PRIu64"ms %8"PRIu64"ms ",
+		       top.entries[i].name, stats->acquire_count,
+		       stats->total_hold_ms, stats->max_hold_ms,
+		       stats->current_hold_ms);
+		for (j = 0; j < SYSPOWER_WAKELOCK_HIST_BUCKETS; j++)
+			printf(" %"PRIu64, stats->hist[j]);
+		printf("\n");
+	}
+
+	free(top.entries);
+
+	return 0;
+}
+
+static int hold(const char *name, char *argv[])
+{
+	int fd, status;
+	pid_t pid;
+
+	fd = syspower_broker_lock(NULL, name);
+	if (fd < 0) {
+		fprintf(stderr, "Unable to hold %s: %s\n", name, strerror(-fd));
+		return 1;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return 1;
+	}
+
+	if (!pid) {
+		execvp(argv[0], argv);
+		perror("exec");
+		_exit(127);
+	}
+
+	waitpid(pid, &status, 0);
+	syspower_broker_unlock(fd);
+
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+int main(int argc, char *argv[])
+{
+	int ret = 0;
+
+	if (argc < 2)
+		usage();
+
+	if (!strcmp("lock", argv[1]) && argc >= 3) {
+		ret = syspower_wake_lock(argv[2], argc >= 4 ? atoi(argv[3]) : 0);
+	} else if (!strcmp("unlock", argv[1]) && argc >= 3) {
+		ret = syspower_wake_unlock(argv[2]);
+	} else if (!strcmp("list", argv[1])) {
+		static struct syspower_wake_lock_list list;
+		int i, count = syspower_wake_lock_list(&list);
+
+		for (i = 0; i < count; i++)
+			printf("%s\n", list.names[i]);
+		ret = count < 0 ? count : 0;
+	} else if (!strcmp("broker", argv[1])) {
+		ret = syspower_broker_run(argc >= 3 ? argv[2] : NULL);
+	} else if (!strcmp("hold", argv[1]) && argc >= 4) {
+		return hold(argv[2], &argv[3]);
+	} else if (!strcmp("clients", argv[1])) {
+		printf("%-8s %-6s %-32s %s\n", "PID", "UID", "Lock", "Held");
+		ret = syspower_broker_clients(argc >= 3 ? argv[2] : NULL,
+					      print_client, NULL);
+	} else if (!strcmp("top", argv[1])) {
+		ret = print_top(argc >= 3 ? atoi(argv[2]) : 10,
+				argc >= 4 ? argv[3] : NULL);
+	} else {
+		usage();
+	}
+
+	if (ret) {
+		fprintf(stderr, "error: %s\n", strerror(-ret));
+		return 1;
+	}
+
+	return 0;
+}